@@ -1,13 +1,33 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <poll.h>
+#include "msgfmt.h"
+#include "rules.h"
+#include "stats.h"
+#include "uring.h"
+#include "fed.h"
+#include "tourney.h"
 
 #ifndef PORT
     #define PORT 51621
@@ -16,608 +36,6213 @@
 #define MAX_NAME_LEN 20
 #define MAX_BUF 512
 #define MAX_MESSAGE_LEN 20
+#define MAX_EVENTS 256
+#define IN_BUF_SIZE 256
+#define OUT_CHUNK_SIZE 1024
+#define OUT_IOV_MAX 64
 
+#define TIMER_TICK_MS 100
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+#ifndef TURN_SECONDS
+    #define TURN_SECONDS 30
+#endif
+
+/* Seeds for the matches; 0 picks a different one every run. */
+#ifndef SEED
+    #define SEED 0
+#endif
+
+/* Waiting players are indexed by rating in bands of RATING_BAND points. */
+#define RATING_BAND 50
+#define RATING_BANDS 64
+
+/* Widest rating gap accepted at first, and how it grows while waiting. */
+#ifndef MATCH_WINDOW
+    #define MATCH_WINDOW 100
+#endif
+
+#ifndef MATCH_WIDEN_MS
+    #define MATCH_WIDEN_MS 5000
+#endif
+
+#define MATCH_WIDEN_STEP 100
+
+/* Bytes of recent events a watched match keeps; a power of two. */
+#ifndef FEED_SIZE
+    #define FEED_SIZE 4096
+#endif
+
+/* Times a spectator may fall behind and be skipped ahead before being dropped. */
+#define FEED_MAX_SKIPS 3
+
+/***
+Tournaments, with -t. Registration closes TOURNEY_REGISTER_MS after the
+first player enters, and each round starts TOURNEY_BREAK_MS after the last
+match of the one before it is over. TOURNEY_SHARD runs every tournament,
+so entrants move there.
+***/
+#ifndef TOURNEY_REGISTER_MS
+    #define TOURNEY_REGISTER_MS 60000
+#endif
+
+#ifndef TOURNEY_BREAK_MS
+    #define TOURNEY_BREAK_MS 5000
+#endif
+
+#define TOURNEY_SHARD 0
+/* entry of a player on their way to TOURNEY_SHARD to enter. */
+#define TOURNEY_ENTERING -2
+
+#define MAX_SHARDS 64
+
+#ifndef SHARDS
+    #define SHARDS 0
+#endif
+
+#ifndef LISTEN_BACKLOG
+    #define LISTEN_BACKLOG SOMAXCONN
+#endif
+
+#ifndef MAX_CLIENTS
+    #define MAX_CLIENTS 131072
+#endif
+
+#ifndef NAME_TABLE_SIZE
+    #define NAME_TABLE_SIZE 262144
+#endif
+
+/* Seconds a new connection gets to confirm a name before it is closed. */
+#ifndef HANDSHAKE_SECONDS
+    #define HANDSHAKE_SECONDS 30
+#endif
+
+/* Connections a shard takes off its listener per wakeup. */
+#define ACCEPT_BATCH 256
+
+/***
+Admission control. New connections per second and the burst allowed on
+top, for the whole arena and for each source address, and how many
+connections may sit at the name prompt at once. A rate of 0 turns that
+limit off.
+***/
+#ifndef ADMIT_RATE
+    #define ADMIT_RATE 2000
+#endif
+
+#ifndef ADMIT_BURST
+    #define ADMIT_BURST 4000
+#endif
+
+#ifndef ADMIT_IP_RATE
+    #define ADMIT_IP_RATE 20
+#endif
+
+#ifndef ADMIT_IP_BURST
+    #define ADMIT_IP_BURST 100
+#endif
+
+#ifndef MAX_PENDING_NAMES
+    #define MAX_PENDING_NAMES 8192
+#endif
+
+/* Per-address buckets each shard keeps, as a power of two. */
+#define ADMIT_IP_BITS 12
+#define ADMIT_IP_SLOTS (1 << ADMIT_IP_BITS)
+/* Tokens are counted in millionths of a connection. */
+#define ADMIT_TOKEN 1000000L
+
+/* Idle input buffers each shard keeps for reuse. */
+#ifndef INBUF_POOL_MAX
+    #define INBUF_POOL_MAX 1024
+#endif
+
+#ifndef OUT_HIGHWATER
+    #define OUT_HIGHWATER 65536
+#endif
+
+#define CHUNK_POOL_MAX 1024
+
+/* io_uring backend: submission ring size and provided receive buffers per shard. */
+#define URING_ENTRIES 4096
+#define URING_BUFS 1024
+#define URING_BUF_SIZE 1024
+
+#ifndef METRICS
+    #define METRICS 1
+#endif
+
+#ifndef ADMIN_PORT
+    #define ADMIN_PORT (listen_port + 1)
+#endif
+
+#ifndef LOG_FILE
+    #define LOG_FILE "battle-events.jsonl"
+#endif
+
+#ifndef STATS_FILE
+    #define STATS_FILE "battle-stats.db"
+#endif
+
+/* Hot upgrades go through the Unix socket UPGRADE_SOCK-<port>.sock. */
+#ifndef UPGRADE_SOCK
+    #define UPGRADE_SOCK "battle-upgrade"
+#endif
+
+#define HANDOFF_MAGIC 0x42544855
+/* Bump whenever struct handoff_client changes. */
+#define HANDOFF_VERSION 2
+#define HANDOFF_FD_BATCH 200
+
+/* move_to of a player on the way to another process of the federation. */
+#define SHARD_AWAY MAX_SHARDS
+
+#ifndef LOG_FLUSH_MS
+    #define LOG_FLUSH_MS 200
+#endif
+
+#define LOG_RING_SIZE 16384
+#define LOG_BATCH_MAX 65536
+
+#define HIST_BUCKETS 24
+#define HIST_MIN_SHIFT 8
+
+/***
+Binary protocol for machine clients. A client selects it by sending
+PROTO_MAGIC as its very first bytes; anything else keeps the text menus.
+The welcome text has already gone out by then, so a binary client skips
+everything up to and including "name: " and reads frames from there on.
+Each frame is a length byte counting the type and body, a type byte and a
+fixed-layout body; 16-bit fields are big-endian and hitpoints are signed.
+Commands from the client are the same bytes as in the text protocol.
+***/
+#define PROTO_MAGIC "\0BT1"
+#define PROTO_MAGIC_LEN 4
+#define PROTO_VERSION 1
+#define MAX_FRAME_BODY 64
+
+enum frame_type {
+    F_HELLO = 1,    /* version u8 */
+    F_NAME,         /* why u8: 1 empty, 2 taken, 3 arena full, 4 timed out */
+    F_WAITING,      /* no body */
+    F_MATCH,        /* you_first u8, turn_seconds u8, opponent name */
+    F_STATE,        /* your_turn u8, hitpoints i16, powermoves u8, opponent hitpoints i16 */
+    F_ATTACK,       /* by_you u8, damage u8, power u8, missed u8, target hitpoints i16 */
+    F_RESULT,       /* won u8, opponent_dropped u8 */
+    F_TIME,         /* seconds u16 */
+    F_TIMEOUT,      /* yours u8 */
+    F_SAY,          /* opponent's message */
+    F_SPEAK,        /* what u8: 0 prompt, 1 too long, 2 not sent, 3 empty */
+    F_ANNOUNCE,     /* left u8, name */
+    F_NO_POWER,     /* no body */
+    F_WATCH,        /* found u8; then side to move u8, side 0 hitpoints i16, side 1 hitpoints i16, side 0 name, NUL, side 1 name */
+    F_SEEN_MOVE,    /* side u8, damage u8, power u8, missed u8, timeout u8, target hitpoints i16 */
+    F_SEEN_SAY,     /* side u8, message */
+    F_SEEN_RESULT,  /* winner side u8, loser dropped u8 */
+    F_SKIPPED,      /* no body */
+    F_TOURNEY       /* what u8: 0 entered, 1 closed, 2 bye, 3 won, 4 out, 5 left, 6 called off, 7 champion; round u8, score u8, champion's name */
+};
+
+/* A slot of the name registry; hash is cached to skip most strcmp calls. */
+struct name_slot {
+    unsigned int hash;
+    struct client *client;
+};
+
+/***
+A token bucket for admission control: tokens in millionths of a
+connection and the millisecond they were last topped up. addr is the
+source address a per-address bucket belongs to.
+***/
+struct bucket {
+    in_addr_t addr;
+    unsigned long last_ms;
+    long tokens;
+};
+
+/* A timer in the timing wheel; expires is measured in ticks. */
+struct timer {
+    struct timer *next;
+    struct timer **pprev;
+    unsigned long expires;
+    void (*fn)(struct timer *t);
+};
+
+/***
+Hierarchical timing wheel. Level 0 has one slot per tick, and each level
+above covers WHEEL_SIZE times the span of the one below; timers move down
+a level as their expiry comes within range, so arming and cancelling are
+both constant time.
+***/
+struct timer_wheel {
+    unsigned long now;
+    int count;
+    struct timer *slots[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+/* Immutable bytes queued by reference to many clients at once. */
+struct payload {
+    int refs;
+    int len;
+    char data[];
+};
+
+/***
+One piece of a client's output queue. A private chunk owns OUT_CHUNK_SIZE
+bytes of data that small messages are packed into; a shared chunk is just
+a header pointing at a payload and has no data of its own.
+***/
+struct outchunk {
+    struct outchunk *next;
+    struct payload *shared;
+    int len;
+    int off;
+    char data[];
+};
+
+/***
+A vectored send in flight on io_uring. The chunks it covers are taken off
+the client's queue, so new output can queue up behind them and a dropped
+client's queue can be freed while the kernel still reads these.
+***/
+struct sendop {
+    struct client *client;
+    struct outchunk *chunks;
+    struct msghdr msg;
+    struct iovec iov[OUT_IOV_MAX];
+    struct sendop *next;
+};
+
+/* What an io_uring request is for, kept in the low bits of its user_data. */
+enum ring_op { OP_RECV, OP_POLLOUT, OP_SEND, OP_ACCEPT, OP_WAKE, OP_CANCEL };
+#define OP_MASK 7
+
+/* One encoding of a watched match's events, written round and round. */
+struct feed_ring {
+    uint64_t head;
+    char data[FEED_SIZE];
+};
+
+/***
+Event log of a watched match, created when its first spectator arrives and
+freed when the last one leaves. Every event is encoded once into the text
+ring and once into the frame ring, and each spectator reads the ring for
+its protocol from its own offset, so the players never wait on anyone
+watching. head counts every byte ever written; a spectator more than
+FEED_SIZE behind it has lost events.
+***/
+struct feed {
+    struct client *player[2];
+    struct client *watchers;
+    int count;
+    struct feed_ring text;
+    struct feed_ring frames;
+};
+
+/***
+A connection. Until its name is confirmed this is all a client has: the
+socket, the name being typed, the output queue and the handshake timer,
+which becomes the turn timer once they play. The input buffer is only
+attached while there are unparsed bytes, and everything about playing
+lives in a player record attached when the name is confirmed. On io_uring
+io_ops counts the client's requests in flight, recv_armed says whether
+its multishot receive is one of them and sending is its send, if any.
+***/
 struct client {
-    int fd; 
-    struct in_addr ipaddr; 
-    struct client *next; 
-    char name[MAX_NAME_LEN]; 
-    int in_game; 
-    struct client *last_opponent; 
-    int hitpoints; 
-    int powermoves; 
-    int is_turn; 
+    int fd;
+    unsigned int gen;
+    int home;
+    int shard;
+    struct in_addr ipaddr;
+    struct client *next;
+    struct client *prev;
+    char name[MAX_NAME_LEN];
+    int name_len;
     int name_entered;
-    int is_messaging; 
-    char message[MAX_MESSAGE_LEN + 1]; 
+    int in_game;
+    int closing;
+    int binary;
+    int hello_checked;
+    char *inbuf;
+    int in_start;
+    int in_len;
+    struct outchunk *out_head;
+    struct outchunk *out_tail;
+    int out_bytes;
+    int out_armed;
+    struct client *flush_next;
+    struct client **flush_pprev;
+    struct timer timer;
+    struct player *pl;
+    int io_ops;
+    int recv_armed;
+    struct sendop *sending;
+};
+
+/* A player's match, rating, place in the waiting queue and spectating. */
+struct player {
+    struct client *last_opponent;
+    unsigned int last_opponent_gen;
+    int side;
+    struct match *match;
+    int match_damage;
+    int rating;
+    uint64_t match_id;
+    int is_messaging;
     int message_length;
-    time_t start_time; 
-    int time_left; 
+    char message[MAX_MESSAGE_LEN + 1];
+    int waiting;
+    struct client *wait_next;
+    struct client *wait_prev;
+    struct client *band_next;
+    struct client *band_prev;
+    unsigned long wait_since;
+    struct feed *feed;
+    struct feed *watching;
+    uint64_t feed_off;
+    int feed_partial;
+    int feed_skips;
+    struct client *watch_next;
+    struct client *watch_prev;
+    int watch_shard;
+    struct client *move_next;
+    int move_to;
+    int away_to;
+    int entry;
+    int pairing;
+};
+
+enum log_type { EV_CONNECT, EV_NAME, EV_MATCH_START, EV_ATTACK, EV_TIMEOUT, EV_RESULT, EV_KICK, EV_DISCONNECT, EV_ROUND, EV_TOURNEY };
+
+/***
+One entry of the event log. Everything is copied in by value when the
+event happens, so the writer thread never looks at a live client.
+***/
+struct log_event {
+    uint64_t ts_ms;
+    uint64_t match_id;
+    uint64_t seed;
+    int type;
+    int shard;
+    int a;
+    int b;
+    int c;
+    int d;
+    struct in_addr addr;
+    char player[MAX_NAME_LEN];
+    char other[MAX_NAME_LEN];
+};
+
+/* A slot of the event ring; seq says whose turn the slot is. */
+struct log_slot {
+    uint64_t seq;
+    struct log_event ev;
+};
+
+enum shard_msg_type { MSG_ADOPT, MSG_WATCH, MSG_BROADCAST, MSG_FREEZE, MSG_AWAY, MSG_ARRIVE, MSG_JOIN };
+
+/***
+A message passed to a shard through its lock-free inbox. Messages from
+the federation carry what the coordinator sent in payload, and the
+socket that came with it, if any, in fd.
+***/
+struct shard_msg {
+    struct shard_msg *next;
+    enum shard_msg_type type;
+    struct client *client;
+    struct payload *payload;
+    struct payload *frames;
+    int fd;
+};
+
+#if METRICS
+/***
+Latency histogram with power-of-two buckets: bucket i counts samples under
+2^(i + HIST_MIN_SHIFT) nanoseconds and the last one catches the rest.
+***/
+struct histogram {
+    uint64_t buckets[HIST_BUCKETS + 1];
+    uint64_t sum_ns;
+    uint64_t count;
+};
+
+/***
+A shard's counters. Only the shard's own thread writes them and the admin
+thread only reads, so updates are relaxed atomic stores of the new value
+rather than locked read-modify-writes. clients, spectators, players,
+in_buffers, feeds and chunk_bytes are gauges and may go down.
+***/
+struct metrics {
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t accepted;
+    uint64_t closed;
+    uint64_t commands;
+    uint64_t matches_started;
+    uint64_t matches_finished;
+    uint64_t timeouts;
+    uint64_t matchmaker_calls;
+    uint64_t matchmaker_scanned;
+    uint64_t match_wait_ms;
+    uint64_t rating_gap;
+    uint64_t clients;
+    uint64_t spectators;
+    uint64_t spectator_skips;
+    uint64_t spectators_dropped;
+    uint64_t handshake_timeouts;
+    uint64_t players;
+    uint64_t in_buffers;
+    uint64_t feeds;
+    uint64_t chunk_bytes;
+    uint64_t io_syscalls;
+    uint64_t rejected_ip;
+    uint64_t rejected_rate;
+    uint64_t rejected_pending;
+    uint64_t fed_in;
+    uint64_t fed_out;
+    struct histogram loop;
+    struct histogram command;
+    struct histogram round_start;
+};
+
+#define METRIC_ADD(field, n) metric_add(&self->metrics.field, (uint64_t)(n))
+#define METRIC_START(var) uint64_t var = now_ns()
+#define METRIC_OBSERVE(hist, start) hist_observe(&self->metrics.hist, now_ns() - (start))
+#else
+#define METRIC_ADD(field, n) ((void)0)
+#define METRIC_START(var)
+#define METRIC_OBSERVE(hist, start) ((void)0)
+#endif
+
+/***
+One worker thread of the arena with its own listener, epoll instance,
+clients, waiting queue and turn timers. Only the fields here are touched
+by other shards: the inbox and remote_free stacks are pushed to with
+compare-and-swap, waiting is read to find a shard with idle players,
+band_waiting is read for the metrics page, and wakefd is an eventfd that
+wakes the shard when its inbox gets mail. For a hot upgrade, listenfd and
+clients are left here for the upgrade thread when the shard stops.
+***/
+struct shard {
+    int id;
+    pthread_t thread;
+    int wakefd;
+    struct shard_msg *inbox;
+    struct client *remote_free;
+    int waiting;
+    int band_waiting[RATING_BANDS];
+    struct client *slab;
+    int slab_size;
+    int listenfd;
+    struct client *clients;
+#if METRICS
+    struct metrics metrics;
+#endif
+};
+
+/***
+First thing the old process sends the new one in a hot upgrade, before
+it freezes anything: the new one answers G if it reads records of this
+version and size, N otherwise, and the old one only goes on after a G.
+***/
+struct handoff_hello {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+};
+
+/* Sent once the shards are frozen, before the sockets and records. */
+struct handoff_header {
+    uint32_t magic;
+    int32_t nlisten;
+    int32_t nclients;
+    int32_t out_bytes;
+    uint64_t next_match_id;
+    uint64_t seed_base;
+};
+
+/***
+A client as handed over in a hot upgrade, in fixed-width fields so the
+record does not depend on how either binary lays out its own structs.
+opponent is the index of the record of their last opponent, or -1; the
+match is written out field by field; turn_expires is the tick their turn
+timer runs out, or 0. The output they had not been sent yet is out_len
+bytes at out_off in the blob that follows the records.
+***/
+struct handoff_client {
+    int32_t shard;
+    int32_t opponent;
+    uint32_t ipaddr;
+    char name[MAX_NAME_LEN];
+    int32_t name_len;
+    int32_t name_entered;
+    int32_t in_game;
+    int32_t waiting;
+    int32_t closing;
+    int32_t binary;
+    int32_t hello_checked;
+    int32_t is_messaging;
+    char message[MAX_MESSAGE_LEN + 1];
+    int32_t message_length;
+    char inbuf[IN_BUF_SIZE];
+    int32_t in_start;
+    int32_t in_len;
+    uint64_t match_seed;
+    uint64_t match_rng;
+    int32_t hitpoints[2];
+    int32_t powermoves[2];
+    int32_t turn;
+    int32_t winner;
+    int32_t moves;
+    int32_t side;
+    int32_t match_damage;
+    int32_t rating;
+    uint64_t match_id;
+    uint64_t turn_expires;
+    uint64_t wait_since;
+    int32_t out_off;
+    int32_t out_len;
 };
 
 int bindandlisten(void);
-static struct client *addclient(struct client *top, int fd, struct in_addr addr);
-struct client *removeclient(struct client *top, int fd);
-void broadcast(struct client *top, char *s, int size);
-int handleclient(struct client *p, struct client *top);
-struct client *matchmaker(struct client *top, struct client *new_client);
-void start_match(struct client *p, struct client *opponent, struct client **top);
+int set_nonblocking(int fd);
+void raise_fd_limit(void);
+void *run_shard(void *arg);
+void post_shard_msg(struct shard *sh, enum shard_msg_type type, struct client *p, struct payload *pl, struct payload *frames);
+static struct client *drain_inbox(struct client *top, int epfd);
+static struct client *adopt_client(struct client *top, struct client *p, int epfd, int watch);
+static struct client *balance_shards(struct client *top, int epfd);
+static void broadcast_local(struct client *top, struct payload *pl, struct payload *frames);
+void init_event_log(void);
+void log_close(void);
+void *run_event_log(void *arg);
+static void log_event(int type, const struct client *p, const struct client *other, int a, int b);
+static void log_tourney(int type, const char *name, int a, int b, int c, int d);
+#if METRICS
+static uint64_t now_ns(void);
+static void metric_add(uint64_t *counter, uint64_t n);
+static void hist_observe(struct histogram *h, uint64_t ns);
+void *run_admin(void *arg);
+#endif
+static struct client *accept_clients(struct client *top, int listenfd, int epfd);
+void *run_federation(void *arg);
+static int fed_connect(void);
+static void fed_listen(void);
+static int fed_send(const void *buf, int len, int fd);
+static void fed_report_due(struct timer *t);
+static void fed_report(void);
+static void fed_announce(const char *s, int size, const char *frames, int frames_len);
+static struct client *send_away(struct client *top, const struct fed_away *a, int epfd);
+static void fed_send_player(struct client *p);
+static struct client *arrive(struct client *top, struct payload *pl, int fd, int epfd);
+static void send_on(struct client *p, int to, enum shard_msg_type type);
+static void post_fed_msg(struct shard *sh, enum shard_msg_type type, struct payload *pl, int fd);
+static void push_shard_msg(struct shard *sh, struct shard_msg *msg);
+static struct client *addclient(struct client *top, int fd, struct in_addr addr, int epfd);
+static int admit_client(struct in_addr addr);
+static int take_token(struct bucket *b, int rate, int burst, unsigned long now);
+static void init_client(struct client *p, int fd, struct in_addr addr);
+struct client *removeclient(struct client *top, struct client *p);
+void init_slab(void);
+static struct client *alloc_client(void);
+static void free_client(struct client *p);
+static int played_last(struct client *p, struct client *other);
+static int rating_band(int rating);
+static int search_window(const struct client *p, unsigned long now);
+static void widen_search(struct timer *t);
+void broadcast(struct client *top, struct payload *pl, const char *frames, int frames_len);
+void send_client(struct client *p, const char *s, int size);
+static void send_tmpl(struct client *p, const struct tmpl *t, ...);
+void init_templates(void);
+static int negotiate(struct client *p);
+static int put_frame(char *buf, int type, const char *body, int len);
+static void send_frame(struct client *p, int type, const char *body, int len);
+static void send_state(struct client *p, struct client *opponent);
+static void send_attack(struct client *p, int by_you, int damage, int power, int missed, int target_hp);
+static void send_waiting(struct client *p);
+static void send_result(struct client *p, struct client *opponent, int won);
+static void send_match(struct client *p, struct client *opponent);
+static int put_announce(char *buf, int left, const char *name);
+static void send_payload(struct client *p, struct payload *pl);
+static void mark_pending(struct client *p);
+static struct payload *new_payload(const char *s, int size);
+static struct payload *tmpl_payload(const struct tmpl *t, ...);
+static void release_payload(struct payload *pl);
+static struct outchunk *alloc_chunk(struct payload *shared);
+static void free_chunk(struct outchunk *c);
+static void kick_client(struct client *p);
+static void free_output(struct client *p);
+int flush_client(struct client *p, int epfd);
+void flush_pending(int epfd);
+static int register_socket(struct client *p, int epfd);
+static void unregister_socket(struct client *p, int epfd);
+static void hand_client(struct client *p, int to, enum shard_msg_type type, int epfd);
+#if URING
+static void run_ring_shard(int listenfd);
+static struct client *ring_complete(struct client *head, uint64_t ud, int res, unsigned flags, int listenfd);
+static struct client *quiesce_ring(struct client *head, int listenfd);
+static void ring_accept(int listenfd);
+static void ring_wake(void);
+static void ring_recv(struct client *p);
+static void ring_send(struct client *p);
+static void ring_poll_out(struct client *p);
+static void ring_cancel(uint64_t ud);
+static int ring_flush(struct client *p);
+static int ring_stopped(const struct client *p);
+static void ring_done(struct client *p);
+static int stash_input(struct client *p, const char *data, int len);
+#endif
+int handleclient(struct client *p, struct client *top, int events);
+static void process_input(struct client *p, struct client *top);
+static int play_turn(struct client *p, struct client *top, const char *s, int n);
+static int take_message(struct client *p, const char *s, int n);
+static int enter_name(struct client *p, struct client *top, const char *s, int n);
+struct client *matchmaker(struct client *matchmake);
+void enqueue_waiting(struct client *p);
+void dequeue_waiting(struct client *p);
+static unsigned int name_hash(const char *name);
+struct client *find_name(const char *name);
+int register_name(struct client *p);
+void unregister_name(struct client *p);
+void start_match(struct client *p, struct client *opponent);
 void switch_turn(struct client *p, struct client *opponent);
-void init_battle(struct client *p);
-void disconnect_client(struct client *p, struct client **top, fd_set *allset, int *maxfd);
+static struct fighter *fighter(const struct client *p);
+static int my_turn(const struct client *p);
+static void end_match(struct client *p, struct client *opponent);
+void disconnect_client(struct client *p, struct client **top, int epfd);
+static unsigned long current_ms(void);
+static unsigned long current_tick(void);
+static void timer_place(struct timer *t);
+void timer_arm(struct timer *t, long ms);
+void timer_cancel(struct timer *t);
+int timer_remaining(struct timer *t);
+static void timer_arm_all(struct timer **timers, int n, long ms);
+void run_timers(void);
+int next_timeout(void);
+static void turn_expired(struct timer *t);
+static void handshake_expired(struct timer *t);
+static void promote_client(struct client *p);
+static int lobby_command(struct client *p, const char *s, int n);
+static int take_watch_name(struct client *p, const char *s, int n);
+static void return_to_lobby(struct client *p);
+static void watch_player(struct client *p, struct client *q);
+static void stop_watching(struct client *p);
+static struct client *send_watchers(struct client *top, int epfd);
+static void join_tournament(struct client *p);
+static void enter_tournament(struct client *p);
+static void leave_tournament(struct client *p);
+static void send_tourney(struct client *p, int what, int round, int score);
+static void finish_pairing(struct client *winner, struct client *loser, int dropped);
+static void round_done(void);
+static void tourney_timer_due(struct timer *t);
+static struct client *run_tournament(struct client *top);
+static void start_round(void);
+static void end_tournament(struct client *top, int called_off);
+static void seat_match(struct client *p, struct client *opponent, struct match *m, uint64_t match_id);
+static void tell_match(struct client *p, struct client *opponent, struct payload *started);
+static void feed_append(struct feed *f, const char *text, int text_len, const char *frame, int frame_len);
+static void watch_move(struct client *p, struct client *opponent, const struct move_result *r);
+static void watch_say(struct client *p);
+static void watch_result(struct client *winner, struct client *loser, int dropped);
+static struct feed_ring *feed_ring(const struct client *p);
+static int flush_feed(struct client *p);
+static int skip_feed(struct client *p, struct feed_ring *ring);
+static void take_over(void);
+static struct client *restore_clients(struct client *top, int epfd);
+static struct client *revive_client(struct handoff_client *r, int fd, int epfd);
+static void serve_upgrades(void);
+static int offer_handoff(int conn);
+static int valid_record(const struct handoff_client *r);
+static int hand_off(int conn);
+static void pack_client(struct client *p, struct handoff_client *r);
+static void freeze_shards(void);
+static int send_fds(int sock, const int *fds, int n);
+static int recv_fds(int sock, int *fds, int n);
+static int write_all(int fd, const void *buf, size_t len);
+static int read_all(int fd, void *buf, size_t len);
+
+/* Port the arena listens on: PORT unless -p says otherwise. */
+static int listen_port = PORT;
+
+/***
+Helps setup the TCP server on listen_port, PORT 51621 (My Port) by default.
+Creates a socket and binds it to a PORT, and listens for any connections.
+SO_REUSEPORT lets every shard bind its own listener on the same port so
+the kernel spreads new connections between them. The backlog is set by
+LISTEN_BACKLOG.
+If success, it listens on the port, and returns a file descriptor.
+On failure it prints error to std-error and exits.
+***/
+int bindandlisten(void) {
+    int listenfd;
+    struct sockaddr_in serveraddr;
+    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+    int yes = 1;
+    if ((setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))) == -1) {
+        perror("setsockopt");
+        exit(1);
+    }
+    if ((setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int))) == -1) {
+        perror("setsockopt");
+        exit(1);
+    }
+    memset(&serveraddr, 0, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY); 
+    serveraddr.sin_port = htons(listen_port); 
+    if (bind(listenfd, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    if (listen(listenfd, LISTEN_BACKLOG) < 0) { 
+        perror("listen");
+        exit(1);
+    }
+    return listenfd;
+}
+
+/***
+Puts a file descriptor into non-blocking mode so reads and writes return
+EAGAIN instead of stalling the event loop.
+int fd -> File descriptor to change
+Return -> 0 on success, -1 on failure
+***/
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        return -1;
+    }
+    return 0;
+}
+
+/***
+Raises the soft open file limit to the hard limit, so the arena is not
+capped at the usual 1024 descriptors when thousands of players connect.
+***/
+void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+            perror("setrlimit");
+        }
+    }
+}
+
+/* The arena's shards; nshards is fixed before any of them starts. */
+static struct shard shards[MAX_SHARDS];
+static int nshards = 1;
+static __thread struct shard *self;
+
+/***
+Federation. fed_fd is the connection to the coordinator; every shard sends
+on it, each message one datagram. The federation thread reconnects by
+putting the new connection on the same descriptor with dup3, so a shard
+never sends on a closed or reused one, and fed_up says whether anyone is
+listening. Each shard reports every FED_REPORT_MS, at the end of the loop
+iteration fed_timer marks as due.
+***/
+static const char *fed_path = NULL;
+static int fed_fd = -1;
+static int fed_up = 0;
+static __thread struct timer fed_timer;
+static __thread int fed_due = 0;
+
+/***
+Tournaments. tourney_open is read by every shard to tell whether players
+may enter; everything else is only touched by TOURNEY_SHARD. A round's
+matches live side by side in round_matches, and tourney_timer marks when
+registration closes or the next round is due.
+***/
+static int tourney_on = 0;
+static int tourney_open = 0;
+static struct tourney tourney;
+static struct match *round_matches = NULL;
+static struct timer **round_timers = NULL;
+static unsigned long round_started_ms;
+static int round_setup_us;
+static int round_count;
+static __thread struct timer tourney_timer;
+static __thread int tourney_due = 0;
+
+/* Runs widen_search every MATCH_WIDEN_MS. */
+static __thread struct timer widen_timer;
+
+/* Set when this shard has been asked to stop for a hot upgrade. */
+static __thread int freezing = 0;
+
+/***
+What a hot upgrade handed over, kept until every shard has restored its
+part: the records, their output blob and sockets, the old listeners, and
+the client each record became.
+***/
+static struct handoff_client *handoff = NULL;
+static int handoff_count = 0;
+static char *handoff_out = NULL;
+static int handoff_out_bytes = 0;
+static int *handoff_fds = NULL;
+static struct client **handoff_restored = NULL;
+static int handoff_listen[MAX_SHARDS];
+static int handoff_nlisten = 0;
+static int restored_shards = 0;
+
+/* Ids for the event log, shared so they are unique across shards. */
+static uint64_t next_match_id = 0;
+
+/* Match n is played from seed_base + n, so a logged seed replays it. */
+static uint64_t seed_base;
+
+/* Markers for the epoll entries that are not clients. */
+static char listen_tag;
+static char wake_tag;
+
+#if URING
+/* Set by -i when the kernel can do it: every shard runs on io_uring. */
+static int use_uring = 0;
+
+/***
+This shard's ring, the send operations it keeps for reuse, how many of
+its requests have a completion still to come, and whether it is waiting
+for them all to finish before a hot upgrade.
+***/
+static __thread struct uring ring;
+static __thread struct sendop *free_sendops = NULL;
+static __thread int ring_inflight = 0;
+static __thread int ring_quiescing = 0;
+#endif
+
+/* Every text message with variable parts, compiled once by init_templates. */
+static struct tmpl t_remaining, t_attacked, t_attacked_by, t_missed_by;
+static struct tmpl t_defeated, t_defeated_by, t_entered, t_entered_pair, t_left, t_dropped;
+static struct tmpl t_your_turn, t_waiting_for, t_menu, t_says, t_timeup;
+static struct tmpl t_started, t_matched_first, t_matched_second, t_record;
+static struct tmpl t_watching, t_not_playing, t_seen_attack, t_seen_timeout, t_seen_won, t_seen_dropped;
+static struct tmpl t_tourney_entered, t_tourney_through, t_tourney_score, t_tourney_bye, t_tourney_won, t_round_started;
+
+/***
+Compiles the message templates. Runs before any shard starts; the
+templates are read-only after that and shared by every thread.
+***/
+void init_templates(void) {
+    tmpl_compile(&t_remaining, "\nRemaining time: %d seconds.\n");
+    tmpl_compile(&t_attacked, "\nYou attacked %s for %d damage.\n");
+    tmpl_compile(&t_attacked_by, "%s attacked you for %d damage.\n");
+    tmpl_compile(&t_missed_by, "%s's power move missed!\n");
+    tmpl_compile(&t_defeated, "You defeated %s! Congratulations!\n");
+    tmpl_compile(&t_defeated_by, "%s defeated you. Better luck next time!\n");
+    tmpl_compile(&t_entered, "%s has entered the arena.\n");
+    tmpl_compile(&t_entered_pair, "%s has entered the arena.\n%s has entered the arena.\n");
+    tmpl_compile(&t_left, "%s has left the arena.\n");
+    tmpl_compile(&t_dropped, "%s has dropped. You Won! You are back in the arena waiting for a new opponent.\n");
+    tmpl_compile(&t_your_turn, "\nIt's your turn\n\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints: %d\n\n(a)ttack\n(p)owermove\n(s)peak\n(t)ime left\n\n");
+    tmpl_compile(&t_waiting_for, "Waiting for %s to make a move...\n");
+    tmpl_compile(&t_menu, "\n\nYour hitpoints: %d\nYour powermoves: %d\nOpponent's hitpoints: %d\n\n(a)ttack\n(p)owermove\n(s)peak\n(t)ime left\n\n");
+    tmpl_compile(&t_says, "%s says: %s\n");
+    tmpl_compile(&t_timeup, "\nTime's up! %s didn't make a move in time. 0 damage dealt. It's now your turn.\n");
+    tmpl_compile(&t_started, "Match started! Remember during your turn you have %d seconds to attack.\n");
+    tmpl_compile(&t_matched_first, "You are matched with %s! Let the battle begin!\nYou go first.\n");
+    tmpl_compile(&t_matched_second, "You are matched with %s! Let the battle begin!\nYou go second.\n");
+    tmpl_compile(&t_record, "Welcome back! Your rating: %d. Your record: %d wins, %d losses, %d damage dealt.\n");
+    tmpl_compile(&t_watching, "You are watching %s (%d hitpoints) against %s (%d hitpoints). Press q to stop watching.\n");
+    tmpl_compile(&t_not_playing, "%s is not in a match.\n");
+    tmpl_compile(&t_seen_attack, "%s attacked %s for %d damage. %s has %d hitpoints left.\n");
+    tmpl_compile(&t_seen_timeout, "%s didn't make a move in time.\n");
+    tmpl_compile(&t_seen_won, "%s defeated %s!\n");
+    tmpl_compile(&t_seen_dropped, "%s has dropped. %s wins!\n");
+    tmpl_compile(&t_tourney_entered, "\nYou entered the tournament, which starts in %d seconds. Press l to leave it.\n");
+    tmpl_compile(&t_tourney_through, "You are through to round %d of the tournament.\n");
+    tmpl_compile(&t_tourney_score, "Your tournament score after round %d: %d.\n");
+    tmpl_compile(&t_tourney_bye, "\nYou have a bye in round %d of the tournament. Your score: %d.\n");
+    tmpl_compile(&t_tourney_won, "%s won the tournament!\n");
+    tmpl_compile(&t_round_started, "\nTournament round %d of %d!\nMatch started! Remember during your turn you have %d seconds to attack.\n");
+}
+
+/***
+Initalizes a server state and starts the arena's shards, one worker
+thread each. SHARDS picks how many; 0 means one per online CPU.
+Every shard gets its own share of the client slab and an eventfd that
+other shards use to wake it, then runs run_shard until the server stops.
+With -p the arena listens on another port than PORT, and with -c it joins
+the federation run by the coordinator on that Unix socket. With -t players
+can enter tournaments of that format from the lobby.
+With -u the server takes over from the one already running on the port: it
+receives that server's sockets and clients, and every shard restores its
+share of them before accepting anyone new. The main thread then waits for
+the next upgrade in serve_upgrades. With -i the shards do their I/O on
+io_uring instead of epoll, if the kernel can; otherwise epoll is used.
+***/
+int main(int argc, char **argv) {
+    int i, opt, upgrade = 0, want_uring = 0;
+    struct timespec start, end;
+    const char *backend = "epoll";
+    while ((opt = getopt(argc, argv, "uip:c:t:")) != -1) {
+        if (opt == 'u') {
+            upgrade = 1;
+        } else if (opt == 'i') {
+            want_uring = 1;
+        } else if (opt == 'p' && atoi(optarg) > 0 && atoi(optarg) < 65535) {
+            listen_port = atoi(optarg);
+        } else if (opt == 'c') {
+            fed_path = optarg;
+        } else if (opt == 't' && (strcmp(optarg, "elimination") == 0 || strcmp(optarg, "swiss") == 0)) {
+            tourney_on = 1;
+            tourney_init(&tourney, optarg[0] == 's' ? TOURNEY_SWISS : TOURNEY_ELIMINATION);
+            tourney_open = 1;
+        } else {
+            fprintf(stderr, "usage: %s [-u] [-i] [-p port] [-c coordinator socket] [-t elimination|swiss]\n", argv[0]);
+            exit(1);
+        }
+    }
+#if URING
+    if (want_uring && !(use_uring = uring_supported())) {
+        fprintf(stderr, "io_uring is not available, using epoll\n");
+    }
+    if (use_uring) {
+        backend = "io_uring";
+    }
+#else
+    if (want_uring) {
+        fprintf(stderr, "Built without io_uring, using epoll\n");
+    }
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    raise_fd_limit();
+    signal(SIGPIPE, SIG_IGN);
+    init_templates();
+    seed_base = SEED != 0 ? (uint64_t)SEED : ((uint64_t)time(NULL) << 20) ^ (uint64_t)getpid();
+    if (upgrade) {
+        take_over();
+    }
+    init_event_log();
+    stats_open(STATS_FILE);
+    nshards = SHARDS > 0 ? SHARDS : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nshards < 1) {
+        nshards = 1;
+    }
+    if (nshards > MAX_SHARDS) {
+        nshards = MAX_SHARDS;
+    }
+    for (i = 0; i < nshards; i++) {
+        shards[i].id = i;
+        shards[i].slab_size = MAX_CLIENTS / nshards > 0 ? MAX_CLIENTS / nshards : 1;
+        if ((shards[i].wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            perror("eventfd");
+            exit(1);
+        }
+        shards[i].listenfd = i < handoff_nlisten ? handoff_listen[i] : -1;
+    }
+    for (i = nshards; i < handoff_nlisten; i++) {
+        close(handoff_listen[i]);
+    }
+    for (i = 0; i < nshards; i++) {
+        if (pthread_create(&shards[i].thread, NULL, run_shard, &shards[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+#if METRICS
+    pthread_t admin;
+    if (pthread_create(&admin, NULL, run_admin, NULL) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
+        exit(1);
+    }
+    pthread_detach(admin);
+#endif
+    if (handoff != NULL) {
+        struct timespec pause = {0, 1000000};
+        while (__atomic_load_n(&restored_shards, __ATOMIC_ACQUIRE) < nshards) {
+            nanosleep(&pause, NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("Took over %d clients in %.1f ms\n", handoff_count,
+               (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+        free(handoff);
+        free(handoff_out);
+        free(handoff_fds);
+        free(handoff_restored);
+        handoff = NULL;
+    }
+    if (fed_path != NULL) {
+        pthread_t fed;
+        if (pthread_create(&fed, NULL, run_federation, NULL) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+        pthread_detach(fed);
+    }
+    printf("Server listening on port %d with %d shard%s on %s\n", listen_port, nshards, nshards == 1 ? "" : "s", backend);
+    printf("Each connection holds %d bytes, plus %d for a named player and %d while reading\n",
+           (int)sizeof(struct client), (int)sizeof(struct player), IN_BUF_SIZE);
+    fflush(stdout);
+    serve_upgrades();
+    return 0;
+}
+
+/***
+Runs one shard of the arena and handles its TCP connections.
+Uses listen_port and stores client IP address to server, and handles 
+disconnection as well. An epoll instance is used for handling multiple
+clients: every client socket is registered edge-triggered with a pointer
+to its struct client, so a wakeup only touches the clients that are ready.
+The listening socket and the wake eventfd are registered with tags.
+Takes accept_clients, handleclient, and disconnect_client to process
+clients. Turn timers are run from the timing wheel, which also sets how
+long epoll_wait may sleep. Everything sent while handling a batch of events
+is queued and written out at the end of the iteration by flush_pending,
+then waiting players may be handed to another shard by balance_shards.
+Each iteration's work, not counting the wait, goes into the loop histogram.
+A shard started by a hot upgrade reuses the old server's listener and
+restores its clients first. When asked to freeze for an upgrade it writes
+out what it can, leaves its clients and listener in its struct shard and
+stops. With -i the shard runs run_ring_shard instead.
+void *arg -> The struct shard this thread runs
+***/
+void *run_shard(void *arg) {
+    int listenfd, epfd, nready, i;
+    struct epoll_event ev, events[MAX_EVENTS];
+    struct client *head = NULL, *p;
+    self = (struct shard *)arg;
+    init_slab();
+    listenfd = self->listenfd >= 0 ? self->listenfd : bindandlisten();
+    widen_timer.fn = widen_search;
+    widen_timer.pprev = NULL;
+    timer_arm(&widen_timer, MATCH_WIDEN_MS);
+    if (fed_path != NULL) {
+        fed_timer.fn = fed_report_due;
+        fed_timer.pprev = NULL;
+        timer_arm(&fed_timer, FED_REPORT_MS);
+    }
+    tourney_timer.fn = tourney_timer_due;
+    tourney_timer.pprev = NULL;
+#if URING
+    if (use_uring) {
+        run_ring_shard(listenfd);
+        return NULL;
+    }
+#endif
+    if ((epfd = epoll_create1(0)) < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    if (set_nonblocking(listenfd) < 0) {
+        exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listen_tag;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wake_tag;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, self->wakefd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    if (handoff != NULL) {
+        head = restore_clients(head, epfd);
+        __atomic_add_fetch(&restored_shards, 1, __ATOMIC_RELEASE);
+    }
+    while (1) {
+        nready = epoll_wait(epfd, events, MAX_EVENTS, next_timeout());
+        METRIC_ADD(io_syscalls, 1);
+        if (nready < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+            }
+            continue; 
+        }
+        METRIC_START(loop_start);
+        run_timers();
+        head = run_tournament(head);
+        for (i = 0; i < nready; i++) {
+            p = events[i].data.ptr;
+            if (events[i].data.ptr == &listen_tag) { 
+                head = accept_clients(head, listenfd, epfd);
+                continue;
+            }
+            if (events[i].data.ptr == &wake_tag) {
+                head = drain_inbox(head, epfd);
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && (p->out_head != NULL || (p->pl != NULL && p->pl->watching != NULL))) {
+                flush_client(p, epfd);
+            }
+            if ((events[i].events & ~EPOLLOUT) && handleclient(p, head, events[i].events) == -1) {
+                disconnect_client(p, &head, epfd); 
+            }
+        }
+        flush_pending(epfd);
+        head = send_watchers(head, epfd);
+        if (freezing) {
+            self->clients = head;
+            self->listenfd = listenfd;
+            close(epfd);
+            return NULL;
+        }
+        head = balance_shards(head, epfd);
+        fed_report();
+        METRIC_OBSERVE(loop, loop_start);
+    }
+    close(epfd);
+    close(listenfd);
+    return NULL;
+}
+
+/***
+Takes up to ACCEPT_BATCH waiting connections off a non-blocking listener,
+each one non-blocking already from accept4. The listener is registered
+level-triggered, so a backlog bigger than one batch wakes the shard again
+after the clients already connected had their turn, and a reconnect storm
+never holds up a match for longer than one batch.
+struct client *top -> First client in linked list
+int listenfd -> This shard's listening socket
+int epfd -> epoll instance new clients are registered with
+Return -> A pointer to top which is first client in linked list
+***/
+static struct client *accept_clients(struct client *top, int listenfd, int epfd) {
+    struct sockaddr_in addr;
+    socklen_t addrlen;
+    int i, fd;
+    for (i = 0; i < ACCEPT_BATCH; i++) {
+        addrlen = sizeof(addr);
+        fd = accept4(listenfd, (struct sockaddr *)&addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        METRIC_ADD(io_syscalls, 1);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept4");
+            }
+            break;
+        }
+        METRIC_ADD(accepted, 1);
+        top = addclient(top, fd, addr.sin_addr, epfd);
+    }
+    return top;
+}
+
+/* Connections of this shard still at the name prompt. */
+static __thread int pending_names = 0;
+/* Clients in this shard's list, as reported to the coordinator. */
+static __thread int client_count = 0;
+/* The shard's bucket for the whole arena and its per-address buckets. */
+static __thread struct bucket admit_bucket;
+static __thread struct bucket admit_ips[ADMIT_IP_SLOTS];
+
+/***
+Decides whether a new connection may come in. It is turned away when too many
+connections are still choosing a name, when its address has used up its
+bucket, or when the arena as a whole has. Each shard enforces its share of
+every limit on its own: SO_REUSEPORT spreads connections, including the
+ones from a single address, over the shards by source port. Addresses map
+straight onto ADMIT_IP_SLOTS buckets, and one that takes over another's
+slot starts with a full bucket.
+struct in_addr addr -> Source address of the connection
+Return -> 1 if it is let in, 0 if it is turned away
+***/
+static int admit_client(struct in_addr addr) {
+    unsigned long now = current_ms();
+    struct bucket *b;
+    if (pending_names >= (MAX_PENDING_NAMES + nshards - 1) / nshards) {
+        METRIC_ADD(rejected_pending, 1);
+        return 0;
+    }
+    b = &admit_ips[(uint32_t)(addr.s_addr * 2654435761u) >> (32 - ADMIT_IP_BITS)];
+    if (b->addr != addr.s_addr) {
+        b->addr = addr.s_addr;
+        b->last_ms = 0;
+    }
+    if (ADMIT_IP_RATE > 0 && !take_token(b, ADMIT_IP_RATE, ADMIT_IP_BURST, now)) {
+        METRIC_ADD(rejected_ip, 1);
+        return 0;
+    }
+    if (ADMIT_RATE > 0 && !take_token(&admit_bucket, ADMIT_RATE, ADMIT_BURST, now)) {
+        if (ADMIT_IP_RATE > 0) {
+            b->tokens += ADMIT_TOKEN;
+        }
+        METRIC_ADD(rejected_rate, 1);
+        return 0;
+    }
+    return 1;
+}
+
+/***
+Tops a bucket up for the time since it was last used and takes one
+connection's worth of tokens from it, if it holds that many. A bucket
+never used, or idle long enough to have filled up, starts full.
+struct bucket *b -> Bucket
+int rate -> Connections per second across the arena
+int burst -> Connections the arena's bucket holds
+unsigned long now -> Current time in milliseconds
+Return -> 1 if a token was taken, 0 if the bucket ran dry
+***/
+static int take_token(struct bucket *b, int rate, int burst, unsigned long now) {
+    long cap = (long)burst * ADMIT_TOKEN / nshards;
+    if (cap < ADMIT_TOKEN) {
+        cap = ADMIT_TOKEN;
+    }
+    if (b->last_ms != 0 && now - b->last_ms < (unsigned long)(burst / rate + 1) * 1000) {
+        b->tokens += (long)(now - b->last_ms) * rate * (ADMIT_TOKEN / 1000) / nshards;
+    } else {
+        b->tokens = cap;
+    }
+    b->last_ms = now;
+    if (b->tokens > cap) {
+        b->tokens = cap;
+    }
+    if (b->tokens < ADMIT_TOKEN) {
+        return 0;
+    }
+    b->tokens -= ADMIT_TOKEN;
+    return 1;
+}
+
+/***
+Adds a new client to the front of the linked list of clients and queues a
+welcome message, once admit_client has let it in. The client is given a
+slot from the client slab; if the slab is full the connection is turned
+away. The client socket is registered with the shard's backend by
+register_socket.
+struct client *top -> First client in linked list 
+int fd -> File descriptor of client connection
+struct in_addr addr -> IP address of new client
+int epfd -> epoll instance the client is registered with
+Return -> A pointer to top which is first client in linked list
+***/
+static struct client *addclient(struct client *top, int fd, struct in_addr addr, int epfd) {
+    struct client *newclient = NULL;
+    const char *sorry = NULL;
+    if (!admit_client(addr)) {
+        sorry = "Sorry, the arena is busy, please try again shortly.\n";
+    } else if ((newclient = alloc_client()) == NULL) {
+        sorry = "Sorry, the arena is full.\n";
+    }
+    if (sorry != NULL) {
+        if (write(fd, sorry, strlen(sorry)) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("write");
+        }
+        close(fd);
+        return top;
+    }
+    init_client(newclient, fd, addr);
+    if (register_socket(newclient, epfd) < 0) {
+        perror("epoll_ctl");
+        close(fd);
+        pending_names--;
+        free_client(newclient);
+        return top;
+    }
+    METRIC_ADD(clients, 1);
+    log_event(EV_CONNECT, newclient, NULL, 0, 0);
+    const char *welcome = "Welcome! Please enter your name: ";
+    send_client(newclient, welcome, strlen(welcome));
+    newclient->next = top;
+    if (top != NULL) {
+        top->prev = newclient;
+    }
+    client_count++;
+    return newclient;
+}
+
+/***
+Puts a freshly allocated client slot into the state of a new connection:
+no player record, no input buffer, and HANDSHAKE_SECONDS to confirm a name.
+struct client *p -> Slot from alloc_client
+int fd -> File descriptor of client connection
+struct in_addr addr -> IP address of the client
+***/
+static void init_client(struct client *p, int fd, struct in_addr addr) {
+    p->fd = fd;
+    p->ipaddr = addr;
+    p->prev = NULL;
+    memset(p->name, 0, sizeof(p->name));
+    p->name_len = 0;
+    p->name_entered = 0;
+    p->in_game = 0;
+    p->closing = 0;
+    p->binary = 0;
+    p->hello_checked = 0;
+    p->inbuf = NULL;
+    p->in_start = 0;
+    p->in_len = 0;
+    p->out_head = NULL;
+    p->out_tail = NULL;
+    p->out_bytes = 0;
+    p->out_armed = 0;
+    p->flush_next = NULL;
+    p->flush_pprev = NULL;
+    p->pl = NULL;
+    p->io_ops = 0;
+    p->recv_armed = 0;
+    p->sending = NULL;
+    __atomic_store_n(&p->shard, self->id, __ATOMIC_RELAXED);
+    p->timer.pprev = NULL;
+    p->timer.fn = handshake_expired;
+    timer_arm(&p->timer, HANDSHAKE_SECONDS * 1000);
+    pending_names++;
+}
+
+/***
+Gives a client whose name was just confirmed a player record, and turns
+their handshake timer into the turn timer.
+struct client *p -> Client with a newly registered name
+***/
+static void promote_client(struct client *p) {
+    struct player *pl = (struct player *)malloc(sizeof(struct player));
+    if (pl == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    pl->last_opponent = NULL;
+    pl->last_opponent_gen = 0;
+    pl->side = 0;
+    pl->match = NULL;
+    pl->match_damage = 0;
+    pl->rating = STATS_RATING_START;
+    pl->match_id = 0;
+    pl->is_messaging = 0;
+    pl->message_length = 0;
+    memset(pl->message, 0, sizeof(pl->message));
+    pl->waiting = 0;
+    pl->wait_next = NULL;
+    pl->wait_prev = NULL;
+    pl->band_next = NULL;
+    pl->band_prev = NULL;
+    pl->wait_since = 0;
+    pl->feed = NULL;
+    pl->watching = NULL;
+    pl->watch_next = NULL;
+    pl->watch_prev = NULL;
+    pl->watch_shard = -1;
+    pl->move_next = NULL;
+    pl->move_to = -1;
+    pl->away_to = -1;
+    pl->entry = -1;
+    pl->pairing = -1;
+    p->pl = pl;
+    timer_cancel(&p->timer);
+    p->timer.fn = turn_expired;
+    pending_names--;
+    METRIC_ADD(players, 1);
+}
+
+/* Input buffers not attached to any client, kept for reuse. */
+static __thread char *free_inbufs = NULL;
+static __thread int free_inbuf_count = 0;
+
+/***
+Attaches an input buffer to a client that is about to read.
+struct client *p -> Client without a buffer
+***/
+static void attach_inbuf(struct client *p) {
+    if (free_inbufs != NULL) {
+        p->inbuf = free_inbufs;
+        free_inbufs = *(char **)p->inbuf;
+        free_inbuf_count--;
+    } else if ((p->inbuf = (char *)malloc(IN_BUF_SIZE)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    METRIC_ADD(in_buffers, 1);
+}
+
+/***
+Takes the input buffer back from a client that has nothing left to parse,
+so idle clients hold none. Up to INBUF_POOL_MAX are kept for reuse.
+struct client *p -> Client with an empty buffer, or none
+***/
+static void release_inbuf(struct client *p) {
+    if (p->inbuf == NULL) {
+        return;
+    }
+    if (free_inbuf_count < INBUF_POOL_MAX) {
+        *(char **)p->inbuf = free_inbufs;
+        free_inbufs = p->inbuf;
+        free_inbuf_count++;
+    } else {
+        free(p->inbuf);
+    }
+    p->inbuf = NULL;
+    p->in_start = 0;
+    METRIC_ADD(in_buffers, -1);
+}
+
+/***
+Reads everything the client has sent into its input ring buffer and runs
+the game logic over it. The socket is edge-triggered, so reading continues
+until the kernel has nothing more for us; each read pulls in as much as the
+ring can hold and the parser then consumes all of it in one pass. The
+buffer is attached for the read and goes back once everything is parsed.
+struct client *p -> Pointer to a clients struct information
+struct client *top -> Front of a client list
+int events -> epoll events reported for the client's socket
+Return -> Return 0 on success, otherwise -1 for client disconnection
+***/
+int handleclient(struct client *p, struct client *top, int events) {
+    if (p->closing) {
+        return -1;
+    }
+    while (1) {
+        struct iovec iov[2];
+        if (p->inbuf == NULL) {
+            attach_inbuf(p);
+        }
+        int tail = (p->in_start + p->in_len) % IN_BUF_SIZE;
+        int space = IN_BUF_SIZE - p->in_len;
+        int iovcnt = 1;
+        iov[0].iov_base = p->inbuf + tail;
+        if (tail + space > IN_BUF_SIZE) {
+            iov[0].iov_len = IN_BUF_SIZE - tail;
+            iov[1].iov_base = p->inbuf;
+            iov[1].iov_len = space - iov[0].iov_len;
+            iovcnt = 2;
+        } else {
+            iov[0].iov_len = space;
+        }
+        ssize_t len = readv(p->fd, iov, iovcnt);
+        METRIC_ADD(io_syscalls, 1);
+        if (len > 0) {
+            METRIC_ADD(bytes_in, len);
+            p->in_len += len;
+            process_input(p, top);
+            /* The client is moving to another shard; that shard reads the rest. */
+            if (p->pl != NULL && p->pl->watch_shard >= 0) {
+                return 0;
+            }
+            /* A short read emptied the socket; a later arrival is a new edge. */
+            if (len < space && !(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                return 0;
+            }
+        } else if (len == 0) {
+            return -1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (p->in_len == 0) {
+                release_inbuf(p);
+            }
+            return 0;
+        } else if (errno != EINTR) {
+            perror("read");
+            return -1;
+        }
+    }
+}
+
+/***
+Parses the bytes waiting in a client's input buffer and hands them to the
+game logic until the buffer is empty, or until the client is on its way to
+another shard to watch a match there. Name entry, speak messages and the
+name of a player to watch take a whole run of bytes at once; every other
+byte is a single command. Each command is counted and timed into the
+command histogram.
+struct client *p -> Client whose input is parsed
+struct client *top -> Front of a client list
+***/
+static void process_input(struct client *p, struct client *top) {
+    if (!p->hello_checked && p->in_len > 0 && !negotiate(p)) {
+        return;
+    }
+    while (p->in_len > 0 && (p->pl == NULL || p->pl->watch_shard < 0)) {
+        char *s = p->inbuf + p->in_start;
+        int n = p->in_len;
+        int used;
+        if (p->in_start + n > IN_BUF_SIZE) {
+            n = IN_BUF_SIZE - p->in_start;
+        }
+        METRIC_START(command_start);
+        if (p->in_game) {
+            used = play_turn(p, top, s, n);
+        } else if (!p->name_entered) {
+            used = enter_name(p, top, s, n);
+        } else {
+            used = lobby_command(p, s, n);
+        }
+        METRIC_ADD(commands, 1);
+        METRIC_OBSERVE(command, command_start);
+        p->in_start = (p->in_start + used) % IN_BUF_SIZE;
+        p->in_len -= used;
+    }
+    if (p->in_len == 0) {
+        release_inbuf(p);
+    }
+}
+
+/***
+Looks at the first bytes a client sends to pick its protocol. A client
+that opens with PROTO_MAGIC is switched to binary frames and greeted with
+F_HELLO; everyone else stays on the text protocol.
+struct client *p -> Client that has just sent its first bytes
+Return -> 1 once the protocol is settled, 0 if more bytes are needed
+***/
+static int negotiate(struct client *p) {
+    char magic[PROTO_MAGIC_LEN];
+    char version = PROTO_VERSION;
+    int i;
+    if (p->inbuf[p->in_start] != PROTO_MAGIC[0]) {
+        p->hello_checked = 1;
+        return 1;
+    }
+    if (p->in_len < PROTO_MAGIC_LEN) {
+        return 0;
+    }
+    for (i = 0; i < PROTO_MAGIC_LEN; i++) {
+        magic[i] = p->inbuf[(p->in_start + i) % IN_BUF_SIZE];
+    }
+    p->hello_checked = 1;
+    if (memcmp(magic, PROTO_MAGIC, PROTO_MAGIC_LEN) == 0) {
+        p->binary = 1;
+        p->in_start = (p->in_start + PROTO_MAGIC_LEN) % IN_BUF_SIZE;
+        p->in_len -= PROTO_MAGIC_LEN;
+        send_frame(p, F_HELLO, &version, 1);
+    }
+    return 1;
+}
+
+/***
+Writes one binary frame into buf.
+char *buf -> Room for at least len + 2 bytes
+int type -> Frame type
+const char *body -> Fixed-layout body, may be NULL when len is 0
+int len -> Body length, at most MAX_FRAME_BODY
+Return -> Length of the whole frame
+***/
+static int put_frame(char *buf, int type, const char *body, int len) {
+    buf[0] = (char)(len + 1);
+    buf[1] = (char)type;
+    if (len > 0) {
+        memcpy(buf + 2, body, len);
+    }
+    return len + 2;
+}
+
+/***
+Queues one binary frame for a client.
+struct client *p -> Binary client the frame is for
+int type -> Frame type
+const char *body -> Fixed-layout body, may be NULL when len is 0
+int len -> Body length, at most MAX_FRAME_BODY
+***/
+static void send_frame(struct client *p, int type, const char *body, int len) {
+    char frame[MAX_FRAME_BODY + 2];
+    send_client(p, frame, put_frame(frame, type, body, len));
+}
+
+/***
+Writes an F_ANNOUNCE frame for a player entering or leaving the arena.
+char *buf -> Room for at least MAX_FRAME_BODY + 2 bytes
+int left -> 1 if the player left, 0 if they entered
+const char *name -> Player's name
+Return -> Length of the frame
+***/
+static int put_announce(char *buf, int left, const char *name) {
+    char body[MAX_NAME_LEN + 1];
+    int len = strlen(name);
+    body[0] = (char)left;
+    memcpy(body + 1, name, len);
+    return put_frame(buf, F_ANNOUNCE, body, len + 1);
+}
+
+/***
+Sends a binary client both players' numbers and whose turn it is.
+struct client *p -> Binary client the frame is for
+struct client *opponent -> The client's opponent
+***/
+static void send_state(struct client *p, struct client *opponent) {
+    char body[6];
+    body[0] = (char)my_turn(p);
+    body[1] = (char)(fighter(p)->hitpoints >> 8);
+    body[2] = (char)fighter(p)->hitpoints;
+    body[3] = (char)fighter(p)->powermoves;
+    body[4] = (char)(fighter(opponent)->hitpoints >> 8);
+    body[5] = (char)fighter(opponent)->hitpoints;
+    send_frame(p, F_STATE, body, 6);
+}
+
+/***
+Sends a binary client an F_ATTACK frame for a move in its match.
+struct client *p -> Binary client the frame is for
+int by_you -> 1 if p made the move, 0 if p was hit
+int damage -> Damage dealt
+int power -> 1 for a power move
+int missed -> 1 if the power move missed
+int target_hp -> Hitpoints the target has left
+***/
+static void send_attack(struct client *p, int by_you, int damage, int power, int missed, int target_hp) {
+    char body[6];
+    body[0] = (char)by_you;
+    body[1] = (char)damage;
+    body[2] = (char)power;
+    body[3] = (char)missed;
+    body[4] = (char)(target_hp >> 8);
+    body[5] = (char)target_hp;
+    send_frame(p, F_ATTACK, body, 6);
+}
+
+/***
+Tells a client it has been put in the waiting queue.
+struct client *p -> Client that is now waiting
+***/
+static void send_waiting(struct client *p) {
+    char *wait_msg = "You are awaiting an opponent... Press w to watch a match.\n";
+    if (__atomic_load_n(&tourney_open, __ATOMIC_ACQUIRE)) {
+        wait_msg = "You are awaiting an opponent... Press w to watch a match, or j to enter the tournament.\n";
+    }
+    if (p->binary) {
+        send_frame(p, F_WAITING, NULL, 0);
+    } else {
+        send_client(p, wait_msg, strlen(wait_msg));
+    }
+}
+
+/***
+Tells a client how a match they played to the end went.
+struct client *p -> Client being told
+struct client *opponent -> Who they played
+int won -> 1 if p won
+***/
+static void send_result(struct client *p, struct client *opponent, int won) {
+    if (p->binary) {
+        send_frame(p, F_RESULT, won ? "\1\0" : "\0\0", 2);
+        return;
+    }
+    send_tmpl(p, won ? &t_defeated : &t_defeated_by, opponent->name, opponent->name_len);
+}
+
+/***
+Sends a binary client an F_MATCH frame for a match that has just started.
+struct client *p -> Binary client the frame is for
+struct client *opponent -> Who they will play
+***/
+static void send_match(struct client *p, struct client *opponent) {
+    char body[MAX_NAME_LEN + 2];
+    int len = strlen(opponent->name);
+    body[0] = (char)my_turn(p);
+    body[1] = (char)TURN_SECONDS;
+    memcpy(body + 2, opponent->name, len);
+    send_frame(p, F_MATCH, body, len + 2);
+}
+
+/***
+Majority of the work and game logic happens here. This function handles 
+client features, inputs, game state, and messages. It manages player and
+the opponent, switching turns, and reading inputs from the client's buffer.
+1. Handles attack, powermove, speak, timeleft; the rules of a move are
+   played out by match_move in rules.c
+2. Switching turns and the 30 second turn timer
+3. Sending client(s) information through message templates and broadcast
+struct client *p -> Pointer to a clients struct information
+struct client *top -> Front of a client list
+const char *s -> Buffered input from the client
+int n -> Number of bytes available at s
+Return -> Number of bytes consumed from s
+***/
+static int play_turn(struct client *p, struct client *top, const char *s, int n) {
+    char frames[2 * (MAX_FRAME_BODY + 2)];
+    if (!my_turn(p)) {
+        return 1; 
+    }
+    struct client *opponent = p->pl->last_opponent;
+    if (p->pl->is_messaging) {
+        return take_message(p, s, n);
+    }
+    if (s[0] == 't') {
+        int remaining_time = timer_remaining(&p->timer);
+        if (p->binary) {
+            char body[2] = { (char)(remaining_time >> 8), (char)remaining_time };
+            send_frame(p, F_TIME, body, 2);
+            return 1;
+        }
+        send_tmpl(p, &t_remaining, remaining_time);
+        return 1;
+    }
+    if (s[0] == 's' && !p->pl->is_messaging) {
+        p->pl->is_messaging = 1;
+        p->pl->message_length = 0;
+        memset(p->pl->message, 0, sizeof(p->pl->message));
+        if (p->binary) {
+            send_frame(p, F_SPEAK, "\0", 1);
+        } else {
+            send_client(p, "\nSpeak (max 20 chars): ", 22);
+        }
+        return 1;
+    } else if ((s[0] == 'a' || s[0] == 'p') && !p->pl->is_messaging) {
+        struct move_result r;
+        if (match_move(p->pl->match, s[0] == 'p' ? MOVE_POWER : MOVE_ATTACK, &r) < 0) {
+            return 1;
+        }
+        int target_hp = fighter(opponent)->hitpoints;
+        p->pl->match_damage += r.damage;
+        log_event(EV_ATTACK, p, opponent, r.damage, r.power);
+        watch_move(p, opponent, &r);
+        if (p->binary) {
+            send_attack(p, 1, r.damage, r.power, r.missed, target_hp);
+        } else {
+            send_tmpl(p, &t_attacked, opponent->name, opponent->name_len, r.damage);
+        }
+        if (opponent->binary) {
+            send_attack(opponent, 0, r.damage, r.power, r.missed, target_hp);
+        } else {
+            send_tmpl(opponent, &t_attacked_by, p->name, p->name_len, r.damage);
+        }
+        if (r.missed) {
+            if (!p->binary) {
+                send_client(p, "Your power move missed!\n", 24);
+            }
+            if (!opponent->binary) {
+                send_tmpl(opponent, &t_missed_by, p->name, p->name_len);
+            }
+        }
+        if (r.finished) {
+            send_result(p, opponent, 1);
+            send_result(opponent, p, 0);
+            timer_cancel(&p->timer);
+            METRIC_ADD(matches_finished, 1);
+            log_event(EV_RESULT, p, opponent, 0, 0);
+            elo_update(&p->pl->rating, &opponent->pl->rating);
+            stats_submit(p->name, p->pl->match_damage, p->pl->rating, opponent->name, opponent->pl->match_damage, opponent->pl->rating);
+            watch_result(p, opponent, 0);
+            end_match(p, opponent);
+            if (p->pl->pairing >= 0) {
+                finish_pairing(p, opponent, 0);
+                return 1;
+            }
+            int flen = put_announce(frames, 0, opponent->name);
+            flen += put_announce(frames + flen, 0, p->name);
+            broadcast(top, tmpl_payload(&t_entered_pair, opponent->name, opponent->name_len, p->name, p->name_len), frames, flen);
+            enqueue_waiting(p);
+            enqueue_waiting(opponent);
+            struct client *new_opponent_for_p = matchmaker(p);
+            if (new_opponent_for_p != NULL) {
+                start_match(p, new_opponent_for_p);
+            } else {
+                send_waiting(p);
+            }
+            struct client *new_opponent_for_opponent = matchmaker(opponent);
+            if (new_opponent_for_opponent != NULL) {
+                start_match(opponent, new_opponent_for_opponent);
+            } else {
+                send_waiting(opponent);
+            }
+            p->name_entered = 1;
+            opponent->name_entered = 1;
+        } else {
+            if (opponent->binary) {
+                send_state(opponent, p);
+            } else {
+                send_tmpl(opponent, &t_your_turn, fighter(opponent)->hitpoints, fighter(opponent)->powermoves, p->name, p->name_len, fighter(p)->hitpoints);
+            }
+            if (p->binary) {
+                send_state(p, opponent);
+            } else {
+                send_tmpl(p, &t_waiting_for, opponent->name, opponent->name_len);
+            }
+            timer_cancel(&p->timer);
+            timer_arm(&opponent->timer, TURN_SECONDS * 1000);
+        }
+    } else {
+        return 1;
+    }
+    return 1;
+}
+
+/***
+Collects a speak message from the client's buffer up to the end of the line,
+then sends it to the opponent. Messages longer than MAX_MESSAGE_LEN are
+rejected once the client hits enter.
+struct client *p -> Client that is speaking
+const char *s -> Buffered input from the client
+int n -> Number of bytes available at s
+Return -> Number of bytes consumed from s
+***/
+static int take_message(struct client *p, const char *s, int n) {
+    int i;
+    for (i = 0; i < n && s[i] != '\n'; i++) {
+        if (s[i] == '\r') {
+            continue;
+        }
+        if (p->pl->message_length < MAX_MESSAGE_LEN) {
+            p->pl->message[p->pl->message_length++] = s[i];
+        } else if (p->pl->message_length == MAX_MESSAGE_LEN) {
+            p->pl->message_length++;  
+            if (p->binary) {
+                send_frame(p, F_SPEAK, "\1", 1);
+            } else {
+                send_client(p, "\nMessage too long! Finish and hit enter.\n", 41);
+            }
+        }
+    }
+    if (i == n) {
+        return n;
+    }
+    if (p->pl->message_length > MAX_MESSAGE_LEN) {
+        if (p->binary) {
+            send_frame(p, F_SPEAK, "\2", 1);
+        } else {
+            send_client(p, "Message too long! Not sent.\n", 28);
+        }
+    } else if (p->pl->message_length > 0) {
+        watch_say(p);
+        if (p->pl->last_opponent->binary) {
+            send_frame(p->pl->last_opponent, F_SAY, p->pl->message, p->pl->message_length);
+        } else {
+            send_tmpl(p->pl->last_opponent, &t_says, p->name, p->name_len, p->pl->message, p->pl->message_length);
+        }
+    } else if (p->binary) {
+        send_frame(p, F_SPEAK, "\3", 1);
+    } else {
+        send_client(p, "\nYou didn't say anything.\n", 25);
+    }
+    p->pl->is_messaging = 0;
+    memset(p->pl->message, 0, sizeof(p->pl->message));
+    p->pl->message_length = 0;
+    switch_turn(p, p->pl->last_opponent);
+    return i + 1;
+}
+
+/***
+Collects the client's name from its buffer up to the end of the line.
+Ensures unique names and prevents duplicates through the name registry,
+then puts the client into the arena and looks for an opponent. Names longer than MAX_NAME_LEN - 1
+characters are cut short.
+struct client *p -> Client entering their name
+struct client *top -> Front of a client list
+const char *s -> Buffered input from the client
+int n -> Number of bytes available at s
+Return -> Number of bytes consumed from s
+***/
+static int enter_name(struct client *p, struct client *top, const char *s, int n) {
+    int i, len = strlen(p->name);
+    for (i = 0; i < n && s[i] != '\n' && s[i] != '\r'; i++) {
+        if (len < MAX_NAME_LEN - 1) {
+            p->name[len++] = s[i];
+        }
+    }
+    if (i == n) {
+        return n;
+    }
+    if (len == 0) {
+        char *prompt = "Name cannot be empty, please enter your name: ";
+        if (p->binary) {
+            send_frame(p, F_NAME, "\1", 1);
+        } else {
+            send_client(p, prompt, strlen(prompt));
+        }
+        return i + 1;
+    }
+    int status = register_name(p);
+    if (status < 0) {
+        char *prompt = "Name already taken, please enter a different name: ";
+        if (status == -2) {
+            prompt = "The arena is full, please try again later: ";
+        }
+        if (p->binary) {
+            send_frame(p, F_NAME, status == -2 ? "\3" : "\2", 1);
+        } else {
+            send_client(p, prompt, strlen(prompt));
+        }
+        memset(p->name, 0, sizeof(p->name));
+        return i + 1;
+    }
+    p->name_len = len;
+    promote_client(p);
+    log_event(EV_NAME, p, NULL, 0, 0);
+    struct player_stats rec;
+    if (stats_lookup(p->name, &rec)) {
+        p->pl->rating = rec.rating;
+        if (!p->binary) {
+            send_tmpl(p, &t_record, p->pl->rating, (int)rec.wins, (int)rec.losses, (int)rec.damage);
+        }
+    }
+    char frames[MAX_FRAME_BODY + 2];
+    broadcast(top, tmpl_payload(&t_entered, p->name, p->name_len), frames, put_announce(frames, 0, p->name));
+    p->name_entered = 1;
+    enqueue_waiting(p);
+    send_waiting(p);
+    struct client *opponent = matchmaker(p);
+    if (opponent != NULL && opponent->name_entered) {
+        start_match(p, opponent);
+    }
+    return i + 1;
+}
+
+/* Idle players of this shard in the order they started waiting. */
+static __thread struct client *wait_head = NULL;
+static __thread struct client *wait_tail = NULL;
+static __thread int wait_grew = 0;
+
+/* The same players by rating band, each band in the order they started waiting. */
+static __thread struct client *band_head[RATING_BANDS];
+static __thread struct client *band_tail[RATING_BANDS];
+
+/***
+Finding a opponent for a player among the idle players waiting in the
+arena. Waiting players are indexed by rating band, so the search starts in
+the player's own band and works outwards one band at a time, looking only
+at the longest waiting player of each band who is not the one they just
+played (or who just played them). The closest rating wins, and the search
+stops as soon as no further band could hold anyone closer. Only opponents
+within the player's search window are taken; the window starts at
+MATCH_WINDOW points and widens the longer they wait, so nobody waits
+forever for a perfect match.
+If no opponent can be found, client waits till suitable opponent 
+exists.
+struct client *matchmake -> Player looking for an opponent
+Return -> Returns struct client pointer for opponent found, otherwise NULL.
+***/
+struct client *matchmaker(struct client *matchmake) {
+    struct client *cur, *best = NULL;
+    int window = search_window(matchmake, current_ms());
+    int home = rating_band(matchmake->pl->rating);
+    int lo = rating_band(matchmake->pl->rating - window);
+    int hi = rating_band(matchmake->pl->rating + window);
+    int best_gap = window + 1, d, side;
+    METRIC_ADD(matchmaker_calls, 1);
+    for (d = 0; home - d >= lo || home + d <= hi; d++) {
+        for (side = 0; side < (d == 0 ? 1 : 2); side++) {
+            int b = side == 0 ? home - d : home + d;
+            if (b < lo || b > hi) {
+                continue;
+            }
+            for (cur = band_head[b]; cur != NULL; cur = cur->pl->band_next) {
+                METRIC_ADD(matchmaker_scanned, 1);
+                if (cur != matchmake && !played_last(matchmake, cur) && !played_last(cur, matchmake)) {
+                    int gap = abs(cur->pl->rating - matchmake->pl->rating);
+                    if (gap < best_gap) {
+                        best = cur;
+                        best_gap = gap;
+                    }
+                    break;
+                }
+            }
+        }
+        if (best != NULL && best_gap <= d * RATING_BAND) {
+            break;
+        }
+    }
+    return best; 
+}
+
+/***
+The rating band a rating is indexed under; ratings off either end share
+the first or last band.
+int rating -> A rating
+Return -> Band number, 0 to RATING_BANDS - 1
+***/
+static int rating_band(int rating) {
+    int b = rating / RATING_BAND;
+    if (rating < 0 || b < 0) {
+        return 0;
+    }
+    return b < RATING_BANDS ? b : RATING_BANDS - 1;
+}
+
+/***
+How far from their own rating a waiting player will accept an opponent:
+MATCH_WINDOW points, plus MATCH_WIDEN_STEP for every MATCH_WIDEN_MS waited.
+const struct client *p -> A waiting player
+unsigned long now -> current_ms()
+Return -> Largest rating gap accepted
+***/
+static int search_window(const struct client *p, unsigned long now) {
+    unsigned long widened = (now - p->pl->wait_since) / MATCH_WIDEN_MS;
+    if (widened > 1000) {
+        widened = 1000;
+    }
+    return MATCH_WINDOW + (int)widened * MATCH_WIDEN_STEP;
+}
+
+/***
+Runs every MATCH_WIDEN_MS. Players who have waited long enough for their
+window to widen search again, longest waiting first, so a gap that was
+too wide a moment ago can now produce a match.
+struct timer *t -> This shard's widen timer
+***/
+static void widen_search(struct timer *t) {
+    unsigned long now = current_ms();
+    struct client *p = wait_head, *next, *opponent;
+    while (p != NULL && now - p->pl->wait_since >= MATCH_WIDEN_MS) {
+        next = p->pl->wait_next;
+        opponent = matchmaker(p);
+        if (opponent != NULL) {
+            if (opponent == next) {
+                next = next->pl->wait_next;
+            }
+            start_match(p, opponent);
+        }
+        p = next;
+    }
+    timer_arm(t, MATCH_WIDEN_MS);
+}
+
+/***
+Checks whether a player's last match was against another player. The slot
+generation is compared too, so a player who left and whose slot was reused
+does not count.
+struct client *p -> Player whose last opponent is checked
+struct client *other -> Possible last opponent
+Return -> 1 if p last played other, otherwise 0
+***/
+static int played_last(struct client *p, struct client *other) {
+    return p->pl->last_opponent == other && p->pl->last_opponent_gen == other->gen;
+}
+
+/***
+Adds an idle player to the back of the waiting queue and of their rating
+band. Does nothing if the player is already waiting.
+struct client *p -> Player now waiting for an opponent
+***/
+void enqueue_waiting(struct client *p) {
+    int b = rating_band(p->pl->rating);
+    if (p->pl->waiting) {
+        return;
+    }
+    p->pl->waiting = 1;
+    p->pl->wait_since = current_ms();
+    __atomic_store_n(&self->waiting, self->waiting + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&self->band_waiting[b], self->band_waiting[b] + 1, __ATOMIC_RELAXED);
+    wait_grew = 1;
+    p->pl->wait_next = NULL;
+    p->pl->wait_prev = wait_tail;
+    if (wait_tail != NULL) {
+        wait_tail->pl->wait_next = p;
+    } else {
+        wait_head = p;
+    }
+    wait_tail = p;
+    p->pl->band_next = NULL;
+    p->pl->band_prev = band_tail[b];
+    if (band_tail[b] != NULL) {
+        band_tail[b]->pl->band_next = p;
+    } else {
+        band_head[b] = p;
+    }
+    band_tail[b] = p;
+}
+
+/***
+Takes a player out of the waiting queue, wherever they are in it. Does
+nothing if the player is not waiting.
+struct client *p -> Player that was matched or left
+***/
+void dequeue_waiting(struct client *p) {
+    int b = rating_band(p->pl->rating);
+    if (!p->pl->waiting) {
+        return;
+    }
+    if (p->pl->wait_prev != NULL) {
+        p->pl->wait_prev->pl->wait_next = p->pl->wait_next;
+    } else {
+        wait_head = p->pl->wait_next;
+    }
+    if (p->pl->wait_next != NULL) {
+        p->pl->wait_next->pl->wait_prev = p->pl->wait_prev;
+    } else {
+        wait_tail = p->pl->wait_prev;
+    }
+    if (p->pl->band_prev != NULL) {
+        p->pl->band_prev->pl->band_next = p->pl->band_next;
+    } else {
+        band_head[b] = p->pl->band_next;
+    }
+    if (p->pl->band_next != NULL) {
+        p->pl->band_next->pl->band_prev = p->pl->band_prev;
+    } else {
+        band_tail[b] = p->pl->band_prev;
+    }
+    p->pl->wait_next = NULL;
+    p->pl->wait_prev = NULL;
+    p->pl->band_next = NULL;
+    p->pl->band_prev = NULL;
+    p->pl->waiting = 0;
+    __atomic_store_n(&self->waiting, self->waiting - 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&self->band_waiting[b], self->band_waiting[b] - 1, __ATOMIC_RELAXED);
+}
+
+/***
+Creates a match and randomly assignes who goes first with inital game settings.
+The match is played from its own seed (see rules.c), which goes in the
+event log so the match can be replayed.
+Both clients leave the waiting queue and get set for battle with in game
+status, and are both notified.
+Each client has TURN_SECONDS to attack during their turn; the turn timer of
+whoever goes first is armed here.
+struct client *p -> Client for the match
+struct client *opponent -> Another client for the match
+***/
+void start_match(struct client *p, struct client *opponent) {
+#if METRICS
+    unsigned long now = current_ms();
+#endif
+    METRIC_ADD(matches_started, 1);
+    METRIC_ADD(match_wait_ms, (now - p->pl->wait_since) + (now - opponent->pl->wait_since));
+    METRIC_ADD(rating_gap, abs(p->pl->rating - opponent->pl->rating));
+    dequeue_waiting(p);
+    dequeue_waiting(opponent);
+    struct match *m = (struct match *)malloc(sizeof(struct match));
+    if (m == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    seat_match(p, opponent, m, __atomic_add_fetch(&next_match_id, 1, __ATOMIC_RELAXED));
+    timer_arm(&(my_turn(p) ? p : opponent)->timer, TURN_SECONDS * 1000);
+    tell_match(p, opponent, NULL);
+}
+
+/***
+Puts two players into a match: sets up its state from its seed, makes
+them each other's opponent and stops any timer they had. Whoever moves
+first has their turn timer armed by the caller.
+struct client *p -> Player on side 0
+struct client *opponent -> Player on side 1
+struct match *m -> Where the match state goes
+uint64_t match_id -> The match's id, which picks its seed
+***/
+static void seat_match(struct client *p, struct client *opponent, struct match *m, uint64_t match_id) {
+    p->in_game = 1;
+    opponent->in_game = 1;
+    p->pl->last_opponent = opponent;
+    p->pl->last_opponent_gen = opponent->gen;
+    opponent->pl->last_opponent = p;
+    opponent->pl->last_opponent_gen = p->gen;
+    p->pl->match_id = match_id;
+    opponent->pl->match_id = match_id;
+    match_init(m, seed_base + match_id);
+    p->pl->match = m;
+    p->pl->side = 0;
+    opponent->pl->match = m;
+    opponent->pl->side = 1;
+    p->pl->match_damage = 0;
+    opponent->pl->match_damage = 0;
+    timer_cancel(&p->timer);
+    timer_cancel(&opponent->timer);
+    if (my_turn(p)) {
+        log_event(EV_MATCH_START, p, opponent, 0, 0);
+    } else {
+        log_event(EV_MATCH_START, opponent, p, 0, 0);
+    }
+}
+
+/***
+Tells both players of a new match who they play and who goes first, and
+shows the first of them the menu.
+struct client *p -> Player on side 0
+struct client *opponent -> Player on side 1
+struct payload *started -> Shared opening text for text clients, or NULL for the usual one
+***/
+static void tell_match(struct client *p, struct client *opponent, struct payload *started) {
+    if (!p->binary) {
+        if (started != NULL) {
+            send_payload(p, started);
+        } else {
+            send_tmpl(p, &t_started, TURN_SECONDS);
+        }
+    }
+    if (!opponent->binary) {
+        if (started != NULL) {
+            send_payload(opponent, started);
+        } else {
+            send_tmpl(opponent, &t_started, TURN_SECONDS);
+        }
+    }
+    if (p->binary) {
+        send_match(p, opponent);
+    } else {
+        send_tmpl(p, my_turn(p) ? &t_matched_first : &t_matched_second, opponent->name, opponent->name_len);
+    }
+    if (opponent->binary) {
+        send_match(opponent, p);
+    } else {
+        send_tmpl(opponent, my_turn(opponent) ? &t_matched_first : &t_matched_second, p->name, p->name_len);
+    }
+    switch_turn(p, opponent);
+    switch_turn(opponent, p);
+}
+
+/***
+Notifies turn switch to clients.
+Sends a message to client whose turn it si and displays hitpoints, powermoves.
+Also, displays player actions (a)ttack, (p)owermove, (s)peak, (t)ime left
+Binary clients get an F_STATE frame instead of the menu.
+struct client *p -> Used for client to display their info.
+struct client *opponent -> Used to display opponent hitpoints
+***/
+void switch_turn(struct client *p, struct client *opponent) {
+    if (p->binary) {
+        send_state(p, opponent);
+        return;
+    }
+    send_tmpl(p, &t_menu, fighter(p)->hitpoints, fighter(p)->powermoves, fighter(opponent)->hitpoints);
+}
+
+/***
+The fighter a player controls in their current match.
+struct client *p -> A player in a match
+Return -> Their hitpoints and power moves
+***/
+static struct fighter *fighter(const struct client *p) {
+    return &p->pl->match->fighter[p->pl->side];
+}
+
+/***
+Whether it is a player's turn to move.
+struct client *p -> Any client
+Return -> 1 if they are in a match that is still on and it is their move
+***/
+static int my_turn(const struct client *p) {
+    return p->pl->match != NULL && p->pl->match->winner < 0 && p->pl->match->turn == p->pl->side;
+}
+
+/***
+Takes both players out of their match and frees it, unless it belongs to
+a tournament round's batch. They stay each other's last opponent.
+struct client *p -> One player
+struct client *opponent -> The other
+***/
+static void end_match(struct client *p, struct client *opponent) {
+    if (p->pl->pairing < 0) {
+        free(p->pl->match);
+    }
+    p->pl->match = NULL;
+    opponent->pl->match = NULL;
+    p->in_game = 0;
+    opponent->in_game = 0;
+}
+
+/***
+Handles the disconnecting of a client when user leaves the server mid-game
+or while waiting. If client that disconnect is in game, the opponent is granted
+a win, notified that their opponent dropped or left, and put back in the
+waiting queue to be matched again; anyone watching is told too. A
+spectator stops watching. The win and loss go to the stats store. Remove client is called to
+remove the dropped client from linked list.
+Also a when client drops, it is broadcasted to the entire connected clients to notify
+them as well. The client's slot is returned to the client slab.
+struct client *p -> Pointer of the disconnecting client
+struct cliet **top -> Pointer to first client that needs to be updated
+int epfd -> epoll instance the dropped client's socket is removed from
+***/
+void disconnect_client(struct client *p, struct client **top, int epfd) {
+    if (p == NULL || p->fd < 0) return; 
+    timer_cancel(&p->timer);
+    log_event(EV_DISCONNECT, p, NULL, 0, 0);
+    METRIC_ADD(closed, 1);
+    METRIC_ADD(clients, -1);
+    struct client *opponent = NULL;
+    if (p->pl != NULL) {
+        dequeue_waiting(p);
+    }
+    if (p->pl != NULL && p->pl->watching != NULL) {
+        stop_watching(p);
+    }
+    if (p->name_entered) {
+        unregister_name(p);
+    }
+    if (p->in_game && p->pl->last_opponent != NULL) {
+        opponent = p->pl->last_opponent;
+        if (opponent->binary) {
+            send_frame(opponent, F_RESULT, "\1\1", 2);
+        } else {
+            send_tmpl(opponent, &t_dropped, p->name, p->name_len);
+        }
+        timer_cancel(&opponent->timer);
+        METRIC_ADD(matches_finished, 1);
+        log_event(EV_RESULT, opponent, p, 1, 0);
+        elo_update(&opponent->pl->rating, &p->pl->rating);
+        stats_submit(opponent->name, opponent->pl->match_damage, opponent->pl->rating, p->name, p->pl->match_damage, p->pl->rating);
+        watch_result(opponent, p, 1);
+        end_match(p, opponent);
+        opponent->pl->last_opponent = NULL;
+        if (p->pl->pairing >= 0) {
+            finish_pairing(opponent, p, 1);
+            opponent = NULL;
+        } else {
+            enqueue_waiting(opponent);
+            send_waiting(opponent);
+        }
+    }
+    if (p->pl != NULL && p->pl->entry >= 0) {
+        tourney_withdraw(&tourney, p->pl->entry);
+    }
+    if (p->name_len > 0) {
+        char frames[MAX_FRAME_BODY + 2];
+        broadcast(*top, tmpl_payload(&t_left, p->name, p->name_len), frames, put_announce(frames, 1, p->name));
+    }
+    *top = removeclient(*top, p);
+    p->name_entered = 0;
+    free_output(p);
+    p->in_len = 0;
+    release_inbuf(p);
+    if (p->pl != NULL) {
+        free(p->pl);
+        p->pl = NULL;
+        METRIC_ADD(players, -1);
+    } else {
+        pending_names--;
+    }
+    unregister_socket(p, epfd);
+    close(p->fd);
+    p->fd = -1;
+#if URING
+    /* With requests still in flight, ring_done frees the slot once the kernel is done with it. */
+    if (p->io_ops == 0) {
+        free_client(p);
+    }
+#else
+    free_client(p);
+#endif
+    if (opponent != NULL) {
+        struct client *new_opponent = matchmaker(opponent);
+        if (new_opponent != NULL) {
+            start_match(opponent, new_opponent);
+        }
+    }
+}
+
+/***
+Removes a client from the doubly linked list of clients. The neighbours
+are joined directly, so no walk through the list is needed. Usually called
+when client leaves or disconnects from server.
+struct client *top -> Pointer to first client in list
+struct client *p -> Client being removed
+Return -> Update list and pointer to first client in list
+***/
+struct client *removeclient(struct client *top, struct client *p) {
+    if (p->prev != NULL) {
+        p->prev->next = p->next;
+    } else {
+        top = p->next;
+    }
+    if (p->next != NULL) {
+        p->next->prev = p->prev;
+    }
+    p->next = NULL;
+    p->prev = NULL;
+    client_count--;
+    return top;
+}
+
+/* Each shard's clients live in its own preallocated array of slots. */
+static __thread int slab_used = 0;
+static __thread struct client *slab_free = NULL;
+
+/***
+Reserves this shard's part of the client slab at startup. Pages are only
+touched as slots are handed out, so an idle server does not pay for
+MAX_CLIENTS up front.
+***/
+void init_slab(void) {
+    self->slab = (struct client *)calloc(self->slab_size, sizeof(struct client));
+    if (self->slab == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+}
+
+/***
+Hands out a client slot, reusing the most recently freed one so recently
+used memory stays warm. Slots freed by other shards are collected in one
+atomic swap when the local free list runs dry. Slots that were never used
+are taken in order.
+Return -> A slot for a new client, or NULL if the shard's slab is full
+***/
+static struct client *alloc_client(void) {
+    struct client *p;
+    if (slab_free == NULL) {
+        slab_free = __atomic_exchange_n(&self->remote_free, NULL, __ATOMIC_ACQUIRE);
+    }
+    p = slab_free;
+    if (p != NULL) {
+        slab_free = p->next;
+    } else if (slab_used < self->slab_size) {
+        p = &self->slab[slab_used++];
+        p->home = self->id;
+    }
+    return p;
+}
+
+/***
+Returns a client slot to the slab it came from. The generation is bumped
+so a stale reference to the old client can never match whoever gets the
+slot next. A player who was handed to another shard is freed there, so
+the slot is pushed onto its home shard's remote free stack.
+struct client *p -> Slot of the client that left
+***/
+static void free_client(struct client *p) {
+    p->gen++;
+    if (p->home == self->id) {
+        p->next = slab_free;
+        slab_free = p;
+        return;
+    }
+    struct shard *owner = &shards[p->home];
+    struct client *old = __atomic_load_n(&owner->remote_free, __ATOMIC_RELAXED);
+    do {
+        p->next = old;
+    } while (!__atomic_compare_exchange_n(&owner->remote_free, &old, p, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/***
+Sends message to all clients connected
+The message comes as a shared payload, usually rendered straight into it
+by tmpl_payload, and is queued by reference for everyone, so an
+announcement is written once however big the arena is. Binary clients get
+the same announcement as frames from a second payload. The other shards
+get both payloads through their inboxes, and the other processes of a
+federation get the announcement through the coordinator.
+struct client *top -> Pointer to first client in linked list
+struct payload *pl -> Message being broadcasted; the caller's reference is taken over
+const char *frames -> The announcement as binary frames
+int frames_len -> Length of the frames
+***/
+void broadcast(struct client *top, struct payload *pl, const char *frames, int frames_len) {
+    struct payload *fr = new_payload(frames, frames_len);
+    int i;
+    broadcast_local(top, pl, fr);
+    for (i = 0; i < nshards; i++) {
+        if (&shards[i] != self) {
+            __atomic_add_fetch(&pl->refs, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&fr->refs, 1, __ATOMIC_RELAXED);
+            post_shard_msg(&shards[i], MSG_BROADCAST, NULL, pl, fr);
+        }
+    }
+    fed_announce(pl->data, pl->len, frames, frames_len);
+    release_payload(pl);
+    release_payload(fr);
+}
+
+/***
+Queues a shared payload for every named client of this shard.
+struct client *top -> Pointer to first client in linked list
+struct payload *pl -> Announcement being sent to text clients
+struct payload *frames -> Announcement being sent to binary clients
+***/
+static void broadcast_local(struct client *top, struct payload *pl, struct payload *frames) {
+    struct client *p;
+    for (p = top; p != NULL; p = p->next) {
+        if (p->fd >= 0 && p->name_entered) { 
+            send_payload(p, p->binary ? frames : pl);
+        }
+    }
+}
+
+/***
+Copies a message into a new payload with one reference held by the caller.
+const char *s -> Message bytes
+int size -> Length of message
+Return -> The new payload
+***/
+static struct payload *new_payload(const char *s, int size) {
+    struct payload *pl = (struct payload *)malloc(sizeof(struct payload) + size);
+    if (pl == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    pl->refs = 1;
+    pl->len = size;
+    memcpy(pl->data, s, size);
+    return pl;
+}
+
+/***
+Renders a message template straight into a new payload with one reference
+held by the caller. Arguments are as for tmpl_render.
+const struct tmpl *t -> Template of the message
+Return -> The new payload
+***/
+static struct payload *tmpl_payload(const struct tmpl *t, ...) {
+    struct payload *pl = (struct payload *)malloc(sizeof(struct payload) + t->bound);
+    va_list ap;
+    if (pl == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    pl->refs = 1;
+    va_start(ap, t);
+    pl->len = tmpl_vrender(pl->data, t, ap);
+    va_end(ap);
+    return pl;
+}
+
+/***
+Drops one reference to a payload and frees it when nobody holds it.
+Payloads can be shared between shards, so the count is atomic.
+struct payload *pl -> Payload being released
+***/
+static void release_payload(struct payload *pl) {
+    if (__atomic_sub_fetch(&pl->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(pl);
+    }
+}
+
+/* Recycled chunks, so queueing does not go back to malloc every time. */
+static __thread struct outchunk *free_chunks = NULL;
+static __thread struct outchunk *free_refs = NULL;
+static __thread int free_chunk_count = 0;
+
+/***
+Gets an output chunk, reusing a freed one when possible.
+struct payload *shared -> Payload to reference, or NULL for a private chunk
+Return -> Empty chunk that is not yet in any queue
+***/
+static struct outchunk *alloc_chunk(struct payload *shared) {
+    struct outchunk **pool = shared ? &free_refs : &free_chunks;
+    struct outchunk *c = *pool;
+    if (c != NULL) {
+        *pool = c->next;
+        if (shared == NULL) {
+            free_chunk_count--;
+        }
+    } else {
+        c = (struct outchunk *)malloc(sizeof(struct outchunk) + (shared ? 0 : OUT_CHUNK_SIZE));
+        if (c == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        METRIC_ADD(chunk_bytes, sizeof(struct outchunk) + (shared ? 0 : OUT_CHUNK_SIZE));
+    }
+    c->next = NULL;
+    c->shared = shared;
+    c->len = shared ? shared->len : 0;
+    c->off = 0;
+    return c;
+}
+
+/***
+Returns a chunk to the pool, dropping its payload reference if it has one.
+Private chunks beyond CHUNK_POOL_MAX go back to malloc.
+struct outchunk *c -> Chunk that has been written or discarded
+***/
+static void free_chunk(struct outchunk *c) {
+    if (c->shared != NULL) {
+        release_payload(c->shared);
+        c->next = free_refs;
+        free_refs = c;
+    } else if (free_chunk_count < CHUNK_POOL_MAX) {
+        c->next = free_chunks;
+        free_chunks = c;
+        free_chunk_count++;
+    } else {
+        free(c);
+        METRIC_ADD(chunk_bytes, -(int64_t)(sizeof(struct outchunk) + OUT_CHUNK_SIZE));
+    }
+}
+
+/* Clients with output queued during this loop iteration. */
+static __thread struct client *flush_list = NULL;
+
+/***
+Queues a message for a client instead of writing it straight to the socket.
+Small messages are packed into the same chunk, and the client is put on the
+flush list so everything queued in this loop iteration goes out together.
+A client whose queue grows past OUT_HIGHWATER has stopped reading and is
+disconnected rather than being allowed to use up memory.
+struct client *p -> Client the message is for
+const char *s -> Message being sent
+int size -> Length of message being sent
+***/
+void send_client(struct client *p, const char *s, int size) {
+    if (p->closing) {
+        return;
+    }
+    if (p->out_bytes + size > OUT_HIGHWATER) {
+        log_event(EV_KICK, p, NULL, p->out_bytes, 0);
+        kick_client(p);
+        return;
+    }
+    while (size > 0) {
+        struct outchunk *c = p->out_tail;
+        if (c == NULL || c->shared != NULL || c->len == OUT_CHUNK_SIZE) {
+            c = alloc_chunk(NULL);
+            if (p->out_tail == NULL) {
+                p->out_head = c;
+            } else {
+                p->out_tail->next = c;
+            }
+            p->out_tail = c;
+        }
+        int n = OUT_CHUNK_SIZE - c->len;
+        if (n > size) {
+            n = size;
+        }
+        memcpy(c->data + c->len, s, n);
+        c->len += n;
+        p->out_bytes += n;
+        s += n;
+        size -= n;
+    }
+    mark_pending(p);
+}
+
+/***
+Renders a message template straight into the client's output queue, so
+the text is written once where it will be sent from. A fresh chunk is
+started when the tail chunk cannot hold the template's worst case.
+Arguments are as for tmpl_render.
+struct client *p -> Client the message is for
+const struct tmpl *t -> Template of the message
+***/
+static void send_tmpl(struct client *p, const struct tmpl *t, ...) {
+    struct outchunk *c = p->out_tail;
+    va_list ap;
+    int len;
+    if (p->closing) {
+        return;
+    }
+    if (c == NULL || c->shared != NULL || OUT_CHUNK_SIZE - c->len < t->bound) {
+        c = alloc_chunk(NULL);
+        if (p->out_tail == NULL) {
+            p->out_head = c;
+        } else {
+            p->out_tail->next = c;
+        }
+        p->out_tail = c;
+    }
+    va_start(ap, t);
+    len = tmpl_vrender(c->data + c->len, t, ap);
+    va_end(ap);
+    if (p->out_bytes + len > OUT_HIGHWATER) {
+        log_event(EV_KICK, p, NULL, p->out_bytes, 0);
+        kick_client(p);
+        return;
+    }
+    c->len += len;
+    p->out_bytes += len;
+    mark_pending(p);
+}
+
+/***
+Queues a shared payload for a client by reference instead of copying it.
+The same flush and high-water rules as send_client apply.
+struct client *p -> Client the payload is for
+struct payload *pl -> Payload being sent
+***/
+static void send_payload(struct client *p, struct payload *pl) {
+    if (p->closing) {
+        return;
+    }
+    if (p->out_bytes + pl->len > OUT_HIGHWATER) {
+        log_event(EV_KICK, p, NULL, p->out_bytes, 0);
+        kick_client(p);
+        return;
+    }
+    __atomic_add_fetch(&pl->refs, 1, __ATOMIC_RELAXED);
+    struct outchunk *c = alloc_chunk(pl);
+    if (p->out_tail == NULL) {
+        p->out_head = c;
+    } else {
+        p->out_tail->next = c;
+    }
+    p->out_tail = c;
+    p->out_bytes += pl->len;
+    mark_pending(p);
+}
+
+/***
+Puts a client on the flush list if it is not there already.
+struct client *p -> Client with newly queued output
+***/
+static void mark_pending(struct client *p) {
+    if (p->flush_pprev == NULL) {
+        p->flush_next = flush_list;
+        if (flush_list != NULL) {
+            flush_list->flush_pprev = &p->flush_next;
+        }
+        flush_list = p;
+        p->flush_pprev = &flush_list;
+    }
+}
+
+/***
+Stops talking to a client that cannot keep up or whose socket failed.
+Its queued output is dropped and the socket is shut down, which wakes the
+event loop so the client is disconnected through the normal path.
+struct client *p -> Client being dropped
+***/
+static void kick_client(struct client *p) {
+    p->closing = 1;
+    free_output(p);
+    shutdown(p->fd, SHUT_RDWR);
+}
+
+/***
+Frees a client's output queue and takes it off the flush list.
+struct client *p -> Client whose output is discarded
+***/
+static void free_output(struct client *p) {
+    struct outchunk *c, *next;
+    for (c = p->out_head; c != NULL; c = next) {
+        next = c->next;
+        free_chunk(c);
+    }
+    p->out_head = NULL;
+    p->out_tail = NULL;
+    p->out_bytes = 0;
+    if (p->flush_pprev != NULL) {
+        *p->flush_pprev = p->flush_next;
+        if (p->flush_next != NULL) {
+            p->flush_next->flush_pprev = p->flush_pprev;
+        }
+        p->flush_next = NULL;
+        p->flush_pprev = NULL;
+    }
+}
+
+/***
+Writes as much of a client's output queue as the socket will take, batching
+the pending chunks, private and shared alike, into writev calls. A
+spectator's queue is followed by the match feed they have not read yet. If the socket fills up, EPOLLOUT is
+turned on for the client and the rest is written when it becomes writable.
+struct client *p -> Client whose output is written
+int epfd -> epoll instance the client is registered with
+Return -> 0 on success, -1 if the client was dropped
+***/
+int flush_client(struct client *p, int epfd) {
+    struct iovec iov[OUT_IOV_MAX];
+    struct epoll_event ev;
+#if URING
+    if (use_uring) {
+        return ring_flush(p);
+    }
+#endif
+    while (p->out_head != NULL) {
+        struct outchunk *c;
+        int iovcnt = 0;
+        ssize_t total = 0;
+        for (c = p->out_head; c != NULL && iovcnt < OUT_IOV_MAX; c = c->next) {
+            iov[iovcnt].iov_base = (c->shared ? c->shared->data : c->data) + c->off;
+            iov[iovcnt].iov_len = c->len - c->off;
+            total += c->len - c->off;
+            iovcnt++;
+        }
+        ssize_t n = writev(p->fd, iov, iovcnt);
+        METRIC_ADD(io_syscalls, 1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            kick_client(p);
+            return -1;
+        }
+        METRIC_ADD(bytes_out, n);
+        p->out_bytes -= n;
+        int partial = (n < total);
+        while (n > 0) {
+            c = p->out_head;
+            if (n < c->len - c->off) {
+                c->off += n;
+                break;
+            }
+            n -= c->len - c->off;
+            p->out_head = c->next;
+            free_chunk(c);
+        }
+        if (p->out_head == NULL) {
+            p->out_tail = NULL;
+        } else if (partial) {
+            break;
+        }
+    }
+    if (p->pl != NULL && p->pl->watching != NULL && flush_feed(p) < 0) {
+        return -1;
+    }
+    int pending = p->out_head != NULL || (p->pl != NULL && p->pl->watching != NULL && p->pl->feed_off < feed_ring(p)->head);
+    if (pending != p->out_armed) {
+        p->out_armed = pending;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (p->out_armed ? EPOLLOUT : 0);
+        ev.data.ptr = p;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, p->fd, &ev);
+        METRIC_ADD(io_syscalls, 1);
+    }
+    return 0;
+}
+
+/***
+Writes out everything queued during this loop iteration.
+int epfd -> epoll instance the clients are registered with
+***/
+void flush_pending(int epfd) {
+    while (flush_list != NULL) {
+        struct client *p = flush_list;
+        flush_list = p->flush_next;
+        if (flush_list != NULL) {
+            flush_list->flush_pprev = &flush_list;
+        }
+        p->flush_next = NULL;
+        p->flush_pprev = NULL;
+        flush_client(p, epfd);
+    }
+}
+
+/***
+Starts watching a client's socket. On epoll it is registered edge-triggered
+with a pointer to the client, with EPOLLOUT if out_armed is set. On
+io_uring a multishot receive is armed and any output the client brought
+along is flushed at the end of the iteration.
+struct client *p -> Client joining this shard
+int epfd -> This shard's epoll instance
+Return -> 0 on success, -1 if the socket could not be registered
+***/
+static int register_socket(struct client *p, int epfd) {
+    struct epoll_event ev;
+#if URING
+    if (use_uring) {
+        p->out_armed = 0;
+        ring_recv(p);
+        if (p->out_head != NULL) {
+            mark_pending(p);
+        }
+        return 0;
+    }
+#endif
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (p->out_armed ? EPOLLOUT : 0);
+    ev.data.ptr = p;
+    METRIC_ADD(io_syscalls, 1);
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, p->fd, &ev);
+}
+
+/***
+Stops watching a client's socket before it is closed or handed to another
+shard. On io_uring the client's requests are cancelled; their last
+completions still arrive here, and ring_done finishes the job then.
+struct client *p -> Client leaving this shard
+int epfd -> This shard's epoll instance
+***/
+static void unregister_socket(struct client *p, int epfd) {
+#if URING
+    if (use_uring) {
+        if (p->recv_armed) {
+            ring_cancel((uint64_t)(uintptr_t)p | OP_RECV);
+        }
+        if (p->sending != NULL) {
+            ring_cancel((uint64_t)(uintptr_t)p->sending | OP_SEND);
+        }
+        if (p->out_armed) {
+            ring_cancel((uint64_t)(uintptr_t)p | OP_POLLOUT);
+        }
+        return;
+    }
+#endif
+    epoll_ctl(epfd, EPOLL_CTL_DEL, p->fd, NULL);
+    METRIC_ADD(io_syscalls, 1);
+}
+
+/***
+Sends a player who has been taken off this shard's lists to another shard,
+or with SHARD_AWAY to another process. On io_uring this waits until the
+player's cancelled requests have completed, so no completion for them can
+turn up here once someone else has them.
+struct client *p -> Player being moved
+int to -> Shard they go to, or SHARD_AWAY
+enum shard_msg_type type -> MSG_ADOPT or MSG_WATCH
+int epfd -> This shard's epoll instance
+***/
+static void hand_client(struct client *p, int to, enum shard_msg_type type, int epfd) {
+    unregister_socket(p, epfd);
+    __atomic_store_n(&p->shard, -1, __ATOMIC_RELAXED);
+#if URING
+    if (p->io_ops > 0) {
+        p->pl->move_to = to;
+        return;
+    }
+#endif
+    send_on(p, to, type);
+}
+
+/***
+Passes a player on once nothing of theirs is in flight any more.
+struct client *p -> Player being moved
+int to -> Shard they go to, or SHARD_AWAY
+enum shard_msg_type type -> MSG_ADOPT or MSG_WATCH
+***/
+static void send_on(struct client *p, int to, enum shard_msg_type type) {
+    if (to == SHARD_AWAY) {
+        fed_send_player(p);
+    } else {
+        post_shard_msg(&shards[to], type, p, NULL, NULL);
+    }
+}
+
+#if URING
+/***
+io_uring backend. A shard started with -i runs this loop instead of the
+epoll one. The listener has a multishot accept, the wake eventfd a
+multishot poll and every client a multishot receive into the provided
+buffers, so accepting and reading cost no system calls of their own.
+Output still collects in the clients' queues during an iteration, then
+flush_pending queues one vectored send per client, and all of them go to
+the kernel in the same io_uring_enter that waits for the next
+completions. A socket that takes only part of a send gets a one-shot
+POLLOUT request, the way it would get EPOLLOUT. Spectators still read
+the match feed with writev, since a ring can be overwritten while a send
+from it is in flight.
+Every request carries its client or send operation in user_data, with the
+kind of request in the low bits. A client's slot is only freed once its
+last request has completed, so a late completion never lands on whoever
+got the slot next.
+int listenfd -> This shard's listening socket
+***/
+static void run_ring_shard(int listenfd) {
+    struct client *head = NULL;
+    struct io_uring_cqe *cqe;
+    if (uring_init(&ring, URING_ENTRIES, URING_BUFS, URING_BUF_SIZE) < 0) {
+        perror("io_uring_setup");
+        exit(1);
+    }
+    ring_accept(listenfd);
+    ring_wake();
+    if (handoff != NULL) {
+        head = restore_clients(head, -1);
+        __atomic_add_fetch(&restored_shards, 1, __ATOMIC_RELEASE);
+    }
+    while (1) {
+#if METRICS
+        uint64_t enters = ring.enters;
+#endif
+        if (uring_wait(&ring, next_timeout()) < 0) {
+            perror("io_uring_enter");
+        }
+        METRIC_START(loop_start);
+        run_timers();
+        head = run_tournament(head);
+        while ((cqe = uring_peek(&ring)) != NULL) {
+            uint64_t ud = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_seen(&ring);
+            head = ring_complete(head, ud, res, flags, listenfd);
+        }
+        flush_pending(-1);
+        head = send_watchers(head, -1);
+        if (freezing) {
+            head = quiesce_ring(head, listenfd);
+            self->clients = head;
+            self->listenfd = listenfd;
+            uring_close(&ring);
+            return;
+        }
+        head = balance_shards(head, -1);
+        fed_report();
+        METRIC_ADD(io_syscalls, ring.enters - enters);
+        METRIC_OBSERVE(loop, loop_start);
+    }
+}
+
+/***
+Handles one completion. A client's request stays counted in io_ops until
+its completion has been dealt with, so a client dropped while handling it
+is not freed under our feet.
+struct client *head -> Front of this shard's client list
+uint64_t ud -> user_data of the request
+int res -> Result of the request
+unsigned flags -> Completion flags
+int listenfd -> This shard's listening socket
+Return -> Updated front of the client list
+***/
+static struct client *ring_complete(struct client *head, uint64_t ud, int res, unsigned flags, int listenfd) {
+    void *ptr = (void *)(uintptr_t)(ud & ~(uint64_t)OP_MASK);
+    int more = (flags & IORING_CQE_F_MORE) != 0;
+    struct client *p = (struct client *)ptr;
+    struct sendop *op = (struct sendop *)ptr;
+    if (!more) {
+        ring_inflight--;
+    }
+    switch ((int)(ud & OP_MASK)) {
+    case OP_ACCEPT:
+        if (res >= 0) {
+            struct sockaddr_in addr;
+            socklen_t len = sizeof(addr);
+            memset(&addr, 0, sizeof(addr));
+            getpeername(res, (struct sockaddr *)&addr, &len);
+            METRIC_ADD(io_syscalls, 1);
+            METRIC_ADD(accepted, 1);
+            head = addclient(head, res, addr.sin_addr, -1);
+        } else if (res != -ECANCELED) {
+            errno = -res;
+            perror("accept");
+        }
+        if (!more) {
+            ring_accept(listenfd);
+        }
+        break;
+    case OP_WAKE:
+        head = drain_inbox(head, -1);
+        if (!more) {
+            ring_wake();
+        }
+        break;
+    case OP_RECV:
+        if (!more) {
+            p->recv_armed = 0;
+        }
+        if (flags & IORING_CQE_F_BUFFER) {
+            int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            char *data = uring_buf(&ring, bid);
+            if (res > 0 && p->fd >= 0) {
+                METRIC_ADD(bytes_in, res);
+                if (ring_stopped(p)) {
+                    stash_input(p, data, res);
+                } else if (p->closing) {
+                    disconnect_client(p, &head, -1);
+                } else {
+                    while (res > 0 && !ring_stopped(p)) {
+                        int n = stash_input(p, data, res);
+                        data += n;
+                        res -= n;
+                        process_input(p, head);
+                        if (n == 0) {
+                            break;
+                        }
+                    }
+                    stash_input(p, data, res);
+                    res = 1;
+                }
+            }
+            uring_recycle(&ring, bid);
+        }
+        if (p->fd >= 0 && !ring_stopped(p)) {
+            if (res == 0 || (res < 0 && res != -ENOBUFS)) {
+                if (res < 0 && res != -ECANCELED && res != -ECONNRESET) {
+                    errno = -res;
+                    perror("recv");
+                }
+                disconnect_client(p, &head, -1);
+            } else if (!p->recv_armed) {
+                ring_recv(p);
+            }
+        }
+        if (!more) {
+            p->io_ops--;
+        }
+        ring_done(p);
+        break;
+    case OP_SEND:
+        p = op->client;
+        p->sending = NULL;
+        if (res > 0) {
+            METRIC_ADD(bytes_out, res);
+            p->out_bytes -= res;
+        }
+        {
+            struct outchunk *c = op->chunks, *next, *last;
+            int n = res > 0 ? res : 0;
+            while (c != NULL && n >= c->len - c->off) {
+                n -= c->len - c->off;
+                next = c->next;
+                free_chunk(c);
+                c = next;
+            }
+            if (c != NULL && (p->fd < 0 || p->closing || (res < 0 && res != -EAGAIN && res != -ECANCELED))) {
+                for (; c != NULL; c = next) {
+                    next = c->next;
+                    free_chunk(c);
+                }
+                if (p->fd >= 0 && !p->closing) {
+                    kick_client(p);
+                }
+            } else if (c != NULL) {
+                /* The rest goes back in front of whatever was queued since. */
+                c->off += n;
+                for (last = c; last->next != NULL; last = last->next) {
+                }
+                last->next = p->out_head;
+                if (p->out_head == NULL) {
+                    p->out_tail = last;
+                }
+                p->out_head = c;
+            }
+            if (p->fd >= 0 && !p->closing && !ring_stopped(p)) {
+                if (c != NULL && res != -ECANCELED) {
+                    ring_poll_out(p);
+                } else if (p->out_head != NULL || (p->pl != NULL && p->pl->watching != NULL)) {
+                    mark_pending(p);
+                }
+            }
+        }
+        op->next = free_sendops;
+        free_sendops = op;
+        p->io_ops--;
+        ring_done(p);
+        break;
+    case OP_POLLOUT:
+        p->out_armed = 0;
+        if (p->fd >= 0 && !ring_stopped(p)) {
+            mark_pending(p);
+        }
+        p->io_ops--;
+        ring_done(p);
+        break;
+    default:
+        break;
+    }
+    return head;
+}
+
+/***
+Waits for every request of the shard to finish before a hot upgrade, so
+no buffer is still in the kernel's hands when the clients are handed over.
+Everything is cancelled; data that had already arrived is handled as
+usual, and output that was not sent stays queued for the new server.
+struct client *head -> Front of this shard's client list
+int listenfd -> This shard's listening socket
+Return -> Updated front of the client list
+***/
+static struct client *quiesce_ring(struct client *head, int listenfd) {
+    struct io_uring_sqe *sqe = uring_sqe(&ring);
+    struct io_uring_cqe *cqe;
+    ring_quiescing = 1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = OP_CANCEL;
+    ring_inflight++;
+    while (ring_inflight > 0) {
+        if (uring_wait(&ring, -1) < 0) {
+            perror("io_uring_enter");
+            break;
+        }
+        while ((cqe = uring_peek(&ring)) != NULL) {
+            uint64_t ud = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_seen(&ring);
+            head = ring_complete(head, ud, res, flags, listenfd);
+        }
+    }
+    return head;
+}
+
+/***
+Arms the multishot accept on the listener. Accepted sockets come back
+non-blocking.
+int listenfd -> This shard's listening socket
+***/
+static void ring_accept(int listenfd) {
+    struct io_uring_sqe *sqe;
+    if (ring_quiescing) {
+        return;
+    }
+    sqe = uring_sqe(&ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = OP_ACCEPT;
+    ring_inflight++;
+}
+
+/***
+Arms the multishot poll on the shard's wake eventfd.
+***/
+static void ring_wake(void) {
+    struct io_uring_sqe *sqe;
+    if (ring_quiescing) {
+        return;
+    }
+    sqe = uring_sqe(&ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = self->wakefd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = OP_WAKE;
+    ring_inflight++;
+}
+
+/***
+Arms a client's multishot receive. Each completion brings one provided
+buffer of input; the request ends when the buffers run out or the
+socket closes, and is armed again if the client is still here.
+struct client *p -> Client to read from
+***/
+static void ring_recv(struct client *p) {
+    struct io_uring_sqe *sqe;
+    if (ring_quiescing) {
+        return;
+    }
+    sqe = uring_sqe(&ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = p->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = (uint64_t)(uintptr_t)p | OP_RECV;
+    p->recv_armed = 1;
+    p->io_ops++;
+    ring_inflight++;
+}
+
+/***
+Queues one vectored send of the front of a client's output queue, up to
+OUT_IOV_MAX chunks. The chunks move to the send operation until it
+completes.
+struct client *p -> Client with output queued and no send in flight
+***/
+static void ring_send(struct client *p) {
+    struct sendop *op = free_sendops;
+    struct outchunk *c, *last = NULL;
+    struct io_uring_sqe *sqe;
+    int n = 0;
+    if (op != NULL) {
+        free_sendops = op->next;
+    } else {
+        if ((op = (struct sendop *)malloc(sizeof(struct sendop))) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        METRIC_ADD(chunk_bytes, sizeof(struct sendop));
+    }
+    for (c = p->out_head; c != NULL && n < OUT_IOV_MAX; c = c->next) {
+        op->iov[n].iov_base = (c->shared ? c->shared->data : c->data) + c->off;
+        op->iov[n].iov_len = c->len - c->off;
+        last = c;
+        n++;
+    }
+    op->client = p;
+    op->chunks = p->out_head;
+    p->out_head = last->next;
+    last->next = NULL;
+    if (p->out_head == NULL) {
+        p->out_tail = NULL;
+    }
+    memset(&op->msg, 0, sizeof(op->msg));
+    op->msg.msg_iov = op->iov;
+    op->msg.msg_iovlen = n;
+    sqe = uring_sqe(&ring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = p->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&op->msg;
+    sqe->len = 1;
+    sqe->user_data = (uint64_t)(uintptr_t)op | OP_SEND;
+    p->sending = op;
+    p->io_ops++;
+    ring_inflight++;
+}
+
+/***
+Asks to be told when a client's full socket has room again.
+struct client *p -> Client whose last send was cut short
+***/
+static void ring_poll_out(struct client *p) {
+    struct io_uring_sqe *sqe;
+    if (ring_quiescing) {
+        return;
+    }
+    sqe = uring_sqe(&ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = p->fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = (uint64_t)(uintptr_t)p | OP_POLLOUT;
+    p->out_armed = 1;
+    p->io_ops++;
+    ring_inflight++;
+}
+
+/***
+Cancels a request. Its own completion, and the cancel's, come later.
+While the shard quiesces the cancel of everything already covers it.
+uint64_t ud -> user_data of the request
+***/
+static void ring_cancel(uint64_t ud) {
+    struct io_uring_sqe *sqe;
+    if (ring_quiescing) {
+        return;
+    }
+    sqe = uring_sqe(&ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = ud;
+    sqe->user_data = OP_CANCEL;
+    ring_inflight++;
+}
+
+/***
+The io_uring side of flush_client. Nothing is started while a send is in
+flight or the socket is full; their completions flush again. A
+spectator with an empty queue is written the feed directly.
+struct client *p -> Client whose output is written
+Return -> 0 on success, -1 if the client was dropped
+***/
+static int ring_flush(struct client *p) {
+    if (p->sending != NULL || p->out_armed || p->closing || ring_stopped(p)) {
+        return 0;
+    }
+    if (p->out_head == NULL && p->pl != NULL && p->pl->watching != NULL) {
+        if (flush_feed(p) < 0) {
+            return -1;
+        }
+        if (p->out_head == NULL && p->pl->feed_off < feed_ring(p)->head) {
+            ring_poll_out(p);
+        }
+    }
+    if (p->out_head != NULL) {
+        ring_send(p);
+    }
+    return 0;
+}
+
+/***
+Tells whether a client's socket is being let go of: the client was
+dropped, is on its way to another shard, or the shard is stopping.
+const struct client *p -> Client
+Return -> 1 if nothing new may be started for it
+***/
+static int ring_stopped(const struct client *p) {
+    return p->fd < 0 || ring_quiescing || (p->pl != NULL && p->pl->move_to >= 0);
+}
+
+/***
+Finishes with a client once its last request has completed: a dropped
+client's slot is freed, and a player on the move is sent on by send_on.
+struct client *p -> Client whose request just completed
+***/
+static void ring_done(struct client *p) {
+    if (p->io_ops > 0) {
+        return;
+    }
+    if (p->fd < 0) {
+        free_client(p);
+    } else if (p->pl != NULL && p->pl->move_to >= 0) {
+        int to = p->pl->move_to;
+        p->pl->move_to = -1;
+        send_on(p, to, p->pl->watch_shard >= 0 ? MSG_WATCH : MSG_ADOPT);
+    }
+}
+
+/***
+Copies received bytes into a client's input ring, as many as fit.
+struct client *p -> Client the bytes are from
+const char *data -> The bytes
+int len -> How many
+Return -> How many were copied
+***/
+static int stash_input(struct client *p, const char *data, int len) {
+    int tail, n, first;
+    if (len <= 0) {
+        return 0;
+    }
+    if (p->inbuf == NULL) {
+        attach_inbuf(p);
+    }
+    tail = (p->in_start + p->in_len) % IN_BUF_SIZE;
+    n = IN_BUF_SIZE - p->in_len < len ? IN_BUF_SIZE - p->in_len : len;
+    first = IN_BUF_SIZE - tail < n ? IN_BUF_SIZE - tail : n;
+    memcpy(p->inbuf + tail, data, first);
+    memcpy(p->inbuf, data + first, n - first);
+    p->in_len += n;
+    return n;
+}
+#endif
+
+/* Turn timers for every match in this shard. */
+static __thread struct timer_wheel wheel;
+
+/***
+Reads the monotonic clock in milliseconds.
+Return -> Milliseconds since an arbitrary fixed point
+***/
+static unsigned long current_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/***
+Reads the monotonic clock in timer ticks.
+Return -> Ticks since an arbitrary fixed point
+***/
+static unsigned long current_tick(void) {
+    return current_ms() / TIMER_TICK_MS;
+}
+
+/***
+Puts a timer into the wheel slot matching how far off its expiry is.
+struct timer *t -> Timer with expires already set
+***/
+static void timer_place(struct timer *t) {
+    unsigned long delta;
+    int level = 0;
+    if ((long)(t->expires - wheel.now) <= 0) {
+        t->expires = wheel.now + 1;
+    }
+    delta = t->expires - wheel.now;
+    if (delta >= (1UL << (WHEEL_BITS * WHEEL_LEVELS))) {
+        t->expires = wheel.now + (1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        delta = t->expires - wheel.now;
+    }
+    while (level < WHEEL_LEVELS - 1 && delta >= (1UL << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    struct timer **slot = &wheel.slots[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    t->next = *slot;
+    if (*slot != NULL) {
+        (*slot)->pprev = &t->next;
+    }
+    *slot = t;
+    t->pprev = slot;
+}
+
+/***
+Arms a timer to fire after the given delay, re-arming it if already set.
+The expiry is rounded up to a whole tick so a timer never fires early.
+struct timer *t -> Timer to arm
+long ms -> Delay in milliseconds
+***/
+void timer_arm(struct timer *t, long ms) {
+    timer_cancel(t);
+    if (wheel.count == 0) {
+        wheel.now = current_tick();
+    }
+    t->expires = (current_ms() + ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    timer_place(t);
+    wheel.count++;
+}
+
+/***
+Arms a batch of timers for the same delay, as a tournament round does
+with the turn timers of all its matches. The expiry is worked out once
+and every timer lands in the same wheel slot.
+struct timer **timers -> Timers to arm
+int n -> How many
+long ms -> Delay in milliseconds
+***/
+static void timer_arm_all(struct timer **timers, int n, long ms) {
+    unsigned long expires;
+    int i;
+    for (i = 0; i < n; i++) {
+        timer_cancel(timers[i]);
+    }
+    if (wheel.count == 0) {
+        wheel.now = current_tick();
+    }
+    expires = (current_ms() + ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    for (i = 0; i < n; i++) {
+        timers[i]->expires = expires;
+        timer_place(timers[i]);
+    }
+    wheel.count += n;
+}
+
+/***
+Takes a timer out of the wheel. Does nothing if it is not armed.
+struct timer *t -> Timer to cancel
+***/
+void timer_cancel(struct timer *t) {
+    if (t->pprev == NULL) {
+        return;
+    }
+    *t->pprev = t->next;
+    if (t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+    wheel.count--;
+}
+
+/***
+Works out how many whole seconds are left before a timer fires.
+struct timer *t -> Timer being asked about
+Return -> Seconds remaining, 0 if the timer is not armed
+***/
+int timer_remaining(struct timer *t) {
+    long ms;
+    if (t->pprev == NULL) {
+        return 0;
+    }
+    ms = (long)(t->expires * TIMER_TICK_MS - current_ms());
+    if (ms < 0) {
+        ms = 0;
+    }
+    return ms / 1000;
+}
+
+/***
+Advances the wheel to the current time and runs every timer that expired.
+When the level 0 index wraps, the next slot of each level above that also
+wrapped is cascaded down and re-placed relative to the new time.
+***/
+void run_timers(void) {
+    unsigned long target = current_tick();
+    if (wheel.count == 0) {
+        wheel.now = target;
+        return;
+    }
+    while ((long)(target - wheel.now) > 0) {
+        int level;
+        wheel.now++;
+        for (level = 1; level < WHEEL_LEVELS; level++) {
+            if ((wheel.now & ((1UL << (WHEEL_BITS * level)) - 1)) != 0) {
+                break;
+            }
+        }
+        while (--level > 0) {
+            struct timer **slot = &wheel.slots[level][(wheel.now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+            struct timer *t = *slot, *next;
+            *slot = NULL;
+            for (; t != NULL; t = next) {
+                next = t->next;
+                timer_place(t);
+            }
+        }
+        struct timer **slot = &wheel.slots[0][wheel.now & WHEEL_MASK];
+        while (*slot != NULL) {
+            struct timer *t = *slot;
+            timer_cancel(t);
+            t->fn(t);
+        }
+    }
+}
+
+/***
+Works out how long epoll_wait may sleep before the next timer is due.
+Only level 0 is scanned; if it is empty the wheel wakes at the next cascade.
+Return -> Milliseconds to sleep, or -1 when no timers are armed
+***/
+int next_timeout(void) {
+    unsigned long now = current_ms();
+    unsigned long ticks;
+    if (wheel.count == 0) {
+        return -1;
+    }
+    for (ticks = 1; ticks < WHEEL_SIZE; ticks++) {
+        if (wheel.slots[0][(wheel.now + ticks) & WHEEL_MASK] != NULL) {
+            break;
+        }
+        if (((wheel.now + ticks) & WHEEL_MASK) == 0) {
+            break;
+        }
+    }
+    if ((long)((wheel.now + ticks) * TIMER_TICK_MS - now) <= 0) {
+        return 0;
+    }
+    return (wheel.now + ticks) * TIMER_TICK_MS - now;
+}
+
+/***
+Runs when a new connection has not confirmed a name within
+HANDSHAKE_SECONDS. The client is told why and closed, so idle sockets do
+not hold a slot forever.
+struct timer *t -> Handshake timer of the client
+***/
+static void handshake_expired(struct timer *t) {
+    struct client *p = (struct client *)((char *)t - offsetof(struct client, timer));
+    char frame[3];
+    const char *msg = "\nToo slow, goodbye.\n";
+    int len = strlen(msg);
+    if (p->binary) {
+        len = put_frame(frame, F_NAME, "\4", 1);
+        msg = frame;
+    }
+    if (p->out_head == NULL && p->sending == NULL && write(p->fd, msg, len) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("write");
+    }
+    METRIC_ADD(handshake_timeouts, 1);
+    kick_client(p);
+}
+
+/***
+Runs when a player lets their TURN_SECONDS run out. They deal no damage,
+both players are told, and the turn passes to the opponent.
+struct timer *t -> Turn timer of the player who ran out of time
+***/
+static void turn_expired(struct timer *t) {
+    struct client *p = (struct client *)((char *)t - offsetof(struct client, timer));
+    struct client *opponent = p->pl->last_opponent;
+    struct move_result r;
+    if (!p->in_game || !my_turn(p) || opponent == NULL) {
+        return;
+    }
+    match_move(p->pl->match, MOVE_TIMEOUT, &r);
+    METRIC_ADD(timeouts, 1);
+    log_event(EV_TIMEOUT, p, opponent, 0, 0);
+    watch_move(p, opponent, &r);
+    if (opponent->binary) {
+        send_frame(opponent, F_TIMEOUT, "\0", 1);
+    } else {
+        send_tmpl(opponent, &t_timeup, p->name, p->name_len);
+    }
+    if (p->binary) {
+        send_frame(p, F_TIMEOUT, "\1", 1);
+    } else {
+        send_client(p, "\nTime's up! You didnt attack. Wait till your turn.\n", 51);
+    }
+    p->pl->is_messaging = 0;
+    memset(p->pl->message, 0, sizeof(p->pl->message));
+    p->pl->message_length = 0;
+    timer_arm(&opponent->timer, TURN_SECONDS * 1000);
+    switch_turn(opponent, p);
+}
+
+/* Spectators leaving this shard to watch a match on another one, and entrants on their way to TOURNEY_SHARD. */
+static __thread struct client *movers = NULL;
+
+/***
+Handles a command from a named player who is not in a match: w asks for
+the name of a player whose match to watch, and q stops watching. Waiting
+players leave the queue while they pick a match and watch it. With -t, j
+enters the tournament open for entry and l leaves it; entrants stay put
+and cannot watch. Anything else is ignored.
+struct client *p -> Client in the lobby
+const char *s -> Buffered input from the client
+int n -> Number of bytes available at s
+Return -> Number of bytes consumed from s
+***/
+static int lobby_command(struct client *p, const char *s, int n) {
+    if (p->pl->is_messaging) {
+        return take_watch_name(p, s, n);
+    }
+    if (s[0] == 'w' && p->pl->watching == NULL && p->pl->entry == -1) {
+        dequeue_waiting(p);
+        p->pl->is_messaging = 1;
+        p->pl->message_length = 0;
+        memset(p->pl->message, 0, sizeof(p->pl->message));
+        if (!p->binary) {
+            send_client(p, "\nWatch whose match? Enter a player's name: ", 43);
+        }
+    } else if (s[0] == 'q' && p->pl->watching != NULL) {
+        stop_watching(p);
+        if (!p->binary) {
+            send_client(p, "You stopped watching.\n", 22);
+        }
+        return_to_lobby(p);
+    } else if (s[0] == 'j' && tourney_on && p->pl->watching == NULL && p->pl->entry == -1) {
+        join_tournament(p);
+    } else if (s[0] == 'l' && p->pl->entry >= 0) {
+        leave_tournament(p);
+    }
+    return 1;
+}
+
+/***
+Collects the name of the player to watch up to the end of the line. A
+player in a match on this shard is watched straight away; for one on
+another shard, the spectator is queued to move there and the move happens
+once this loop iteration's output is flushed.
+struct client *p -> Client picking a match to watch
+const char *s -> Buffered input from the client
+int n -> Number of bytes available at s
+Return -> Number of bytes consumed from s
+***/
+static int take_watch_name(struct client *p, const char *s, int n) {
+    struct client *q;
+    int i, shard;
+    for (i = 0; i < n && s[i] != '\n'; i++) {
+        if (s[i] != '\r' && p->pl->message_length < MAX_NAME_LEN - 1) {
+            p->pl->message[p->pl->message_length++] = s[i];
+        }
+    }
+    if (i == n) {
+        return n;
+    }
+    p->pl->is_messaging = 0;
+    q = find_name(p->pl->message);
+    shard = q != NULL ? __atomic_load_n(&q->shard, __ATOMIC_RELAXED) : -1;
+    if (shard >= 0 && shard != self->id) {
+        p->pl->watch_shard = shard;
+        p->pl->move_next = movers;
+        movers = p;
+    } else {
+        watch_player(p, q);
+    }
+    return i + 1;
+}
+
+/***
+Puts an idle player back in the waiting queue and looks for an opponent.
+struct client *p -> Player done watching
+***/
+static void return_to_lobby(struct client *p) {
+    enqueue_waiting(p);
+    send_waiting(p);
+    struct client *opponent = matchmaker(p);
+    if (opponent != NULL) {
+        start_match(p, opponent);
+    }
+}
+
+/***
+Starts a spectator watching a player's match. The match's feed is created
+for its first spectator, and the spectator reads it from the current end
+after being told where the match stands. If the player is not in a match
+on this shard the spectator goes back to the lobby.
+struct client *p -> Spectator, with the name they asked for in p->pl->message
+struct client *q -> Player of that name from find_name, or NULL
+***/
+static void watch_player(struct client *p, struct client *q) {
+    struct feed *f;
+    if (q == NULL || __atomic_load_n(&q->shard, __ATOMIC_RELAXED) != self->id || !q->in_game || strcmp(q->name, p->pl->message) != 0) {
+        if (p->binary) {
+            send_frame(p, F_WATCH, "\0", 1);
+        } else {
+            send_tmpl(p, &t_not_playing, p->pl->message, p->pl->message_length);
+        }
+        memset(p->pl->message, 0, sizeof(p->pl->message));
+        p->pl->message_length = 0;
+        return_to_lobby(p);
+        return;
+    }
+    memset(p->pl->message, 0, sizeof(p->pl->message));
+    p->pl->message_length = 0;
+    if ((f = q->pl->feed) == NULL) {
+        f = (struct feed *)malloc(sizeof(struct feed));
+        if (f == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        f->player[q->pl->side] = q;
+        f->player[1 - q->pl->side] = q->pl->last_opponent;
+        f->watchers = NULL;
+        f->count = 0;
+        f->text.head = 0;
+        f->frames.head = 0;
+        METRIC_ADD(feeds, 1);
+        q->pl->feed = f;
+        q->pl->last_opponent->pl->feed = f;
+    }
+    p->pl->watch_prev = NULL;
+    p->pl->watch_next = f->watchers;
+    if (f->watchers != NULL) {
+        f->watchers->pl->watch_prev = p;
+    }
+    f->watchers = p;
+    f->count++;
+    p->pl->watching = f;
+    p->pl->feed_off = feed_ring(p)->head;
+    p->pl->feed_partial = 0;
+    p->pl->feed_skips = 0;
+    METRIC_ADD(spectators, 1);
+    struct client *a = f->player[0], *b = f->player[1];
+    if (p->binary) {
+        char body[MAX_FRAME_BODY];
+        body[0] = 1;
+        body[1] = (char)a->pl->match->turn;
+        body[2] = (char)(fighter(a)->hitpoints >> 8);
+        body[3] = (char)fighter(a)->hitpoints;
+        body[4] = (char)(fighter(b)->hitpoints >> 8);
+        body[5] = (char)fighter(b)->hitpoints;
+        memcpy(body + 6, a->name, a->name_len);
+        body[6 + a->name_len] = '\0';
+        memcpy(body + 7 + a->name_len, b->name, b->name_len);
+        send_frame(p, F_WATCH, body, 7 + a->name_len + b->name_len);
+    } else {
+        send_tmpl(p, &t_watching, a->name, a->name_len, fighter(a)->hitpoints, b->name, b->name_len, fighter(b)->hitpoints);
+    }
+}
+
+/***
+Stops a spectator watching. Whatever of the feed they have not been sent
+yet is copied to their own output queue first, so nothing already played
+is lost, and the feed is freed when its last spectator leaves.
+struct client *p -> Spectator
+***/
+static void stop_watching(struct client *p) {
+    struct feed *f = p->pl->watching;
+    struct feed_ring *ring = feed_ring(p);
+    if (!p->closing && ring->head - p->pl->feed_off > FEED_SIZE) {
+        skip_feed(p, ring);
+    } else if (!p->closing && p->pl->feed_off < ring->head) {
+        int start = p->pl->feed_off & (FEED_SIZE - 1);
+        int len = ring->head - p->pl->feed_off;
+        int first = len < FEED_SIZE - start ? len : FEED_SIZE - start;
+        send_client(p, ring->data + start, first);
+        send_client(p, ring->data, len - first);
+    }
+    if (p->pl->watch_prev != NULL) {
+        p->pl->watch_prev->pl->watch_next = p->pl->watch_next;
+    } else {
+        f->watchers = p->pl->watch_next;
+    }
+    if (p->pl->watch_next != NULL) {
+        p->pl->watch_next->pl->watch_prev = p->pl->watch_prev;
+    }
+    p->pl->watch_next = NULL;
+    p->pl->watch_prev = NULL;
+    p->pl->watching = NULL;
+    METRIC_ADD(spectators, -1);
+    if (--f->count == 0) {
+        f->player[0]->pl->feed = NULL;
+        f->player[1]->pl->feed = NULL;
+        free(f);
+        METRIC_ADD(feeds, -1);
+    }
+}
+
+/***
+Hands the spectators queued by take_watch_name to the shards of the
+matches they asked for, and the entrants queued by join_tournament to
+TOURNEY_SHARD. Runs after the loop's output is flushed, so none of them
+is still on this shard's flush list.
+struct client *top -> Front of this shard's client list
+int epfd -> This shard's epoll instance
+Return -> Updated front of the client list
+***/
+static struct client *send_watchers(struct client *top, int epfd) {
+    while (movers != NULL) {
+        struct client *p = movers;
+        movers = p->pl->move_next;
+        top = removeclient(top, p);
+        METRIC_ADD(clients, -1);
+        METRIC_ADD(players, -1);
+        METRIC_ADD(in_buffers, -(p->inbuf != NULL));
+        if (p->pl->entry == TOURNEY_ENTERING) {
+            int to = p->pl->watch_shard;
+            p->pl->watch_shard = -1;
+            hand_client(p, to, MSG_ADOPT, epfd);
+        } else {
+            hand_client(p, p->pl->watch_shard, MSG_WATCH, epfd);
+        }
+    }
+    return top;
+}
+
+/***
+Copies bytes into a feed ring, wrapping at the end.
+struct feed_ring *r -> Ring being written
+const char *s -> Bytes to add
+int len -> Number of bytes, at most FEED_SIZE
+***/
+static void ring_put(struct feed_ring *r, const char *s, int len) {
+    int start = r->head & (FEED_SIZE - 1);
+    int first = len < FEED_SIZE - start ? len : FEED_SIZE - start;
+    memcpy(r->data + start, s, first);
+    memcpy(r->data, s + first, len - first);
+    r->head += len;
+}
+
+/***
+Adds one event to a match feed and puts every spectator on the flush
+list. Nothing is copied per spectator; they are written from the rings.
+struct feed *f -> Feed of the match
+const char *text -> The event for text spectators
+int text_len -> Its length
+const char *frame -> The event as a binary frame
+int frame_len -> Its length
+***/
+static void feed_append(struct feed *f, const char *text, int text_len, const char *frame, int frame_len) {
+    struct client *w;
+    ring_put(&f->text, text, text_len);
+    ring_put(&f->frames, frame, frame_len);
+    for (w = f->watchers; w != NULL; w = w->pl->watch_next) {
+        mark_pending(w);
+    }
+}
+
+/***
+Tells a match's spectators about a move or a timeout. A timeout is the
+only move that is neither a power move nor deals damage.
+struct client *p -> Player who moved
+struct client *opponent -> Their opponent
+const struct move_result *r -> What happened
+***/
+static void watch_move(struct client *p, struct client *opponent, const struct move_result *r) {
+    char text[MAX_BUF];
+    char frame[MAX_FRAME_BODY + 2];
+    char body[7];
+    int len, target_hp = fighter(opponent)->hitpoints;
+    int timeout = !r->power && r->damage == 0;
+    if (p->pl->feed == NULL) {
+        return;
+    }
+    if (timeout) {
+        len = tmpl_render(text, &t_seen_timeout, p->name, p->name_len);
+    } else if (r->missed) {
+        len = tmpl_render(text, &t_missed_by, p->name, p->name_len);
+    } else {
+        len = tmpl_render(text, &t_seen_attack, p->name, p->name_len, opponent->name, opponent->name_len, r->damage, opponent->name, opponent->name_len, target_hp);
+    }
+    body[0] = (char)p->pl->side;
+    body[1] = (char)r->damage;
+    body[2] = (char)r->power;
+    body[3] = (char)r->missed;
+    body[4] = (char)timeout;
+    body[5] = (char)(target_hp >> 8);
+    body[6] = (char)target_hp;
+    feed_append(p->pl->feed, text, len, frame, put_frame(frame, F_SEEN_MOVE, body, 7));
+}
+
+/***
+Tells a match's spectators what a player said.
+struct client *p -> Player who spoke, with the message in p->pl->message
+***/
+static void watch_say(struct client *p) {
+    char text[MAX_BUF];
+    char frame[MAX_FRAME_BODY + 2];
+    char body[MAX_MESSAGE_LEN + 1];
+    if (p->pl->feed == NULL) {
+        return;
+    }
+    body[0] = (char)p->pl->side;
+    memcpy(body + 1, p->pl->message, p->pl->message_length);
+    feed_append(p->pl->feed, text, tmpl_render(text, &t_says, p->name, p->name_len, p->pl->message, p->pl->message_length),
+                frame, put_frame(frame, F_SEEN_SAY, body, p->pl->message_length + 1));
+}
+
+/***
+Tells a match's spectators how it ended and sends them all back to the
+lobby, which frees the feed. Runs before the match itself is freed.
+struct client *winner -> Player who won
+struct client *loser -> Player who lost
+int dropped -> 1 if the loser left the arena
+***/
+static void watch_result(struct client *winner, struct client *loser, int dropped) {
+    char text[MAX_BUF];
+    char frame[MAX_FRAME_BODY + 2];
+    char body[2];
+    struct client *w, *next;
+    int len;
+    if (winner->pl->feed == NULL) {
+        return;
+    }
+    if (dropped) {
+        len = tmpl_render(text, &t_seen_dropped, loser->name, loser->name_len, winner->name, winner->name_len);
+    } else {
+        len = tmpl_render(text, &t_seen_won, winner->name, winner->name_len, loser->name, loser->name_len);
+    }
+    body[0] = (char)winner->pl->side;
+    body[1] = (char)dropped;
+    feed_append(winner->pl->feed, text, len, frame, put_frame(frame, F_SEEN_RESULT, body, 2));
+    for (w = winner->pl->feed->watchers; w != NULL; w = next) {
+        next = w->pl->watch_next;
+        stop_watching(w);
+        return_to_lobby(w);
+    }
+}
+
+/***
+The ring a spectator reads, picked by their protocol.
+const struct client *p -> Spectator
+Return -> The text or frame ring of the feed they watch
+***/
+static struct feed_ring *feed_ring(const struct client *p) {
+    return p->binary ? &p->pl->watching->frames : &p->pl->watching->text;
+}
+
+/***
+Writes as much of the feed a spectator has not read as their socket will
+take, straight from the ring, once their own output queue is empty. A
+spectator whose unread part has already been overwritten is skipped
+ahead, even while their queue is still stuck.
+struct client *p -> Spectator
+Return -> 0 on success, -1 if the spectator was dropped
+***/
+static int flush_feed(struct client *p) {
+    struct feed_ring *ring = feed_ring(p);
+    struct iovec iov[2];
+    if (p->closing) {
+        return 0;
+    }
+    while (p->pl->feed_off < ring->head) {
+        if (ring->head - p->pl->feed_off > FEED_SIZE) {
+            if (skip_feed(p, ring) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (p->out_head != NULL) {
+            break;
+        }
+        int start = p->pl->feed_off & (FEED_SIZE - 1);
+        size_t len = ring->head - p->pl->feed_off;
+        int iovcnt = 1;
+        iov[0].iov_base = ring->data + start;
+        iov[0].iov_len = len;
+        if (start + len > FEED_SIZE) {
+            iov[0].iov_len = FEED_SIZE - start;
+            iov[1].iov_base = ring->data;
+            iov[1].iov_len = len - iov[0].iov_len;
+            iovcnt = 2;
+        }
+        ssize_t n = writev(p->fd, iov, iovcnt);
+        METRIC_ADD(io_syscalls, 1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            kick_client(p);
+            return -1;
+        }
+        METRIC_ADD(bytes_out, n);
+        p->pl->feed_off += n;
+        p->pl->feed_partial = (size_t)n < len;
+        if (p->pl->feed_partial) {
+            break;
+        }
+    }
+    return 0;
+}
+
+/***
+Moves a spectator who fell more than FEED_SIZE behind to the end of the
+feed and tells them events were skipped. A spectator whose socket keeps
+filling up, or a binary one left in the middle of a frame, is dropped
+instead.
+struct client *p -> Spectator who fell behind
+struct feed_ring *ring -> The ring they read
+Return -> 0 if they were skipped ahead, -1 if they were dropped
+***/
+static int skip_feed(struct client *p, struct feed_ring *ring) {
+    METRIC_ADD(spectator_skips, 1);
+    /* A burst of events can outrun even a spectator whose socket has room. */
+    if ((p->out_armed && ++p->pl->feed_skips > FEED_MAX_SKIPS) || (p->binary && p->pl->feed_partial)) {
+        METRIC_ADD(spectators_dropped, 1);
+        log_event(EV_KICK, p, NULL, (int)(ring->head - p->pl->feed_off), 0);
+        kick_client(p);
+        return -1;
+    }
+    if (p->binary) {
+        send_frame(p, F_SKIPPED, NULL, 0);
+    } else if (p->pl->feed_partial) {
+        send_client(p, "\n(You fell behind; skipping ahead.)\n", 36);
+    } else {
+        send_client(p, "(You fell behind; skipping ahead.)\n", 35);
+    }
+    p->pl->feed_off = ring->head;
+    p->pl->feed_partial = 0;
+    return 0;
+}
+
+/***
+Name registry: an open addressing hash table of every confirmed name, so
+checking for a duplicate or finding a player by name does not walk the
+client list. Linear probing with backward shift deletion keeps lookups
+short without tombstones. NAME_TABLE_SIZE must be a power of two.
+Names are unique across all shards, so the table is shared and locked.
+***/
+static struct name_slot names[NAME_TABLE_SIZE];
+static int name_count = 0;
+static pthread_mutex_t names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/***
+Hashes a name with FNV-1a.
+const char *name -> Name to hash
+Return -> 32-bit hash, never 0 so an empty slot is easy to spot
+***/
+static unsigned int name_hash(const char *name) {
+    unsigned int h = 2166136261u;
+    int i;
+    for (i = 0; i < MAX_NAME_LEN && name[i] != '\0'; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h ? h : 1;
+}
+
+/***
+Looks up the player who confirmed a name.
+const char *name -> Name to look for
+Return -> The client using the name, otherwise NULL
+***/
+struct client *find_name(const char *name) {
+    unsigned int h = name_hash(name);
+    unsigned int i = h & (NAME_TABLE_SIZE - 1);
+    struct client *found = NULL;
+    pthread_mutex_lock(&names_lock);
+    while (names[i].client != NULL) {
+        if (names[i].hash == h && strcmp(names[i].client->name, name) == 0) {
+            found = names[i].client;
+            break;
+        }
+        i = (i + 1) & (NAME_TABLE_SIZE - 1);
+    }
+    pthread_mutex_unlock(&names_lock);
+    return found;
+}
+
+/***
+Claims a client's name in the registry. The table is kept at most three
+quarters full so probe sequences stay short.
+struct client *p -> Client confirming their name
+Return -> 0 on success, -1 if the name is taken, -2 if the table is full
+***/
+int register_name(struct client *p) {
+    unsigned int h = name_hash(p->name);
+    unsigned int i = h & (NAME_TABLE_SIZE - 1);
+    int status = 0;
+    pthread_mutex_lock(&names_lock);
+    while (names[i].client != NULL) {
+        if (names[i].hash == h && strcmp(names[i].client->name, p->name) == 0) {
+            status = -1;
+            break;
+        }
+        i = (i + 1) & (NAME_TABLE_SIZE - 1);
+    }
+    if (status == 0 && name_count >= NAME_TABLE_SIZE / 4 * 3) {
+        status = -2;
+    }
+    if (status == 0) {
+        names[i].hash = h;
+        names[i].client = p;
+        name_count++;
+    }
+    pthread_mutex_unlock(&names_lock);
+    return status;
+}
+
+/***
+Releases a client's name. Entries after the freed slot that belong
+earlier in the probe sequence are shifted back so no lookup stops short.
+struct client *p -> Client leaving the arena
+***/
+void unregister_name(struct client *p) {
+    unsigned int mask = NAME_TABLE_SIZE - 1;
+    unsigned int i = name_hash(p->name) & mask;
+    unsigned int j;
+    pthread_mutex_lock(&names_lock);
+    while (names[i].client != p) {
+        if (names[i].client == NULL) {
+            pthread_mutex_unlock(&names_lock);
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    names[i].client = NULL;
+    name_count--;
+    for (j = (i + 1) & mask; names[j].client != NULL; j = (j + 1) & mask) {
+        unsigned int home = names[j].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            names[i] = names[j];
+            names[j].client = NULL;
+            i = j;
+        }
+    }
+    pthread_mutex_unlock(&names_lock);
+}
+
+/***
+Hands a message to another shard. The inbox is a lock-free stack pushed
+with compare-and-swap; the shard is only woken through its eventfd when
+the inbox was empty, since otherwise a wakeup is already on its way.
+struct shard *sh -> Shard the message is for
+enum shard_msg_type type -> What the shard should do
+struct client *p -> Client being handed over, if any
+struct payload *pl -> Payload being broadcast, if any (reference included)
+struct payload *frames -> The same broadcast as binary frames, if any
+***/
+void post_shard_msg(struct shard *sh, enum shard_msg_type type, struct client *p, struct payload *pl, struct payload *frames) {
+    struct shard_msg *msg = (struct shard_msg *)malloc(sizeof(struct shard_msg));
+    if (msg == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    msg->type = type;
+    msg->client = p;
+    msg->payload = pl;
+    msg->frames = frames;
+    msg->fd = -1;
+    push_shard_msg(sh, msg);
+}
+
+/***
+Hands a shard what the coordinator sent it.
+struct shard *sh -> Shard the message is for
+enum shard_msg_type type -> MSG_AWAY, MSG_ARRIVE or MSG_JOIN
+struct payload *pl -> The coordinator's message (reference included)
+int fd -> Socket that came with it, or -1
+***/
+static void post_fed_msg(struct shard *sh, enum shard_msg_type type, struct payload *pl, int fd) {
+    struct shard_msg *msg = (struct shard_msg *)malloc(sizeof(struct shard_msg));
+    if (msg == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    msg->type = type;
+    msg->client = NULL;
+    msg->payload = pl;
+    msg->frames = NULL;
+    msg->fd = fd;
+    push_shard_msg(sh, msg);
+}
+
+/***
+Pushes a message onto a shard's inbox and wakes the shard if needed.
+struct shard *sh -> Shard the message is for
+struct shard_msg *msg -> The message
+***/
+static void push_shard_msg(struct shard *sh, struct shard_msg *msg) {
+    uint64_t one = 1;
+    struct shard_msg *old = __atomic_load_n(&sh->inbox, __ATOMIC_RELAXED);
+    do {
+        msg->next = old;
+    } while (!__atomic_compare_exchange_n(&sh->inbox, &old, msg, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (old == NULL && write(sh->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("write");
+    }
+}
+
+/***
+Takes everything out of this shard's inbox in one atomic swap and handles
+it in the order it was posted: players handed over from other shards are
+adopted, spectators sent here to watch a match start watching it, other
+shards' announcements are sent to local clients, and a
+freeze request for a hot upgrade stops the shard at the end of the loop.
+From the federation come players to send to another process, players
+arriving from one, and connections the coordinator accepted.
+struct client *top -> Front of this shard's client list
+int epfd -> This shard's epoll instance
+Return -> Updated front of the client list
+***/
+static struct client *drain_inbox(struct client *top, int epfd) {
+    struct shard_msg *msg, *next, *list = NULL;
+    uint64_t count;
+    if (read(self->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("read");
+    }
+    msg = __atomic_exchange_n(&self->inbox, NULL, __ATOMIC_ACQUIRE);
+    for (; msg != NULL; msg = next) {
+        next = msg->next;
+        msg->next = list;
+        list = msg;
+    }
+    for (msg = list; msg != NULL; msg = next) {
+        next = msg->next;
+        if (msg->type == MSG_ADOPT || msg->type == MSG_WATCH) {
+            top = adopt_client(top, msg->client, epfd, msg->type == MSG_WATCH);
+        } else if (msg->type == MSG_FREEZE) {
+            freezing = 1;
+        } else if (msg->type == MSG_AWAY) {
+            top = send_away(top, (struct fed_away *)msg->payload->data, epfd);
+            release_payload(msg->payload);
+        } else if (msg->type == MSG_ARRIVE) {
+            top = arrive(top, msg->payload, msg->fd, epfd);
+            release_payload(msg->payload);
+        } else if (msg->type == MSG_JOIN) {
+            METRIC_ADD(accepted, 1);
+            top = addclient(top, msg->fd, ((struct fed_client *)msg->payload->data)->addr, epfd);
+            release_payload(msg->payload);
+        } else {
+            broadcast_local(top, msg->payload, msg->frames);
+            release_payload(msg->payload);
+            release_payload(msg->frames);
+        }
+        free(msg);
+    }
+    return top;
+}
+
+/***
+Takes over an idle player handed to this shard by another one. The player
+joins this shard's client list and epoll instance. A player sent to watch
+a match here starts watching it, and any input that came with them is
+handled; a player come to enter the tournament enters it; anyone else
+joins the waiting queue and is matched straight away if anyone here can
+play them, and then has their input handled too.
+struct client *top -> Front of this shard's client list
+struct client *p -> Player being adopted
+int epfd -> This shard's epoll instance
+int watch -> 1 if p came to watch the match of the player named in p->pl->message
+Return -> Updated front of the client list
+***/
+static struct client *adopt_client(struct client *top, struct client *p, int epfd, int watch) {
+    p->prev = NULL;
+    p->next = top;
+    if (top != NULL) {
+        top->prev = p;
+    }
+    top = p;
+    client_count++;
+    METRIC_ADD(clients, 1);
+    METRIC_ADD(players, 1);
+    METRIC_ADD(in_buffers, (p->inbuf != NULL));
+    __atomic_store_n(&p->shard, self->id, __ATOMIC_RELAXED);
+    p->out_armed = (p->out_head != NULL);
+    if (register_socket(p, epfd) < 0) {
+        perror("epoll_ctl");
+        disconnect_client(p, &top, epfd);
+        return top;
+    }
+    if (watch) {
+        p->pl->watch_shard = -1;
+        watch_player(p, find_name(p->pl->message));
+        if (p->in_len > 0) {
+            process_input(p, top);
+        }
+        return top;
+    }
+    if (p->pl->entry == TOURNEY_ENTERING) {
+        enter_tournament(p);
+        if (p->in_len > 0) {
+            process_input(p, top);
+        }
+        return top;
+    }
+    enqueue_waiting(p);
+    struct client *opponent = matchmaker(p);
+    if (opponent != NULL) {
+        start_match(p, opponent);
+    }
+    if (p->in_len > 0) {
+        process_input(p, top);
+    }
+    return top;
+}
+
+/***
+Lets idle players on different shards find each other. Players only ever
+move to a shard with a higher id that has someone waiting, so a player is
+never bounced back and forth. When this shard has just gained a waiting
+player, lower shards with players of their own are woken so they can send
+them up here.
+struct client *top -> Front of this shard's client list
+int epfd -> This shard's epoll instance
+Return -> Updated front of the client list
+***/
+static struct client *balance_shards(struct client *top, int epfd) {
+    struct client *p = wait_head;
+    uint64_t one = 1;
+    int i;
+    if (nshards == 1 || p == NULL) {
+        wait_grew = 0;
+        return top;
+    }
+    for (i = self->id + 1; i < nshards; i++) {
+        if (__atomic_load_n(&shards[i].waiting, __ATOMIC_RELAXED) > 0 && !p->closing) {
+            dequeue_waiting(p);
+            top = removeclient(top, p);
+            METRIC_ADD(clients, -1);
+            METRIC_ADD(players, -1);
+            METRIC_ADD(in_buffers, -(p->inbuf != NULL));
+            hand_client(p, i, MSG_ADOPT, epfd);
+            wait_grew = 0;
+            return top;
+        }
+    }
+    if (wait_grew) {
+        for (i = 0; i < self->id; i++) {
+            if (__atomic_load_n(&shards[i].waiting, __ATOMIC_RELAXED) > 0) {
+                if (write(shards[i].wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+                    perror("write");
+                }
+            }
+        }
+    }
+    wait_grew = 0;
+    return top;
+}
+
+/***
+Tournaments. With -t, players in the lobby enter with j; they move to
+TOURNEY_SHARD, which runs the tournament, and wait there outside the
+waiting queue. Registration closes TOURNEY_REGISTER_MS after the first
+entry, and from then on every round is drawn by tourney.c and started in
+one go: the round's matches are set up side by side in one allocation,
+all their turn timers are armed at once, and every text client gets the
+same shared opening text, so the whole round goes out with this loop
+iteration's flush, one write per player. When the last match of a round
+is over its timing is reported, and the next round starts after
+TOURNEY_BREAK_MS. Results still count towards ratings and stats.
+***/
+
+/***
+Enters a player in the tournament, or sends them on to TOURNEY_SHARD to
+enter it there once this loop iteration's output is flushed.
+struct client *p -> Player in the lobby
+***/
+static void join_tournament(struct client *p) {
+    if (!__atomic_load_n(&tourney_open, __ATOMIC_ACQUIRE)) {
+        send_tourney(p, 1, 0, 0);
+        return;
+    }
+    dequeue_waiting(p);
+    p->pl->entry = TOURNEY_ENTERING;
+    if (self->id == TOURNEY_SHARD) {
+        enter_tournament(p);
+        return;
+    }
+    p->pl->watch_shard = TOURNEY_SHARD;
+    p->pl->move_next = movers;
+    movers = p;
+}
+
+/***
+Adds a player who asked to enter to the tournament. The first entry
+starts the registration clock. If registration closed while the player
+was on their way, they go back to the lobby.
+struct client *p -> Player with entry TOURNEY_ENTERING, on TOURNEY_SHARD
+***/
+static void enter_tournament(struct client *p) {
+    if (!tourney_open) {
+        p->pl->entry = -1;
+        send_tourney(p, 1, 0, 0);
+        return_to_lobby(p);
+        return;
+    }
+    p->pl->entry = tourney_enter(&tourney, p->name, p->pl->rating, p);
+    if (tourney.count == 1) {
+        timer_arm(&tourney_timer, TOURNEY_REGISTER_MS);
+    }
+    send_tourney(p, 0, 0, 0);
+}
+
+/***
+Takes a player who is not in a match out of the tournament and back to
+the lobby.
+struct client *p -> Entrant
+***/
+static void leave_tournament(struct client *p) {
+    tourney_withdraw(&tourney, p->pl->entry);
+    p->pl->entry = -1;
+    send_tourney(p, 5, tourney.round, 0);
+    return_to_lobby(p);
+}
+
+/***
+Tells a player what the tournament did with them: a frame for binary
+clients, a line of text for everyone else.
+struct client *p -> Entrant or would-be entrant
+int what -> What happened, as in F_TOURNEY; the champion goes out by broadcast
+int round -> Round it happened in
+int score -> Their score
+***/
+static void send_tourney(struct client *p, int what, int round, int score) {
+    if (p->binary) {
+        char body[3] = { (char)what, (char)round, (char)score };
+        send_frame(p, F_TOURNEY, body, 3);
+        return;
+    }
+    if (what == 0) {
+        send_tmpl(p, &t_tourney_entered, timer_remaining(&tourney_timer));
+    } else if (what == 1) {
+        const char *msg = "There is no tournament open for entry right now.\n";
+        send_client(p, msg, strlen(msg));
+    } else if (what == 2) {
+        send_tmpl(p, &t_tourney_bye, round, score);
+    } else if (what == 3 && tourney.format == TOURNEY_ELIMINATION) {
+        send_tmpl(p, &t_tourney_through, round + 1);
+    } else if (what == 3) {
+        send_tmpl(p, &t_tourney_score, round, score);
+    } else if (what == 4) {
+        const char *msg = "You are out of the tournament.\n";
+        send_client(p, msg, strlen(msg));
+    } else if (what == 5) {
+        const char *msg = "You left the tournament.\n";
+        send_client(p, msg, strlen(msg));
+    } else if (what == 6) {
+        const char *msg = "Not enough players entered, so the tournament is off.\n";
+        send_client(p, msg, strlen(msg));
+    }
+}
+
+/***
+Records the result of a tournament match that has just ended. A knockout
+loser is out and back in the lobby; everyone else waits for the next
+round. The last result of a round closes it.
+struct client *winner -> Player who won
+struct client *loser -> Player who lost
+int dropped -> 1 if the loser dropped and is being disconnected
+***/
+static void finish_pairing(struct client *winner, struct client *loser, int dropped) {
+    int left = tourney_result(&tourney, winner->pl->pairing, winner->pl->entry);
+    winner->pl->pairing = -1;
+    loser->pl->pairing = -1;
+    if (tourney.format == TOURNEY_SWISS || tourney.round < tourney.rounds) {
+        send_tourney(winner, 3, tourney.round, tourney.entrants[winner->pl->entry].score);
+    }
+    if (tourney.format == TOURNEY_ELIMINATION) {
+        tourney_withdraw(&tourney, loser->pl->entry);
+        loser->pl->entry = -1;
+        if (!dropped) {
+            send_tourney(loser, 4, tourney.round, 0);
+            return_to_lobby(loser);
+        }
+    } else if (!dropped) {
+        send_tourney(loser, 3, tourney.round, tourney.entrants[loser->pl->entry].score);
+    }
+    if (left == 0) {
+        round_done();
+    }
+}
+
+/***
+Logs how long the round that just ended took to start and to play, frees
+its matches and schedules what comes next.
+***/
+static void round_done(void) {
+    log_tourney(EV_ROUND, NULL, tourney.round, round_count, round_setup_us, (int)(current_ms() - round_started_ms));
+    free(round_matches);
+    round_matches = NULL;
+    timer_arm(&tourney_timer, TOURNEY_BREAK_MS);
+}
+
+/***
+Marks the tournament's next step as due; it is taken at the start of the
+loop iteration, where the client list is at hand.
+struct timer *t -> tourney_timer
+***/
+static void tourney_timer_due(struct timer *t) {
+    (void)t;
+    tourney_due = 1;
+}
+
+/***
+Takes the tournament's next step once tourney_timer has fired: closes
+registration and starts the first round, starts the next round, or ends
+the tournament when there is nothing left to play.
+struct client *top -> Front of this shard's client list
+Return -> Front of this shard's client list
+***/
+static struct client *run_tournament(struct client *top) {
+    if (!tourney_due) {
+        return top;
+    }
+    tourney_due = 0;
+    if (tourney.round == 0) {
+        __atomic_store_n(&tourney_open, 0, __ATOMIC_RELEASE);
+        if (tourney_active(&tourney) < 2) {
+            end_tournament(top, 1);
+            return top;
+        }
+        log_tourney(EV_TOURNEY, NULL, 0, tourney_active(&tourney), 0, 0);
+    }
+    if (tourney_over(&tourney)) {
+        end_tournament(top, 0);
+        return top;
+    }
+    start_round();
+    return top;
+}
+
+/***
+Draws the next round and starts all of its matches at once. Players with
+a bye are told so and sit the round out.
+***/
+static void start_round(void) {
+    struct timespec start, end;
+    struct payload *started;
+    uint64_t first_id;
+    int i, n = 0;
+    METRIC_START(setup_start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    tourney_next_round(&tourney);
+    round_matches = (struct match *)malloc((tourney.pending > 0 ? tourney.pending : 1) * sizeof(struct match));
+    round_timers = (struct timer **)realloc(round_timers, (tourney.pending > 0 ? tourney.pending : 1) * sizeof(struct timer *));
+    if (round_matches == NULL || round_timers == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    first_id = __atomic_add_fetch(&next_match_id, tourney.pending, __ATOMIC_RELAXED) - tourney.pending;
+    for (i = 0; i < tourney.npairs; i++) {
+        struct pairing *pr = &tourney.pairs[i];
+        struct client *a, *b;
+        if (pr->a < 0) {
+            continue;
+        }
+        a = (struct client *)tourney.entrants[pr->a].client;
+        if (pr->b < 0) {
+            send_tourney(a, 2, tourney.round, tourney.entrants[pr->a].score);
+            continue;
+        }
+        b = (struct client *)tourney.entrants[pr->b].client;
+        seat_match(a, b, &round_matches[n], first_id + n + 1);
+        a->pl->pairing = i;
+        b->pl->pairing = i;
+        round_timers[n++] = &(my_turn(a) ? a : b)->timer;
+    }
+    timer_arm_all(round_timers, n, TURN_SECONDS * 1000);
+    started = tmpl_payload(&t_round_started, tourney.round, tourney.rounds, TURN_SECONDS);
+    for (i = 0; i < tourney.npairs; i++) {
+        struct pairing *pr = &tourney.pairs[i];
+        if (pr->a >= 0 && pr->b >= 0) {
+            tell_match((struct client *)tourney.entrants[pr->a].client, (struct client *)tourney.entrants[pr->b].client, started);
+        }
+    }
+    release_payload(started);
+    METRIC_ADD(matches_started, n);
+    METRIC_OBSERVE(round_start, setup_start);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    round_setup_us = (int)((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
+    round_count = n;
+    round_started_ms = current_ms();
+    if (n == 0) {
+        round_done();
+    }
+}
+
+/***
+Ends the tournament: the winner is announced to the whole arena and
+everyone still entered goes back to the lobby, then registration opens
+for the next one. A tournament called off for want of entrants just
+sends its entrants back.
+struct client *top -> Front of this shard's client list
+int called_off -> 1 if registration closed with fewer than two entrants
+***/
+static void end_tournament(struct client *top, int called_off) {
+    int i, leader = called_off ? -1 : tourney_leader(&tourney);
+    if (leader >= 0) {
+        const struct entrant *e = &tourney.entrants[leader];
+        char body[3 + TOURNEY_NAME_LEN];
+        char frames[MAX_FRAME_BODY + 2];
+        int name_len = strlen(e->name);
+        body[0] = 7;
+        body[1] = (char)tourney.round;
+        body[2] = (char)e->score;
+        memcpy(body + 3, e->name, name_len);
+        broadcast(top, tmpl_payload(&t_tourney_won, e->name, name_len), frames, put_frame(frames, F_TOURNEY, body, 3 + name_len));
+        log_tourney(EV_TOURNEY, e->name, 1, tourney.round, 0, 0);
+    } else {
+        log_tourney(EV_TOURNEY, NULL, 2, tourney_active(&tourney), 0, 0);
+    }
+    for (i = 0; i < tourney.count; i++) {
+        struct client *p = (struct client *)tourney.entrants[i].client;
+        if (p == NULL) {
+            continue;
+        }
+        p->pl->entry = -1;
+        if (called_off) {
+            send_tourney(p, 6, 0, 0);
+        }
+        return_to_lobby(p);
+    }
+    tourney_free(&tourney);
+    __atomic_store_n(&tourney_open, 1, __ATOMIC_RELEASE);
+}
+
+#if METRICS
+/***
+Reads the monotonic clock in nanoseconds for the latency histograms.
+Return -> Nanoseconds since an arbitrary fixed point
+***/
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/***
+Adds to one of this shard's counters. The owning thread is the only
+writer, so a plain read and an atomic store are enough for the admin
+thread to never see a torn value.
+uint64_t *counter -> Counter in this shard's metrics
+uint64_t n -> Amount to add; gauges pass (uint64_t)-1 to go down
+***/
+static void metric_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/***
+Records one latency sample in a histogram.
+struct histogram *h -> Histogram in this shard's metrics
+uint64_t ns -> Sample in nanoseconds
+***/
+static void hist_observe(struct histogram *h, uint64_t ns) {
+    int b = 0;
+    if (ns >= (1ULL << HIST_MIN_SHIFT)) {
+        b = 64 - __builtin_clzll(ns) - HIST_MIN_SHIFT;
+        if (b > HIST_BUCKETS) {
+            b = HIST_BUCKETS;
+        }
+    }
+    metric_add(&h->buckets[b], 1);
+    metric_add(&h->sum_ns, ns);
+    metric_add(&h->count, 1);
+}
+
+/***
+Appends one counter or gauge to the metrics page, one line per shard.
+char *out -> Page being built
+int len -> Bytes already in the page
+int size -> Size of the page buffer
+const char *name -> Metric name
+const char *type -> "counter" or "gauge"
+const char *help -> One-line description
+size_t field -> offsetof the value in struct metrics
+Return -> New length of the page
+***/
+static int render_counter(char *out, int len, int size, const char *name, const char *type, const char *help, size_t field) {
+    int i;
+    if (len < size) {
+        len += snprintf(out + len, size - len, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    }
+    for (i = 0; i < nshards && len < size; i++) {
+        uint64_t v = __atomic_load_n((uint64_t *)((char *)&shards[i].metrics + field), __ATOMIC_RELAXED);
+        len += snprintf(out + len, size - len, "%s{shard=\"%d\"} %lld\n", name, i, (long long)v);
+    }
+    return len;
+}
+
+/***
+Appends one histogram to the metrics page, summed over all shards.
+char *out -> Page being built
+int len -> Bytes already in the page
+int size -> Size of the page buffer
+const char *name -> Metric name
+const char *help -> One-line description
+size_t field -> offsetof the histogram in struct metrics
+Return -> New length of the page
+***/
+static int render_histogram(char *out, int len, int size, const char *name, const char *help, size_t field) {
+    uint64_t buckets[HIST_BUCKETS + 1] = {0}, sum_ns = 0, count = 0, cumulative = 0;
+    int i, b;
+    for (i = 0; i < nshards; i++) {
+        struct histogram *h = (struct histogram *)((char *)&shards[i].metrics + field);
+        for (b = 0; b <= HIST_BUCKETS; b++) {
+            buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        }
+        sum_ns += __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED);
+        count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    }
+    if (len < size) {
+        len += snprintf(out + len, size - len, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    }
+    for (b = 0; b < HIST_BUCKETS && len < size; b++) {
+        cumulative += buckets[b];
+        len += snprintf(out + len, size - len, "%s_bucket{le=\"%g\"} %llu\n", name,
+                        (double)(1ULL << (b + HIST_MIN_SHIFT)) / 1e9, (unsigned long long)cumulative);
+    }
+    if (len < size) {
+        len += snprintf(out + len, size - len, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %g\n%s_count %llu\n",
+                        name, (unsigned long long)(cumulative + buckets[HIST_BUCKETS]),
+                        name, sum_ns / 1e9, name, (unsigned long long)count);
+    }
+    return len;
+}
+
+/***
+Appends the memory held for clients, by kind, and what that comes to per
+connection. Client records are counted for every connection, player
+records only once a name is confirmed, input buffers only while a client
+has unparsed input or is reading, and output chunks as allocated,
+including the ones pooled for reuse.
+char *out -> Page being built
+int len -> Bytes already in the page
+int size -> Size of the page buffer
+Return -> New length of the page
+***/
+static int render_memory(char *out, int len, int size) {
+    int64_t clients = 0, players = 0, inbufs = 0, feeds = 0, chunks = 0;
+    int i;
+    for (i = 0; i < nshards; i++) {
+        clients += (int64_t)__atomic_load_n(&shards[i].metrics.clients, __ATOMIC_RELAXED);
+        players += (int64_t)__atomic_load_n(&shards[i].metrics.players, __ATOMIC_RELAXED);
+        inbufs += (int64_t)__atomic_load_n(&shards[i].metrics.in_buffers, __ATOMIC_RELAXED);
+        feeds += (int64_t)__atomic_load_n(&shards[i].metrics.feeds, __ATOMIC_RELAXED);
+        chunks += (int64_t)__atomic_load_n(&shards[i].metrics.chunk_bytes, __ATOMIC_RELAXED);
+    }
+    clients *= sizeof(struct client);
+    players *= sizeof(struct player);
+    inbufs *= IN_BUF_SIZE;
+    feeds *= sizeof(struct feed);
+    if (len < size) {
+        len += snprintf(out + len, size - len,
+                        "# HELP battle_memory_bytes Memory held for clients, by kind.\n# TYPE battle_memory_bytes gauge\n"
+                        "battle_memory_bytes{kind=\"clients\"} %lld\nbattle_memory_bytes{kind=\"players\"} %lld\n"
+                        "battle_memory_bytes{kind=\"input_buffers\"} %lld\nbattle_memory_bytes{kind=\"output_chunks\"} %lld\n"
+                        "battle_memory_bytes{kind=\"feeds\"} %lld\n",
+                        (long long)clients, (long long)players, (long long)inbufs, (long long)chunks, (long long)feeds);
+    }
+    if (len < size) {
+        int64_t n = clients / (int64_t)sizeof(struct client);
+        len += snprintf(out + len, size - len,
+                        "# HELP battle_bytes_per_connection Memory held for clients divided by connected clients.\n# TYPE battle_bytes_per_connection gauge\n"
+                        "battle_bytes_per_connection %lld\n",
+                        (long long)(n > 0 ? (clients + players + inbufs + chunks + feeds) / n : 0));
+    }
+    return len;
+}
+
+/***
+Builds the metrics page in the Prometheus text format.
+char *out -> Buffer for the page
+int size -> Size of the buffer
+Return -> Length of the page, at most size - 1
+***/
+static int render_metrics(char *out, int size) {
+    int i, b, len = 0;
+    len = render_counter(out, len, size, "battle_bytes_received_total", "counter", "Bytes read from clients.", offsetof(struct metrics, bytes_in));
+    len = render_counter(out, len, size, "battle_bytes_sent_total", "counter", "Bytes written to clients.", offsetof(struct metrics, bytes_out));
+    len = render_counter(out, len, size, "battle_connections_accepted_total", "counter", "Connections accepted.", offsetof(struct metrics, accepted));
+    len = render_counter(out, len, size, "battle_connections_closed_total", "counter", "Connections closed.", offsetof(struct metrics, closed));
+    len = render_counter(out, len, size, "battle_commands_total", "counter", "Commands handled.", offsetof(struct metrics, commands));
+    len = render_counter(out, len, size, "battle_matches_started_total", "counter", "Matches started.", offsetof(struct metrics, matches_started));
+    len = render_counter(out, len, size, "battle_matches_finished_total", "counter", "Matches won by knockout or by a drop.", offsetof(struct metrics, matches_finished));
+    len = render_counter(out, len, size, "battle_turn_timeouts_total", "counter", "Turns that ran out of time.", offsetof(struct metrics, timeouts));
+    len = render_counter(out, len, size, "battle_matchmaker_calls_total", "counter", "Opponent searches.", offsetof(struct metrics, matchmaker_calls));
+    len = render_counter(out, len, size, "battle_matchmaker_scanned_total", "counter", "Waiting players looked at by opponent searches.", offsetof(struct metrics, matchmaker_scanned));
+    len = render_counter(out, len, size, "battle_match_wait_milliseconds_total", "counter", "Time matched players spent waiting, summed over both players of every match.", offsetof(struct metrics, match_wait_ms));
+    len = render_counter(out, len, size, "battle_match_rating_gap_total", "counter", "Rating difference between the players of every match started, summed.", offsetof(struct metrics, rating_gap));
+    len = render_counter(out, len, size, "battle_clients", "gauge", "Connected clients.", offsetof(struct metrics, clients));
+    len = render_counter(out, len, size, "battle_spectators", "gauge", "Clients watching a match.", offsetof(struct metrics, spectators));
+    len = render_counter(out, len, size, "battle_spectator_skips_total", "counter", "Times a spectator fell behind and was skipped ahead.", offsetof(struct metrics, spectator_skips));
+    len = render_counter(out, len, size, "battle_spectators_dropped_total", "counter", "Spectators dropped for falling behind.", offsetof(struct metrics, spectators_dropped));
+    len = render_counter(out, len, size, "battle_handshake_timeouts_total", "counter", "Connections closed for not confirming a name in time.", offsetof(struct metrics, handshake_timeouts));
+    len = render_counter(out, len, size, "battle_io_syscalls_total", "counter", "System calls made for socket I/O: waits, accepts, reads, writes and epoll_ctl, or io_uring_enter.", offsetof(struct metrics, io_syscalls));
+    len = render_counter(out, len, size, "battle_rejected_address_total", "counter", "Connections turned away because their address was over its connection rate.", offsetof(struct metrics, rejected_ip));
+    len = render_counter(out, len, size, "battle_rejected_rate_total", "counter", "Connections turned away because the arena was over its connection rate.", offsetof(struct metrics, rejected_rate));
+    len = render_counter(out, len, size, "battle_rejected_pending_total", "counter", "Connections turned away because too many were still choosing a name.", offsetof(struct metrics, rejected_pending));
+    len = render_counter(out, len, size, "battle_federation_arrivals_total", "counter", "Players sent here by another process of the federation.", offsetof(struct metrics, fed_in));
+    len = render_counter(out, len, size, "battle_federation_departures_total", "counter", "Players sent to another process of the federation.", offsetof(struct metrics, fed_out));
+    len = render_counter(out, len, size, "battle_players", "gauge", "Clients with a confirmed name.", offsetof(struct metrics, players));
+    len = render_memory(out, len, size);
+    if (len < size) {
+        len += snprintf(out + len, size - len, "# HELP battle_waiting_players Players waiting for an opponent.\n# TYPE battle_waiting_players gauge\n");
+    }
+    for (i = 0; i < nshards && len < size; i++) {
+        len += snprintf(out + len, size - len, "battle_waiting_players{shard=\"%d\"} %d\n", i, __atomic_load_n(&shards[i].waiting, __ATOMIC_RELAXED));
+    }
+    if (len < size) {
+        len += snprintf(out + len, size - len,
+                        "# HELP battle_stats_records Players with a stored record.\n# TYPE battle_stats_records gauge\nbattle_stats_records %llu\n"
+                        "# HELP battle_stats_dropped_total Match results lost because the stats queue was full.\n# TYPE battle_stats_dropped_total counter\nbattle_stats_dropped_total %llu\n",
+                        (unsigned long long)stats_records(), (unsigned long long)stats_dropped());
+    }
+    if (len < size) {
+        len += snprintf(out + len, size - len, "# HELP battle_waiting_by_rating Players waiting for an opponent, by rating band.\n# TYPE battle_waiting_by_rating gauge\n");
+    }
+    for (b = 0; b < RATING_BANDS && len < size; b++) {
+        int n = 0;
+        for (i = 0; i < nshards; i++) {
+            n += __atomic_load_n(&shards[i].band_waiting[b], __ATOMIC_RELAXED);
+        }
+        if (n > 0) {
+            len += snprintf(out + len, size - len, "battle_waiting_by_rating{band=\"%d\"} %d\n", b * RATING_BAND, n);
+        }
+    }
+    len = render_histogram(out, len, size, "battle_loop_seconds", "Event loop iteration time, not counting the wait.", offsetof(struct metrics, loop));
+    len = render_histogram(out, len, size, "battle_command_seconds", "Time to handle one client command.", offsetof(struct metrics, command));
+    len = render_histogram(out, len, size, "battle_round_start_seconds", "Time to start every match of a tournament round.", offsetof(struct metrics, round_start));
+    return len < size ? len : size - 1;
+}
+
+/***
+Serves the metrics page on 127.0.0.1:ADMIN_PORT from its own thread, so
+scrapes never touch the shards' event loops. Each connection gets one
+HTTP/1.0 response with the page and is closed. If the port cannot be
+bound the arena keeps running without the endpoint.
+void *arg -> Unused
+***/
+void *run_admin(void *arg) {
+    struct sockaddr_in addr;
+    struct timeval tv = {1, 0};
+    struct timespec retry = {0, 100000000};
+    char req[1024], header[128];
+    int size = 16384 + nshards * 4096;
+    int fd, conn, bound, yes = 1, tries = 50;
+    char *page = (char *)malloc(size);
+    (void)arg;
+    if (page == NULL || (fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("admin");
+        free(page);
+        return NULL;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(ADMIN_PORT);
+    /* After a hot upgrade the old process holds the port until it exits. */
+    while ((bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr))) < 0 && errno == EADDRINUSE && tries-- > 0) {
+        nanosleep(&retry, NULL);
+    }
+    if (bound < 0 || listen(fd, 16) < 0) {
+        perror("admin bind");
+        close(fd);
+        free(page);
+        return NULL;
+    }
+    while (1) {
+        if ((conn = accept(fd, NULL, NULL)) < 0) {
+            if (errno != EINTR) {
+                perror("admin accept");
+            }
+            continue;
+        }
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (read(conn, req, sizeof(req)) >= 0) {
+            int len = render_metrics(page, size);
+            int hlen = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n", len);
+            if (write(conn, header, hlen) == hlen && write(conn, page, len) < 0) {
+                perror("admin write");
+            }
+        }
+        close(conn);
+    }
+    return NULL;
+}
+#endif
+
+/***
+Event log. Shards push fixed-size entries into a bounded lock-free ring
+(Vyukov's queue: each slot carries a sequence number, producers claim a
+slot with one compare-and-swap on the tail) and never wait on I/O. A
+background thread wakes every LOG_FLUSH_MS, turns everything in the ring
+into JSON lines and appends them to LOG_FILE with a single write. If the
+ring is full the event is dropped and counted rather than stalling a shard.
+log_close wakes the writer early for a last pass, before a hot upgrade
+hands the file to the new process.
+***/
+static struct log_slot log_ring[LOG_RING_SIZE];
+static uint64_t log_tail = 0;
+static uint64_t log_head = 0;
+static uint64_t log_dropped = 0;
+static int log_fd = -1;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static int log_closing = 0;
+static int log_closed = 0;
+
+/***
+Opens the event log and starts its writer thread. Runs before any shard.
+***/
+void init_event_log(void) {
+    pthread_t writer;
+    int i;
+    for (i = 0; i < LOG_RING_SIZE; i++) {
+        log_ring[i].seq = i;
+    }
+    log_fd = open(LOG_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd < 0) {
+        perror(LOG_FILE);
+        exit(1);
+    }
+    if (pthread_create(&writer, NULL, run_event_log, NULL) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
+        exit(1);
+    }
+    pthread_detach(writer);
+}
+
+/***
+Has the writer write out everything queued so far and stop. Returns once
+it has; events recorded after that are never written.
+***/
+void log_close(void) {
+    pthread_mutex_lock(&log_lock);
+    log_closing = 1;
+    pthread_cond_broadcast(&log_cond);
+    while (!log_closed) {
+        pthread_cond_wait(&log_cond, &log_lock);
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+/***
+Claims the next slot of the event ring and stamps it with the time, the
+event type and the shard. Safe to call from any shard at the same time.
+int type -> What happened (enum log_type)
+uint64_t *pos -> Set to the slot's position; the slot is published by
+storing pos + 1 in its seq once it is filled in
+Return -> The slot, or NULL if the ring is full and the event is dropped
+***/
+static struct log_slot *log_claim(int type, uint64_t *pos) {
+    struct log_slot *slot;
+    struct timespec ts;
+    *pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+    while (1) {
+        slot = &log_ring[*pos & (LOG_RING_SIZE - 1)];
+        int64_t diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - *pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log_tail, pos, *pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        } else {
+            *pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+        }
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    slot->ev.ts_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    slot->ev.type = type;
+    slot->ev.shard = self != NULL ? self->id : -1;
+    return slot;
+}
+
+/***
+Records an event. Safe to call from any shard at the same time.
+int type -> What happened (enum log_type)
+const struct client *p -> Player the event is about
+const struct client *other -> Their opponent, or NULL
+int a -> Damage for an attack; 1 for a result decided by a drop
+int b -> 1 if an attack was a power move
+***/
+static void log_event(int type, const struct client *p, const struct client *other, int a, int b) {
+    uint64_t pos;
+    struct log_slot *slot = log_claim(type, &pos);
+    if (slot == NULL) {
+        return;
+    }
+    slot->ev.a = a;
+    slot->ev.b = b;
+    slot->ev.addr = p->ipaddr;
+    slot->ev.match_id = p->pl != NULL ? p->pl->match_id : 0;
+    slot->ev.seed = p->pl != NULL && p->pl->match != NULL ? p->pl->match->seed : 0;
+    memcpy(slot->ev.player, p->name, MAX_NAME_LEN);
+    if (other != NULL) {
+        memcpy(slot->ev.other, other->name, MAX_NAME_LEN);
+    } else {
+        slot->ev.other[0] = '\0';
+    }
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/***
+Records a tournament event, which is about the tournament rather than one
+client.
+int type -> EV_ROUND or EV_TOURNEY
+const char *name -> The champion's name for a won tournament, or NULL
+int a -> Round number; for EV_TOURNEY 0 closed, 1 won, 2 called off
+int b -> Matches in the round; entrants, or rounds played once won
+int c -> Microseconds the round took to start
+int d -> Milliseconds the round took to play
+***/
+static void log_tourney(int type, const char *name, int a, int b, int c, int d) {
+    uint64_t pos;
+    struct log_slot *slot = log_claim(type, &pos);
+    if (slot == NULL) {
+        return;
+    }
+    slot->ev.a = a;
+    slot->ev.b = b;
+    slot->ev.c = c;
+    slot->ev.d = d;
+    slot->ev.match_id = 0;
+    slot->ev.seed = 0;
+    memset(&slot->ev.addr, 0, sizeof(slot->ev.addr));
+    snprintf(slot->ev.player, MAX_NAME_LEN, "%s", name != NULL ? name : "");
+    slot->ev.other[0] = '\0';
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/***
+Appends a name as a JSON string; names are whatever the client typed.
+char *out -> Where the string goes, room for 6 bytes per name byte + 2
+const char *name -> NUL-terminated name
+Return -> Number of bytes written
+***/
+static int json_string(char *out, const char *name) {
+    static const char hex[] = "0123456789abcdef";
+    char *o = out;
+    int i;
+    *o++ = '"';
+    for (i = 0; i < MAX_NAME_LEN && name[i] != '\0'; i++) {
+        unsigned char c = (unsigned char)name[i];
+        if (c == '"' || c == '\\') {
+            *o++ = '\\';
+            *o++ = c;
+        } else if (c < 0x20 || c >= 0x7f) {
+            memcpy(o, "\\u00", 4);
+            o[4] = hex[c >> 4];
+            o[5] = hex[c & 15];
+            o += 6;
+        } else {
+            *o++ = c;
+        }
+    }
+    *o++ = '"';
+    return o - out;
+}
+
+/***
+Formats one event as a line of JSON.
+char *out -> Room for at least 512 bytes
+const struct log_event *ev -> Event to format
+Return -> Length of the line including its newline
+***/
+static int format_event(char *out, const struct log_event *ev) {
+    static const char *names[] = {"connect", "name", "match_start", "attack", "timeout", "result", "kick", "disconnect", "round", "tourney"};
+    static const char *outcomes[] = {"closed", "won", "called_off"};
+    char addr[INET_ADDRSTRLEN];
+    int len = sprintf(out, "{\"ts\":%llu,\"shard\":%d,\"ev\":\"%s\"",
+                      (unsigned long long)ev->ts_ms, ev->shard, names[ev->type]);
+    switch (ev->type) {
+    case EV_CONNECT:
+    case EV_DISCONNECT:
+        inet_ntop(AF_INET, &ev->addr, addr, sizeof(addr));
+        len += sprintf(out + len, ",\"addr\":\"%s\"", addr);
+        if (ev->player[0] != '\0') {
+            len += sprintf(out + len, ",\"player\":");
+            len += json_string(out + len, ev->player);
+        }
+        break;
+    case EV_NAME:
+    case EV_KICK:
+        len += sprintf(out + len, ",\"player\":");
+        len += json_string(out + len, ev->player);
+        if (ev->type == EV_KICK) {
+            len += sprintf(out + len, ",\"queued\":%d", ev->a);
+        }
+        break;
+    case EV_MATCH_START:
+        len += sprintf(out + len, ",\"match\":%llu,\"first\":", (unsigned long long)ev->match_id);
+        len += json_string(out + len, ev->player);
+        len += sprintf(out + len, ",\"second\":");
+        len += json_string(out + len, ev->other);
+        len += sprintf(out + len, ",\"seed\":%llu", (unsigned long long)ev->seed);
+        break;
+    case EV_ATTACK:
+        len += sprintf(out + len, ",\"match\":%llu,\"player\":", (unsigned long long)ev->match_id);
+        len += json_string(out + len, ev->player);
+        len += sprintf(out + len, ",\"target\":");
+        len += json_string(out + len, ev->other);
+        len += sprintf(out + len, ",\"damage\":%d,\"power\":%d", ev->a, ev->b);
+        break;
+    case EV_TIMEOUT:
+        len += sprintf(out + len, ",\"match\":%llu,\"player\":", (unsigned long long)ev->match_id);
+        len += json_string(out + len, ev->player);
+        break;
+    case EV_RESULT:
+        len += sprintf(out + len, ",\"match\":%llu,\"winner\":", (unsigned long long)ev->match_id);
+        len += json_string(out + len, ev->player);
+        len += sprintf(out + len, ",\"loser\":");
+        len += json_string(out + len, ev->other);
+        len += sprintf(out + len, ",\"by\":\"%s\"", ev->a ? "drop" : "ko");
+        break;
+    case EV_ROUND:
+        len += sprintf(out + len, ",\"round\":%d,\"matches\":%d,\"setup_us\":%d,\"played_ms\":%d", ev->a, ev->b, ev->c, ev->d);
+        break;
+    case EV_TOURNEY:
+        len += sprintf(out + len, ",\"outcome\":\"%s\"", outcomes[ev->a]);
+        if (ev->a == 1) {
+            len += sprintf(out + len, ",\"winner\":");
+            len += json_string(out + len, ev->player);
+            len += sprintf(out + len, ",\"rounds\":%d", ev->b);
+        } else {
+            len += sprintf(out + len, ",\"entrants\":%d", ev->b);
+        }
+        break;
+    }
+    out[len++] = '}';
+    out[len++] = '\n';
+    return len;
+}
+
+/***
+Writes a batch to the log file, retrying short writes.
+const char *buf -> JSON lines
+int len -> Number of bytes
+***/
+static void write_batch(const char *buf, int len) {
+    while (len > 0) {
+        ssize_t n = write(log_fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror(LOG_FILE);
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/***
+Background writer of the event log. Every LOG_FLUSH_MS it empties the
+ring, formatting into a batch buffer that is written out whenever it
+fills up and once more at the end of the pass. After the pass log_close
+asked for, it stops.
+void *arg -> Unused
+***/
+void *run_event_log(void *arg) {
+    static char batch[LOG_BATCH_MAX];
+    struct timespec deadline;
+    struct log_event ev;
+    uint64_t dropped;
+    int len, stop;
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&log_lock);
+        if (!log_closing) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (LOG_FLUSH_MS % 1000) * 1000000L;
+            deadline.tv_sec += LOG_FLUSH_MS / 1000 + deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&log_cond, &log_lock, &deadline);
+        }
+        stop = log_closing;
+        pthread_mutex_unlock(&log_lock);
+        len = 0;
+        while (1) {
+            struct log_slot *slot = &log_ring[log_head & (LOG_RING_SIZE - 1)];
+            if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log_head + 1) {
+                break;
+            }
+            ev = slot->ev;
+            __atomic_store_n(&slot->seq, log_head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+            log_head++;
+            if (len > LOG_BATCH_MAX - 512) {
+                write_batch(batch, len);
+                len = 0;
+            }
+            len += format_event(batch + len, &ev);
+        }
+        dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+        if (dropped > 0) {
+            if (len > LOG_BATCH_MAX - 512) {
+                write_batch(batch, len);
+                len = 0;
+            }
+            len += sprintf(batch + len, "{\"ev\":\"log_dropped\",\"count\":%llu}\n", (unsigned long long)dropped);
+        }
+        if (len > 0) {
+            write_batch(batch, len);
+        }
+        if (stop) {
+            pthread_mutex_lock(&log_lock);
+            log_closed = 1;
+            pthread_cond_broadcast(&log_cond);
+            pthread_mutex_unlock(&log_lock);
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/***
+Hot upgrade. A new binary started with -u connects to the running
+server's Unix socket. The old server first says which version of client
+records it hands over, and carries on serving if the new one cannot read
+them. Otherwise it freezes every shard, has the event log and stats
+writers finish, and sends the new one a header, its listening sockets
+and every client socket (SCM_RIGHTS, in batches), then a record per
+client and the output they had not been sent yet. It exits
+once the new process acknowledges. Listeners never close, so connections
+that arrive meanwhile wait in the accept queue; matches carry on with the
+same rules state and turn deadlines, since both processes read the same
+monotonic clock.
+***/
+
+/***
+Builds the path of the upgrade socket for this listen_port.
+struct sockaddr_un *addr -> Filled in with the path
+***/
+static void upgrade_addr(struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    snprintf(addr->sun_path, sizeof(addr->sun_path), "%s-%d.sock", UPGRADE_SOCK, listen_port);
+}
+
+/***
+Receives the running server's state for a hot upgrade. Runs before any
+shard starts and exits if anything goes wrong. If the running server
+hands over records this build cannot read, it is told so before it
+freezes and keeps serving; past that point it is left frozen, so the
+operator has to restart it.
+***/
+static void take_over(void) {
+    struct sockaddr_un addr;
+    struct handoff_hello hello;
+    struct handoff_header h;
+    int sock, i;
+    upgrade_addr(&addr);
+    if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(addr.sun_path);
+        exit(1);
+    }
+    if (read_all(sock, &hello, sizeof(hello)) < 0 || hello.magic != HANDOFF_MAGIC) {
+        fprintf(stderr, "bad upgrade handoff\n");
+        exit(1);
+    }
+    if (hello.version != HANDOFF_VERSION || hello.record_size != sizeof(struct handoff_client)) {
+        fprintf(stderr, "cannot take over: the running server hands over version %u records of %u bytes, this build reads version %d records of %d bytes\n",
+                hello.version, hello.record_size, HANDOFF_VERSION, (int)sizeof(struct handoff_client));
+        write_all(sock, "N", 1);
+        exit(1);
+    }
+    if (write_all(sock, "G", 1) < 0) {
+        perror("write");
+        exit(1);
+    }
+    if (read_all(sock, &h, sizeof(h)) < 0 || h.magic != HANDOFF_MAGIC ||
+        h.nlisten > MAX_SHARDS || h.nclients < 0 || h.out_bytes < 0) {
+        fprintf(stderr, "bad upgrade handoff\n");
+        exit(1);
+    }
+    handoff_fds = (int *)malloc((h.nclients + 1) * sizeof(int));
+    handoff = (struct handoff_client *)malloc((h.nclients + 1) * sizeof(struct handoff_client));
+    handoff_restored = (struct client **)calloc(h.nclients + 1, sizeof(struct client *));
+    handoff_out = (char *)malloc(h.out_bytes + 1);
+    if (handoff_fds == NULL || handoff == NULL || handoff_restored == NULL || handoff_out == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    if (recv_fds(sock, handoff_listen, h.nlisten) < 0 || recv_fds(sock, handoff_fds, h.nclients) < 0 ||
+        read_all(sock, handoff, h.nclients * sizeof(struct handoff_client)) < 0 ||
+        read_all(sock, handoff_out, h.out_bytes) < 0) {
+        fprintf(stderr, "upgrade handoff cut short\n");
+        exit(1);
+    }
+    if (write_all(sock, "K", 1) < 0) {
+        perror("write");
+    }
+    close(sock);
+    for (i = 0; i < h.nlisten; i++) {
+        fcntl(handoff_listen[i], F_SETFD, FD_CLOEXEC);
+    }
+    handoff_nlisten = h.nlisten;
+    handoff_count = h.nclients;
+    handoff_out_bytes = h.out_bytes;
+    next_match_id = h.next_match_id;
+    seed_base = h.seed_base;
+}
+
+/***
+Checks that the lengths and offsets in a client record another process
+sent fit the buffers they index, before anything is copied with them.
+const struct handoff_client *r -> Record as received
+Return -> 1 if it can be used, 0 if not
+***/
+static int valid_record(const struct handoff_client *r) {
+    return r->name_len >= 0 && r->name_len < MAX_NAME_LEN && r->name[r->name_len] == '\0' &&
+           r->message_length >= 0 && r->message_length <= MAX_MESSAGE_LEN &&
+           r->in_start >= 0 && r->in_len >= 0 && r->in_start <= IN_BUF_SIZE - r->in_len &&
+           (r->side == 0 || r->side == 1) && r->out_off >= 0 && r->out_len >= 0;
+}
+
+/***
+Rebuilds this shard's share of the clients from a hot upgrade: those the
+old server had on shard id modulo nshards, so both players of a match
+land together. A first pass gives every record a client slot and
+registers its socket; a second links last opponents on this shard,
+rebuilds matches, re-arms turn timers and refills the waiting queue.
+struct client *top -> Front of this shard's client list
+int epfd -> This shard's epoll instance
+Return -> Updated front of the client list
+***/
+static struct client *restore_clients(struct client *top, int epfd) {
+    int i, j;
+    for (i = 0; i < handoff_count; i++) {
+        struct handoff_client *r = &handoff[i];
+        struct client *p;
+        if (r->shard % nshards != self->id) {
+            continue;
+        }
+        if (!valid_record(r) || r->out_off > handoff_out_bytes - r->out_len) {
+            close(handoff_fds[i]);
+            continue;
+        }
+        if ((p = revive_client(r, handoff_fds[i], epfd)) == NULL) {
+            continue;
+        }
+        send_client(p, handoff_out + r->out_off, r->out_len);
+        METRIC_ADD(clients, 1);
+        p->next = top;
+        if (top != NULL) {
+            top->prev = p;
+        }
+        top = p;
+        client_count++;
+        handoff_restored[i] = p;
+    }
+    for (i = 0; i < handoff_count; i++) {
+        struct handoff_client *r = &handoff[i];
+        struct client *p, *q = NULL;
+        if (r->shard % nshards != self->id || (p = handoff_restored[i]) == NULL || p->pl == NULL) {
+            continue;
+        }
+        if (r->opponent >= 0 && r->opponent < handoff_count && handoff[r->opponent].shard % nshards == self->id) {
+            q = handoff_restored[r->opponent];
+        }
+        if (q != NULL && q->pl == NULL) {
+            q = NULL;
+        }
+        if (q != NULL) {
+            p->pl->last_opponent = q;
+            p->pl->last_opponent_gen = q->gen;
+        }
+        if (p->in_game && q == NULL) {
+            p->in_game = 0;
+        } else if (p->in_game && p->pl->side == 0) {
+            struct match *m = (struct match *)malloc(sizeof(struct match));
+            if (m == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+            m->seed = r->match_seed;
+            m->rng.state = r->match_rng;
+            for (j = 0; j < 2; j++) {
+                m->fighter[j].hitpoints = r->hitpoints[j];
+                m->fighter[j].powermoves = r->powermoves[j];
+            }
+            m->turn = r->turn;
+            m->winner = r->winner;
+            m->moves = r->moves;
+            p->pl->match = m;
+            q->pl->match = m;
+        }
+        if (p->in_game && r->turn_expires != 0) {
+            long ms = (long)(r->turn_expires * TIMER_TICK_MS - current_ms());
+            timer_arm(&p->timer, ms > 0 ? ms : 0);
+        }
+        if (p->name_entered && (r->waiting || (r->in_game && !p->in_game))) {
+            enqueue_waiting(p);
+            p->pl->wait_since = r->waiting ? r->wait_since : current_ms();
+        }
+    }
+    return top;
+}
 
 /***
-Helps setup the TCP server on the PORT 51621 (My Port).
-Creates a socket and binds it to a PORT, and listens for any connections.
-If success, it listens on the port, and returns a file descriptor.
-On failure it prints error to std-error and exits.
+Gives a client handed over from another process a slot on this shard and
+registers its socket. A player whose name is free here gets their player
+record back; anyone else is left at the name prompt.
+struct handoff_client *r -> The client as the other process had them
+int fd -> Their socket
+int epfd -> This shard's epoll instance
+Return -> The client, not yet on any list, or NULL if it was closed
 ***/
-int bindandlisten(void) {
-    int listenfd;
-    struct sockaddr_in serveraddr;
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket");
-        exit(1);
+static struct client *revive_client(struct handoff_client *r, int fd, int epfd) {
+    struct client *p;
+    struct in_addr addr;
+    if ((p = alloc_client()) == NULL) {
+        close(fd);
+        return NULL;
     }
-    int yes = 1;
-    if ((setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))) == -1) {
-        perror("setsockopt");
-        exit(1);
+    addr.s_addr = r->ipaddr;
+    init_client(p, fd, addr);
+    memcpy(p->name, r->name, MAX_NAME_LEN);
+    p->name_len = r->name_len;
+    p->binary = r->binary;
+    p->hello_checked = r->hello_checked;
+    if (r->in_len > 0) {
+        attach_inbuf(p);
+        memcpy(p->inbuf, r->inbuf, IN_BUF_SIZE);
     }
-    memset(&serveraddr, 0, sizeof(serveraddr));
-    serveraddr.sin_family = AF_INET;
-    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY); 
-    serveraddr.sin_port = htons(PORT); 
-    if (bind(listenfd, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0) {
-        perror("bind");
-        exit(1);
+    p->in_start = r->in_start;
+    p->in_len = r->in_len;
+    p->in_game = r->in_game;
+    p->closing = r->closing;
+    if (register_socket(p, epfd) < 0) {
+        perror("epoll_ctl");
+        close(p->fd);
+        pending_names--;
+        free_client(p);
+        return NULL;
     }
-    if (listen(listenfd, 5) < 0) { 
-        perror("listen");
-        exit(1);
+    if (r->name_entered && register_name(p) == 0) {
+        p->name_entered = 1;
+        promote_client(p);
+        p->pl->is_messaging = r->is_messaging;
+        memcpy(p->pl->message, r->message, sizeof(p->pl->message));
+        p->pl->message_length = r->message_length;
+        p->pl->side = r->side;
+        p->pl->match_damage = r->match_damage;
+        p->pl->rating = r->rating;
+        p->pl->match_id = r->match_id;
+    } else {
+        p->in_game = 0;
     }
-    printf("Server listening on port %d\n", PORT);
-    return listenfd;
+    return p;
 }
 
 /***
-Initalizes a server state and handles multiple TCP connections
-Uses PORT and stores client IP address to server, and handles 
-disconnection as well. Select is used for handling multiple 
-clients, and new client's file descriptor is added. 
-Takes addclient, handleclient, and disconnect_client to process
-clients.
+Waits on the upgrade socket for a new binary to take over, and hands the
+arena to it. Runs on the main thread for the life of the server. If the
+socket cannot be set up the server runs on without hot upgrades.
 ***/
-int main(void) {
-    int listenfd, newfd, maxfd;
-    fd_set allset, rset;
-    struct client *head = NULL, *p, *next_p;
-    struct sockaddr_in clientaddr;
-    socklen_t addrlen;
-    listenfd = bindandlisten(); 
-    maxfd = listenfd;
-    FD_ZERO(&allset);
-    FD_SET(listenfd, &allset);
-    while (1) {
-        rset = allset; 
-        if (select(maxfd + 1, &rset, NULL, NULL, NULL) < 0) {
-            perror("select");
-            continue; 
+static void serve_upgrades(void) {
+    struct sockaddr_un addr;
+    struct timespec start, end;
+    int fd, conn, i;
+    upgrade_addr(&addr);
+    unlink(addr.sun_path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        perror(addr.sun_path);
+        for (i = 0; i < nshards; i++) {
+            pthread_join(shards[i].thread, NULL);
         }
-        if (FD_ISSET(listenfd, &rset)) { 
-            addrlen = sizeof(clientaddr);
-            newfd = accept(listenfd, (struct sockaddr *)&clientaddr, &addrlen);
-            if (newfd < 0) {
+        return;
+    }
+    while (1) {
+        if ((conn = accept(fd, NULL, NULL)) < 0) {
+            if (errno != EINTR) {
                 perror("accept");
-                continue;
             }
-            printf("New connection from %s\n", inet_ntoa(clientaddr.sin_addr));
-            head = addclient(head, newfd, clientaddr.sin_addr);
-            FD_SET(newfd, &allset);
-            if (newfd > maxfd) maxfd = newfd;
+            continue;
+        }
+        if (offer_handoff(conn) < 0) {
+            fprintf(stderr, "the new binary turned the upgrade down, still serving\n");
+            close(conn);
+            continue;
         }
-        for (p = head; p != NULL; p = next_p) { 
-            next_p = p->next; 
-            if (FD_ISSET(p->fd, &rset)) {
-                if (handleclient(p, head) == -1) {
-                    disconnect_client(p, &head, &allset, &maxfd); 
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        i = hand_off(conn);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (i < 0) {
+            fprintf(stderr, "upgrade failed, the arena is frozen\n");
+            exit(1);
+        }
+        printf("Handed %d clients over in %.1f ms\n", i,
+               (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+        exit(0);
+    }
+}
+
+/***
+Stops every shard at the end of its current loop iteration and waits
+until all of them have. Players that were on their way between shards
+are then taken out of the inboxes and put on the receiving shard's list.
+***/
+static void freeze_shards(void) {
+    struct shard_msg *msg, *next;
+    int i;
+    for (i = 0; i < nshards; i++) {
+        post_shard_msg(&shards[i], MSG_FREEZE, NULL, NULL, NULL);
+    }
+    for (i = 0; i < nshards; i++) {
+        pthread_join(shards[i].thread, NULL);
+    }
+    for (i = 0; i < nshards; i++) {
+        msg = __atomic_exchange_n(&shards[i].inbox, NULL, __ATOMIC_ACQUIRE);
+        for (; msg != NULL; msg = next) {
+            next = msg->next;
+            if (msg->type == MSG_ADOPT || msg->type == MSG_WATCH) {
+                msg->client->prev = NULL;
+                msg->client->next = shards[i].clients;
+                shards[i].clients = msg->client;
+            } else if (msg->type == MSG_BROADCAST) {
+                release_payload(msg->payload);
+                release_payload(msg->frames);
+            } else if (msg->type != MSG_FREEZE) {
+                if (msg->fd >= 0) {
+                    close(msg->fd);
                 }
+                release_payload(msg->payload);
             }
+            free(msg);
         }
     }
-    close(listenfd);
+}
+
+/***
+Tells a new process what records it would get, before anything is frozen.
+int conn -> Connection from the new process
+Return -> 0 if it can take them, -1 if it turned them down or went away
+***/
+static int offer_handoff(int conn) {
+    struct handoff_hello hello;
+    char answer;
+    hello.magic = HANDOFF_MAGIC;
+    hello.version = HANDOFF_VERSION;
+    hello.record_size = sizeof(struct handoff_client);
+    if (write_all(conn, &hello, sizeof(hello)) < 0 || read_all(conn, &answer, 1) < 0 || answer != 'G') {
+        return -1;
+    }
     return 0;
 }
 
 /***
-Adds a new client to the linked list of clients with a 
-welcome message. Dynamically allocates memory for a new client.
-Handles error if memory allocations fails.
-struct client *top -> First client in linked list 
-int fd -> File descriptor of client connection
-struct in_addr addr -> IP address of new client
-Return -> A pointer to top which is first client in linked list
+Hands the arena to a new process over an accepted upgrade connection.
+int conn -> Connection from the new process
+Return -> Number of clients handed over, or -1 if the transfer failed
 ***/
-static struct client *addclient(struct client *top, int fd, struct in_addr addr) {
-    struct client *newclient = (struct client *)malloc(sizeof(struct client));
-    if (newclient == NULL) {
+static int hand_off(int conn) {
+    struct handoff_header h;
+    struct handoff_client *recs;
+    struct client *p;
+    struct outchunk *c;
+    int base[MAX_SHARDS + 1], listenfds[MAX_SHARDS];
+    int *slot_index, *fds, i, n = 0, out_bytes = 0, status = 0;
+    char *out, ack;
+    freeze_shards();
+    log_close();
+    stats_close();
+    base[0] = 0;
+    for (i = 0; i < nshards; i++) {
+        base[i + 1] = base[i] + shards[i].slab_size;
+        listenfds[i] = shards[i].listenfd;
+        for (p = shards[i].clients; p != NULL; p = p->next) {
+            n++;
+            out_bytes += p->out_bytes;
+        }
+    }
+    slot_index = (int *)malloc(base[nshards] * sizeof(int));
+    recs = (struct handoff_client *)calloc(n + 1, sizeof(struct handoff_client));
+    fds = (int *)malloc((n + 1) * sizeof(int));
+    out = (char *)malloc(out_bytes + 1);
+    if (slot_index == NULL || recs == NULL || fds == NULL || out == NULL) {
         perror("malloc");
         exit(1);
     }
-    newclient->is_messaging = 0;
-    newclient->message[0] = '\0'; 
-    newclient->message_length = 0;
-    newclient->name_entered = 0;
-    newclient->fd = fd;
-    newclient->ipaddr = addr;
-    newclient->in_game = 0;
-    newclient->last_opponent = NULL;
-    memset(newclient->name, 0, sizeof(newclient->name));
-    newclient->next = NULL;  
-    const char *welcome = "Welcome! Please enter your name: ";
-    if (write(fd, welcome, strlen(welcome)) < 0) {
-        perror("write");
-        free(newclient);
-        return top;
+    memset(slot_index, -1, base[nshards] * sizeof(int));
+    n = 0;
+    for (i = 0; i < nshards; i++) {
+        for (p = shards[i].clients; p != NULL; p = p->next) {
+            slot_index[base[p->home] + (p - shards[p->home].slab)] = n++;
+        }
     }
-    if (top == NULL) {
-        return newclient;
-    } else {
-        struct client *cur = top;
-        while (cur->next != NULL) {
-            cur = cur->next;
+    n = 0;
+    out_bytes = 0;
+    for (i = 0; i < nshards; i++) {
+        for (p = shards[i].clients; p != NULL; p = p->next, n++) {
+            struct handoff_client *r = &recs[n];
+            struct client *q = p->pl != NULL ? p->pl->last_opponent : NULL;
+            r->shard = i;
+            r->opponent = -1;
+            if (q != NULL && q->gen == p->pl->last_opponent_gen) {
+                r->opponent = slot_index[base[q->home] + (q - shards[q->home].slab)];
+            }
+            pack_client(p, r);
+            r->out_off = out_bytes;
+            for (c = p->out_head; c != NULL; c = c->next) {
+                memcpy(out + out_bytes, (c->shared ? c->shared->data : c->data) + c->off, c->len - c->off);
+                out_bytes += c->len - c->off;
+            }
+            r->out_len = out_bytes - r->out_off;
+            fds[n] = p->fd;
         }
-        cur->next = newclient;
     }
-    return top;
+    h.magic = HANDOFF_MAGIC;
+    h.nlisten = nshards;
+    h.nclients = n;
+    h.out_bytes = out_bytes;
+    h.next_match_id = next_match_id;
+    h.seed_base = seed_base;
+    if (write_all(conn, &h, sizeof(h)) < 0 || send_fds(conn, listenfds, nshards) < 0 ||
+        send_fds(conn, fds, n) < 0 || write_all(conn, recs, n * sizeof(struct handoff_client)) < 0 ||
+        write_all(conn, out, out_bytes) < 0 || read_all(conn, &ack, 1) < 0 || ack != 'K') {
+        perror("upgrade");
+        status = -1;
+    }
+    close(conn);
+    free(slot_index);
+    free(recs);
+    free(fds);
+    free(out);
+    return status < 0 ? -1 : n;
 }
 
 /***
-Majority of the work and game logic happens here. This function handles 
-client features, inputs, game state, and messages. It manages player and
-the opponent, switching turns, and reading inputs at 1 character at a time.
-1. Ensures unique names and prevents duplicates
-2. Handles attack, powermove, speak, timeleft
-3. Switching turns, and 30 second timer
-4. Sending client(s) information through snprintf and broadcast
-struct client *p -> Pointer to a clients struct information
-struct client *top -> Front of a client list
-Return -> Return 0 on success, otherwise -1 for client disconnection
+Writes down everything about a client another process needs to carry on
+with them, except who their opponent is and their pending output.
+struct client *p -> Client being handed over
+struct handoff_client *r -> Zeroed record to fill in
 ***/
-int handleclient(struct client *p, struct client *top) {
-    char buf[256], outbuf[512];
-    int len;
-    len = read(p->fd, buf, 1);
-    if (len > 0) {
-        buf[len] = '\0'; 
-        if (!p->in_game && p->name_entered && p->last_opponent == NULL) {
-            if (!p->is_turn) {
-                return 0; 
-            }
+static void pack_client(struct client *p, struct handoff_client *r) {
+    r->ipaddr = p->ipaddr.s_addr;
+    memcpy(r->name, p->name, MAX_NAME_LEN);
+    r->name_len = p->name_len;
+    r->name_entered = p->name_entered;
+    r->in_game = p->in_game;
+    r->waiting = (p->pl != NULL && p->pl->waiting) || (p->name_entered && !p->in_game);
+    r->closing = p->closing;
+    r->binary = p->binary;
+    r->hello_checked = p->hello_checked;
+    if (p->inbuf != NULL) {
+        memcpy(r->inbuf, p->inbuf, IN_BUF_SIZE);
+    }
+    r->in_start = p->in_start;
+    r->in_len = p->in_len;
+    if (p->pl != NULL) {
+        r->is_messaging = p->pl->is_messaging;
+        memcpy(r->message, p->pl->message, sizeof(r->message));
+        r->message_length = p->pl->message_length;
+        if (p->pl->match != NULL) {
+            struct match *m = p->pl->match;
+            r->match_seed = m->seed;
+            r->match_rng = m->rng.state;
+            r->hitpoints[0] = m->fighter[0].hitpoints;
+            r->hitpoints[1] = m->fighter[1].hitpoints;
+            r->powermoves[0] = m->fighter[0].powermoves;
+            r->powermoves[1] = m->fighter[1].powermoves;
+            r->turn = m->turn;
+            r->winner = m->winner;
+            r->moves = m->moves;
         }
-        if (p->in_game) {
-            if (!p->is_turn) {
-                return 0; 
-            }
-            struct client *opponent = p->last_opponent;
-            time_t now = time(NULL);
-            if (p->is_turn && p->in_game) {
-                double elapsed = difftime(now, p->start_time);
-                if (elapsed >= p->time_left) {
-                    if (opponent) {
-                        snprintf(outbuf, sizeof(outbuf), "\nTime's up! %s didn't make a move in time. 0 damage dealt. It's now your turn.\n", p->name);
-                        write(opponent->fd, outbuf, strlen(outbuf));
-                        snprintf(outbuf, sizeof(outbuf), "\nTime's up! You didnt attack. Wait till your turn.\n");
-                        write(p->fd, outbuf, strlen(outbuf));
-                        p->is_turn = 0;
-                        opponent->is_turn = 1;
-                        opponent->time_left = 30;
-                        opponent->start_time = now;
-                        p->time_left = 30; 
-                        p->start_time = now;
-                        switch_turn(opponent, p);
-                    }
-                    return 0;
-                }
-            } else if (!p->is_turn) {
-                double elapsed = difftime(now, opponent->start_time);
-                if (elapsed >= opponent->time_left) {
-                    p->is_turn = 1;
-                    opponent->is_turn = 0;
-                    opponent->time_left = 30;
-                    opponent->start_time = now;
-                    p->time_left = 30; 
-                    p->start_time = now;
-                    switch_turn(p, opponent);
-                    return 0;
-                }
-            }
-            if (p->is_messaging) {
-                if (buf[0] == '\n') {
-                    if (p->message_length > MAX_MESSAGE_LEN) {
-                        write(p->fd, "Message too long! Not sent.\n", 28);
-                    } else if (p->message_length > 0) {
-                        snprintf(outbuf, sizeof(outbuf), "%s says: %s\n", p->name, p->message);
-                        write(p->last_opponent->fd, outbuf, strlen(outbuf));
-                    } else {
-                        write(p->fd, "\nYou didn't say anything.\n", 25);
-                    }
-                    p->is_messaging = 0;
-                    memset(p->message, 0, sizeof(p->message));
-                    p->message_length = 0;
-                    switch_turn(p, p->last_opponent);
-                } else if (buf[0] != '\r') {
-                    if (p->message_length < MAX_MESSAGE_LEN) {
-                        p->message[p->message_length++] = buf[0];
-                    } else {
-                        if (p->message_length == MAX_MESSAGE_LEN) {
-                            p->message_length++;  
-                            write(p->fd, "\nMessage too long! Finish and hit enter.\n", 41);
-                        }
-                    }
-                }
-                return 0;
-            }
-            if (buf[0] == 't') {
-                int remaining_time;
-                if (p->is_turn) {
-                    remaining_time = p->time_left - (int)difftime(time(NULL), p->start_time);
-                } else if (opponent->is_turn) {
-                    remaining_time = opponent->time_left - (int)difftime(time(NULL), opponent->start_time);
-                } else {
-                    remaining_time = 30;
-                }
-                if (remaining_time < 0) {
-                    remaining_time = 0; 
-                }
-                snprintf(outbuf, sizeof(outbuf), "\nRemaining time: %d seconds.\n", remaining_time);
-                write(p->fd, outbuf, strlen(outbuf));
-                return 0;
-            }
-            if (buf[0] == 's' && !p->is_messaging) {
-                p->is_messaging = 1;
-                p->message_length = 0;
-                memset(p->message, 0, sizeof(p->message));
-                write(p->fd, "\nSpeak (max 20 chars): ", 22);
-                return 0;
-            } else if ((buf[0] == 'a' || (buf[0] == 'p' && p->powermoves > 0)) && !p->is_messaging) {
-                int damage;
-                if (buf[0] == 'a') {
-                    damage = (rand() % 5) + 2; 
-                } else {
-                    if (buf[0] == 'p' && p->powermoves == 0) {
-                        snprintf(outbuf, sizeof(outbuf), "No more power moves left!\n");
-                        write(p->fd, outbuf, strlen(outbuf));
-                        return 0;
-                    } else {
-                        if (rand() % 2 == 0) {
-                            damage = ((rand() % 5) + 2) * 3; 
-                        } else {
-                            damage = 0; 
-                        }
-                        p->powermoves--;
-                    }
-                }
-                opponent->hitpoints -= damage;
-                snprintf(outbuf, sizeof(outbuf), "\nYou attacked %s for %d damage.\n", opponent->name, damage);
-                write(p->fd, outbuf, strlen(outbuf));
-                snprintf(outbuf, sizeof(outbuf), "%s attacked you for %d damage.\n", p->name, damage);
-                write(opponent->fd, outbuf, strlen(outbuf));
-                if (buf[0] == 'p' && damage == 0) {
-                    snprintf(outbuf, sizeof(outbuf), "Your power move missed!\n");
-                    write(p->fd, outbuf, strlen(outbuf));
-                    snprintf(outbuf, sizeof(outbuf), "%s's power move missed!\n", p->name);
-                    write(opponent->fd, outbuf, strlen(outbuf));
-                }
-                if ((opponent->hitpoints <= 0) && opponent->in_game) {
-                    snprintf(outbuf, sizeof(outbuf), "You defeated %s! Congratulations!\n", opponent->name);
-                    write(p->fd, outbuf, strlen(outbuf));
-                    snprintf(outbuf, sizeof(outbuf), "%s defeated you. Better luck next time!\n", p->name);
-                    write(opponent->fd, outbuf, strlen(outbuf));
-                    p->in_game = 0;
-                    opponent->in_game = 0;
-                    p->last_opponent = opponent; 
-                    opponent->last_opponent = p; 
-                    snprintf(outbuf, sizeof(outbuf), "%s has entered the arena.\n", opponent->name);
-                    broadcast(top, outbuf, strlen(outbuf));
-                    snprintf(outbuf, sizeof(outbuf), "%s has entered the arena.\n", p->name);
-                    broadcast(top, outbuf, strlen(outbuf));
-                    struct client *new_opponent_for_p = matchmaker(top, p);
-                    if (new_opponent_for_p != NULL) {
-                        start_match(p, new_opponent_for_p, &top);
-                    } else {
-                        char *wait_msg = "You are awaiting an opponent...\n";
-                        write(p->fd, wait_msg, strlen(wait_msg));
-                    }
-                    struct client *new_opponent_for_opponent = matchmaker(top, opponent);
-                    if (new_opponent_for_opponent != NULL) {
-                        start_match(opponent, new_opponent_for_opponent, &top);
-                    } else {
-                        char *wait_msg = "You are awaiting an opponent...\n";
-                        write(opponent->fd, wait_msg, strlen(wait_msg));
-                    }
-                    p->name_entered = 1;
-                    opponent->name_entered = 1;
-                } else if ((p->hitpoints <= 0) && p->in_game) {
-                    snprintf(outbuf, sizeof(outbuf), "%s defeated you. Better luck next time!\n", opponent->name);
-                    write(p->fd, outbuf, strlen(outbuf));
-                    snprintf(outbuf, sizeof(outbuf), "You defeated %s! Congratulations!\n", p->name);
-                    write(opponent->fd, outbuf, strlen(outbuf));
-                    p->in_game = 0;
-                    opponent->in_game = 0;
-                    p->last_opponent = opponent;
-                    opponent->last_opponent = p;
-                    snprintf(outbuf, sizeof(outbuf), "%s has entered the arena.\n", p->name);
-                    broadcast(top, outbuf, strlen(outbuf));
-                    snprintf(outbuf, sizeof(outbuf), "%s has entered the arena.\n", opponent->name);
-                    broadcast(top, outbuf, strlen(outbuf));
-                    struct client *new_opponent_for_p = matchmaker(top, p);
-                    if (new_opponent_for_p != NULL) {
-                        start_match(p, new_opponent_for_p, &top);
-                    } else {
-                        char *wait_msg = "You are awaiting an opponent...\n";
-                        write(p->fd, wait_msg, strlen(wait_msg));
-                    }
-                    struct client *new_opponent_for_opponent = matchmaker(top, opponent);
-                    if (new_opponent_for_opponent != NULL) {
-                        start_match(opponent, new_opponent_for_opponent, &top);
-                    } else {
-                        char *wait_msg = "You are awaiting an opponent...\n";
-                        write(opponent->fd, wait_msg, strlen(wait_msg));
-                    }
-                    p->name_entered = 1;
-                    opponent->name_entered = 1;
-                } else {
-                    p->is_turn = 0;
-                    opponent->is_turn = 1;
-                    snprintf(outbuf, sizeof(outbuf), "\nIt's your turn\n\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints: %d\n\n(a)ttack\n(p)owermove\n(s)peak\n(t)ime left\n\n", opponent->hitpoints, opponent->powermoves, p->name, p->hitpoints);
-                    write(opponent->fd, outbuf, strlen(outbuf));
-                    snprintf(outbuf, sizeof(outbuf), "Waiting for %s to make a move...\n", opponent->name);
-                    write(p->fd, outbuf, strlen(outbuf));
-                    opponent->start_time = time(NULL);
-                    opponent->time_left = 30;
-                }
-            } else {
-                return 0;
-            }
-        } else {
-            if (!p->name_entered) {
-                if (buf[0] == '\n' || buf[0] == '\r') {
-                    if (strlen(p->name) == 0) {
-                        char *prompt = "Name cannot be empty, please enter your name: ";
-                        write(p->fd, prompt, strlen(prompt));
-                        return 0;
-                    }
-                    struct client *existing_client = top;
-                    while (existing_client != NULL) {
-                        if (existing_client != p && strcmp(existing_client->name, p->name) == 0) {
-                            char *prompt = "Name already taken, please enter a different name: ";
-                            write(p->fd, prompt, strlen(prompt));
-                            memset(p->name, 0, sizeof(p->name));
-                            return 0;
-                        }
-                        existing_client = existing_client->next;
-                    }
-                    if (p->name_entered == 0) {
-                        snprintf(outbuf, sizeof(outbuf), "%s has entered the arena.\n", p->name);
-                        printf("%s has joined the server.\n", p->name);
-                        broadcast(top, outbuf, strlen(outbuf));
-                    }
-                    p->name_entered = 1;
-                    char *wait_msg = "You are awaiting an opponent...\n";
-                    write(p->fd, wait_msg, strlen(wait_msg));
-                    struct client *opponent = matchmaker(top, p);
-                    if (opponent != NULL && opponent->name_entered) {
-                        start_match(p, opponent, &top);
-                    }
-                } else {
-                    if (!p->in_game) {
-                        strncat(p->name, buf, 1);
-                    }
-                }
+        r->side = p->pl->side;
+        r->match_damage = p->pl->match_damage;
+        r->rating = p->pl->rating;
+        r->match_id = p->pl->match_id;
+        r->wait_since = p->pl->wait_since;
+    }
+    r->turn_expires = p->in_game && p->timer.pprev != NULL ? p->timer.expires : 0;
+}
+
+/***
+Sends file descriptors over a Unix socket, HANDOFF_FD_BATCH at a time
+with one byte of data each.
+int sock -> Connected Unix socket
+const int *fds -> Descriptors to send
+int n -> How many
+Return -> 0 on success, -1 on failure
+***/
+static int send_fds(int sock, const int *fds, int n) {
+    char control[CMSG_SPACE(HANDOFF_FD_BATCH * sizeof(int))];
+    char byte = 'F';
+    while (n > 0) {
+        int batch = n < HANDOFF_FD_BATCH ? n : HANDOFF_FD_BATCH;
+        struct iovec iov = {&byte, 1};
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(batch * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(batch * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, batch * sizeof(int));
+        if (sendmsg(sock, &msg, 0) != 1) {
+            return -1;
+        }
+        fds += batch;
+        n -= batch;
+    }
+    return 0;
+}
+
+/***
+Receives file descriptors sent by send_fds.
+int sock -> Connected Unix socket
+int *fds -> Filled in with the descriptors
+int n -> How many to expect
+Return -> 0 on success, -1 on failure
+***/
+static int recv_fds(int sock, int *fds, int n) {
+    char control[CMSG_SPACE(HANDOFF_FD_BATCH * sizeof(int))];
+    char byte;
+    while (n > 0) {
+        int batch = n < HANDOFF_FD_BATCH ? n : HANDOFF_FD_BATCH;
+        struct iovec iov = {&byte, 1};
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1 || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+            cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(batch * sizeof(int))) {
+            return -1;
+        }
+        memcpy(fds, CMSG_DATA(cmsg), batch * sizeof(int));
+        fds += batch;
+        n -= batch;
+    }
+    return 0;
+}
+
+/***
+Writes a whole buffer to a blocking socket.
+int fd -> Socket
+const void *buf -> Bytes to write
+size_t len -> Number of bytes
+Return -> 0 on success, -1 on failure
+***/
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *s = (const char *)buf;
+    while (len > 0) {
+        ssize_t n = write(fd, s, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        s += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/***
+Reads exactly len bytes from a blocking socket.
+int fd -> Socket
+void *buf -> Where the bytes go
+size_t len -> Number of bytes
+Return -> 0 on success, -1 on failure or end of stream
+***/
+static int read_all(int fd, void *buf, size_t len) {
+    char *s = (char *)buf;
+    while (len > 0) {
+        ssize_t n = read(fd, s, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        s += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/***
+Federation. Started with -c, the arena joins the coordinator on that Unix
+socket and becomes one process of a bigger arena. Every shard reports its
+load and its players who waited FED_WAIT_MS without finding an opponent.
+The coordinator pairs players from different processes and asks one
+process to send its player over: the socket goes through the coordinator
+as SCM_RIGHTS, together with the same record a hot upgrade uses, and the
+player joins the waiting queue of their opponent's shard. Announcements
+are relayed to every process, and connections made to the coordinator's
+own port are handed to the least loaded one. Shards send to the
+coordinator themselves and never wait for it; anything that cannot be
+sent at once is given up, and a player who cannot be sent stays here.
+***/
+
+/***
+Connects to the coordinator and keeps reading from it, reconnecting every
+second when it goes away, for the life of the server.
+void *arg -> Unused
+***/
+void *run_federation(void *arg) {
+    struct timespec retry = {1, 0};
+    int lost = 0;
+    (void)arg;
+    while (1) {
+        if (fed_connect() < 0) {
+            if (!lost) {
+                perror(fed_path);
+                lost = 1;
             }
+            nanosleep(&retry, NULL);
+            continue;
+        }
+        if (lost) {
+            printf("Joined the federation at %s\n", fed_path);
+            fflush(stdout);
         }
-    } else if (len == 0) {
+        lost = 0;
+        fed_listen();
+        __atomic_store_n(&fed_up, 0, __ATOMIC_RELEASE);
+        fprintf(stderr, "Lost the coordinator, playing on alone\n");
+        lost = 1;
+    }
+    return NULL;
+}
+
+/***
+Opens a connection to the coordinator on fed_fd and says hello.
+Return -> 0 on success, -1 with errno set otherwise
+***/
+static int fed_connect(void) {
+    struct sockaddr_un addr;
+    struct fed_hello h;
+    int sock;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", fed_path);
+    if ((sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0) {
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
         return -1;
+    }
+    if (fed_fd < 0) {
+        fed_fd = sock;
     } else {
-        perror("read");
+        dup3(sock, fed_fd, O_CLOEXEC);
+        close(sock);
+    }
+    h.type = FED_HELLO;
+    h.port = listen_port;
+    h.shards = nshards;
+    h.pid = getpid();
+    if (send(fed_fd, &h, sizeof(h), MSG_NOSIGNAL) != sizeof(h)) {
+        return -1;
     }
+    __atomic_store_n(&fed_up, 1, __ATOMIC_RELEASE);
     return 0;
 }
 
 /***
-Finding a opponent for a player in the list of clients connected
-Goes through list of clients looking for possible opponents avoiding
-rematches and ensuring constantly and fair matchmaking. Clients
-are not matched with someone who they just played.
-If no opponent can be found, client waits till suitable opponent 
-exists.
-struct client *top -> Top of the client list (linked list)
-struct client *matchmake -> Potential opponent to matchmake with
-Return -> Returns struct client pointer for opponent found, otherwise NULL.
+Reads what the coordinator sends until the connection drops, and passes
+each message to the shard it is for: players to send away go to the shard
+that reported them, arriving players to the shard their opponent is on,
+new connections to every shard in turn, and announcements to all of them.
 ***/
-struct client *matchmaker(struct client *top, struct client *matchmake) {
-    struct client *cur = top;
-    struct client *b_opponent = NULL;
-    while (cur != NULL) {
-        if (cur != matchmake && !cur->in_game && cur->name_entered) {
-            if (matchmake->last_opponent != cur && cur->last_opponent != matchmake) {
-                b_opponent = cur;
-                break; 
+static void fed_listen(void) {
+    char buf[FED_MAX_MSG];
+    char control[CMSG_SPACE(sizeof(int))];
+    unsigned int next_join = 0;
+    while (1) {
+        struct iovec iov = {buf, sizeof(buf)};
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        struct payload *pl, *fr;
+        uint32_t type;
+        int n, fd = -1, i;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if ((n = recvmsg(fed_fd, &msg, MSG_CMSG_CLOEXEC)) <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        if ((cmsg = CMSG_FIRSTHDR(&msg)) != NULL && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+        if (n < (int)sizeof(type)) {
+            type = (uint32_t)-1;
+        } else {
+            memcpy(&type, buf, sizeof(type));
+        }
+        if (type == FED_AWAY && n == sizeof(struct fed_away) && fd < 0) {
+            struct fed_away *a = (struct fed_away *)buf;
+            post_fed_msg(&shards[(unsigned int)a->shard % nshards], MSG_AWAY, new_payload(buf, n), -1);
+        } else if (type == FED_PLAYER && n >= (int)sizeof(struct fed_player) && fd >= 0) {
+            struct fed_player *m = (struct fed_player *)buf;
+            post_fed_msg(&shards[(unsigned int)m->to_shard % nshards], MSG_ARRIVE, new_payload(buf, n), fd);
+        } else if (type == FED_CLIENT && n == sizeof(struct fed_client) && fd >= 0) {
+            post_fed_msg(&shards[next_join++ % nshards], MSG_JOIN, new_payload(buf, n), fd);
+        } else if (type == FED_ANNOUNCE && n >= (int)sizeof(struct fed_announce) && fd < 0) {
+            struct fed_announce *a = (struct fed_announce *)buf;
+            if (a->len < 0 || a->frames_len < 0 || (int)sizeof(*a) + a->len + a->frames_len != n) {
+                continue;
             }
+            pl = new_payload(buf + sizeof(*a), a->len);
+            fr = new_payload(buf + sizeof(*a) + a->len, a->frames_len);
+            for (i = 0; i < nshards; i++) {
+                __atomic_add_fetch(&pl->refs, 1, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&fr->refs, 1, __ATOMIC_RELAXED);
+                post_shard_msg(&shards[i], MSG_BROADCAST, NULL, pl, fr);
+            }
+            release_payload(pl);
+            release_payload(fr);
+        } else if (fd >= 0) {
+            close(fd);
         }
-        cur = cur->next;
     }
-    return b_opponent; 
 }
 
 /***
-Creates a match and randomly assignes who goes first with inital game settings.
-Both clients get set for battle with in game status, and are both notified.
-Each client has 30 seconds to attack during their turn.
-struct client *p -> Client for the match
-struct client *opponent -> Another client for the match
-struct client **top -> First client in linked list
+Sends one message to the coordinator without waiting.
+const void *buf -> The message
+int len -> Its length
+int fd -> Socket to send along with it, or -1
+Return -> 0 if it was sent, -1 if not
 ***/
-void start_match(struct client *p, struct client *opponent, struct client **top) {
-    init_battle(p);
-    init_battle(opponent);
-    p->in_game = 1;
-    opponent->in_game = 1;
-    p->last_opponent = opponent;
-    opponent->last_opponent = p;
-    char msg[512];
-    snprintf(msg, sizeof(msg), "Match started! Remember during your turn you have 30 seconds to attack.\n");
-    write(p->fd, msg, strlen(msg));
-    write(opponent->fd, msg, strlen(msg));
-    char your_turn_msg[512];
-    char opponent_turn_msg[512];
-    if (rand() % 2 == 0) {
-        p->start_time = time(NULL);
-        p->time_left = 30; 
-        p->is_turn = 1;
-        opponent->is_turn = 0;
-        snprintf(your_turn_msg, sizeof(your_turn_msg),
-                 "You are matched with %s! Let the battle begin!\nYou go first.\n",
-                 opponent->name);
-        snprintf(opponent_turn_msg, sizeof(opponent_turn_msg),
-                 "You are matched with %s! Let the battle begin!\nYou go second.\n",
-                 p->name);
-    } else {
-        opponent->start_time = time(NULL);
-        opponent->time_left = 30; 
-        p->is_turn = 0;
-        opponent->is_turn = 1;
-        snprintf(your_turn_msg, sizeof(your_turn_msg),
-                 "You are matched with %s! Let the battle begin!\nYou go second.\n",
-                 opponent->name);
-        snprintf(opponent_turn_msg, sizeof(opponent_turn_msg),
-                 "You are matched with %s! Let the battle begin!\nYou go first.\n",
-                 p->name);
-    }
-    write(p->fd, your_turn_msg, strlen(your_turn_msg));
-    write(opponent->fd, opponent_turn_msg, strlen(opponent_turn_msg));
-    switch_turn(p, opponent);
-    switch_turn(opponent, p);
+static int fed_send(const void *buf, int len, int fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {(void *)buf, len};
+    struct msghdr msg;
+    if (!__atomic_load_n(&fed_up, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0) {
+        struct cmsghdr *cmsg;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    return sendmsg(fed_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == len ? 0 : -1;
 }
 
 /***
-Notifies turn switch to clients.
-Sends a message to client whose turn it si and displays hitpoints, powermoves.
-Also, displays player actions (a)ttack, (p)owermove, (s)peak, (t)ime left
-struct client *p -> Used for client to display their info.
-struct client *opponent -> Used to display opponent hitpoints
+Marks this shard's report as due; it goes out at the end of the loop
+iteration, once the iteration's moves and matches are done.
+struct timer *t -> fed_timer
 ***/
-void switch_turn(struct client *p, struct client *opponent) {
-    char prompt[512];
-    snprintf(prompt, sizeof(prompt), "\n\nYour hitpoints: %d\nYour powermoves: %d\nOpponent's hitpoints: %d\n\n(a)ttack\n(p)owermove\n(s)peak\n(t)ime left\n\n", p->hitpoints, p->powermoves, opponent->hitpoints);
-    write(p->fd, prompt, strlen(prompt));
+static void fed_report_due(struct timer *t) {
+    fed_due = 1;
+    timer_arm(t, FED_REPORT_MS);
 }
 
 /***
-Sets up game with hitpoints for both users opponent and player
-Randomly assignes hitpoints to both users (20-30) and powermoves (1-3)
-struct client *p -> CLient pointer to whose hitpoints and power moves
-are setup.
+Tells the coordinator how many clients this shard has and who has been
+waiting for an opponent for FED_WAIT_MS or longer, longest first.
 ***/
-void init_battle(struct client *p) {
-    p->hitpoints = (rand() % 11) + 20;
-    p->powermoves = (rand() % 3) + 1;
+static void fed_report(void) {
+    struct fed_report r;
+    struct client *p;
+    unsigned long now;
+    if (!fed_due) {
+        return;
+    }
+    fed_due = 0;
+    now = current_ms();
+    memset(&r, 0, sizeof(r));
+    r.type = FED_REPORT;
+    r.shard = self->id;
+    r.clients = client_count;
+    for (p = wait_head; p != NULL && r.count < FED_REPORT_MAX; p = p->pl->wait_next) {
+        if (now - p->pl->wait_since >= FED_WAIT_MS && !p->closing) {
+            struct fed_waiting *w = &r.waiting[r.count++];
+            memcpy(w->name, p->name, FED_NAME_LEN);
+            w->rating = p->pl->rating;
+            w->waited_ms = (uint32_t)(now - p->pl->wait_since);
+        }
+    }
+    fed_send(&r, offsetof(struct fed_report, waiting) + r.count * sizeof(struct fed_waiting), -1);
 }
 
 /***
-Handles the disconnecting of a client when user leaves the server mid-game
-or while waiting. If client that disconnect is in game, the opponent is granted
-a win and notified that their opponent dropped or left. Remove client is called to
-remove the dropped client from linked list.
-Also a when client drops, it is broadcasted to the entire connected clients to notify
-them as well. Memory is freed also that was allocated dynamically to that client
-struct client *p -> Pointer of the disconnecting client
-struct cliet **top -> Pointer to first client that needs to be updated
-fd_set *allset -> Pointer to file descriptor that needs to be removed of dropped client
-int *maxfd -> File descriptor number that may need to the updated
+Passes an announcement on to the other processes of the federation.
+const char *s -> Announcement for text clients
+int size -> Its length
+const char *frames -> The announcement as binary frames
+int frames_len -> Their length
 ***/
-void disconnect_client(struct client *p, struct client **top, fd_set *allset, int *maxfd) {
-    p->time_left = 30;
-    if (p == NULL || p->fd < 0) return; 
-    char addrbuf[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &(p->ipaddr), addrbuf, INET_ADDRSTRLEN);
-    printf("Connection from %s disconnected.\n", addrbuf);
-    struct client *opponent = p->last_opponent;
-    if (p->in_game && p->last_opponent != NULL) {
-        struct client *opponent = p->last_opponent;
-        char msg[MAX_BUF];
-        snprintf(msg, sizeof(msg), "%s has dropped. You Won! You are back in the arena waiting for a new opponent.\n", p->name);
-        write(opponent->fd, msg, strlen(msg));
-        opponent->in_game = 0;
-        opponent->last_opponent = NULL;
-        char *wait_msg = "You are awaiting an opponent...\n";
-        write(opponent->fd, wait_msg, strlen(wait_msg));
-    }
-    if (strlen(p->name) > 0) {
-        char outbuf[MAX_BUF];
-        snprintf(outbuf, sizeof(outbuf), "%s has left the arena.\n", p->name);
-        broadcast(*top, outbuf, strlen(outbuf));
-    }
-    *top = removeclient(*top, p->fd);
-    p->name_entered = 0;
-    close(p->fd);
-    FD_CLR(p->fd, allset);
-    p->fd = -1;
-    if (*maxfd == p->fd) {
-        int new_maxfd = 0;
-        for (struct client *temp = *top; temp; temp = temp->next) {
-            if (temp->fd > new_maxfd) new_maxfd = temp->fd;
-        }
-        *maxfd = new_maxfd;
-    }
-    free(p);
-    if (opponent != NULL) {
-        struct client *new_opponent = matchmaker(*top, opponent);
-        if (new_opponent != NULL) {
-            start_match(opponent, new_opponent, top);
-        }
+static void fed_announce(const char *s, int size, const char *frames, int frames_len) {
+    char buf[FED_MAX_MSG];
+    struct fed_announce a;
+    if (fed_path == NULL || (int)sizeof(a) + size + frames_len > FED_MAX_MSG) {
+        return;
     }
+    a.type = FED_ANNOUNCE;
+    a.len = size;
+    a.frames_len = frames_len;
+    memcpy(buf, &a, sizeof(a));
+    memcpy(buf + sizeof(a), s, size);
+    memcpy(buf + sizeof(a) + size, frames, frames_len);
+    fed_send(buf, sizeof(a) + size + frames_len, -1);
 }
 
 /***
-Removes a client from linked list from file descriptor. Goes through linked list 
-and finds client with correct file descriptor and removes it from list.
-Linked list is then adjust to prevent issues and gaps. Usually called when client
-leaves or disconnects from server.
-struct client *top -> Pointer to first client in list
-int fd -> File descriptor of client being removed
-Return -> Update list and pointer to first client in list
+Sends a waiting player of this shard to another process, as the
+coordinator asked. Players who stopped waiting in the meantime, or who
+still have output to be written, stay; the coordinator asks again if they
+are still waiting at the next report.
+struct client *top -> Front of this shard's client list
+const struct fed_away *a -> The coordinator's request
+int epfd -> This shard's epoll instance
+Return -> Updated front of the client list
 ***/
-struct client *removeclient(struct client *top, int fd) {
-    struct client *p, *prev = NULL;
-    for (p = top; p != NULL; prev = p, p = p->next) {
-        if (p->fd == fd) {
-            if (prev == NULL) {
-                top = p->next;
-            } else {
-                prev->next = p->next;
-            }
-            break;
-        }
+static struct client *send_away(struct client *top, const struct fed_away *a, int epfd) {
+    char name[MAX_NAME_LEN];
+    struct client *p;
+    memcpy(name, a->name, MAX_NAME_LEN);
+    name[MAX_NAME_LEN - 1] = '\0';
+    p = find_name(name);
+    if (p == NULL || __atomic_load_n(&p->shard, __ATOMIC_RELAXED) != self->id || p->pl == NULL ||
+        !p->pl->waiting || p->in_game || p->closing || p->out_head != NULL || p->flush_pprev != NULL ||
+        a->to_instance < 0 || a->to_shard < 0) {
+        return top;
     }
+    dequeue_waiting(p);
+    top = removeclient(top, p);
+    METRIC_ADD(clients, -1);
+    METRIC_ADD(players, -1);
+    METRIC_ADD(in_buffers, -(p->inbuf != NULL));
+    p->pl->away_to = a->to_instance * MAX_SHARDS + a->to_shard % MAX_SHARDS;
+    hand_client(p, SHARD_AWAY, MSG_ADOPT, epfd);
     return top;
 }
 
 /***
-Sends message to all clients connected
-Iterates through linked list and sends message to everyone
-struct client *top -> Pointer to first client in linked list
-char *s -> Message being broadcasted
-int size -> Length of message being sent
+Sends a player taken off this shard through the coordinator, then lets
+go of them here. If they cannot be sent they are adopted back by this
+shard as if they had never left.
+struct client *p -> Player whose away_to says where they go
 ***/
-void broadcast(struct client *top, char *s, int size) {
-    struct client *p;
-    for (p = top; p != NULL; p = p->next) {
-        if (p->fd >= 0 && p->name_entered) { 
-            if (write(p->fd, s, size) == -1) {
-                perror("write");
-            }
+static void fed_send_player(struct client *p) {
+    char buf[sizeof(struct fed_player) + sizeof(struct handoff_client)];
+    struct fed_player m;
+    struct handoff_client r;
+    memset(&r, 0, sizeof(r));
+    pack_client(p, &r);
+    r.opponent = -1;
+    m.type = FED_PLAYER;
+    m.version = HANDOFF_VERSION;
+    m.to_instance = p->pl->away_to / MAX_SHARDS;
+    m.to_shard = p->pl->away_to % MAX_SHARDS;
+    m.len = sizeof(r);
+    memcpy(buf, &m, sizeof(m));
+    memcpy(buf + sizeof(m), &r, sizeof(r));
+    p->pl->away_to = -1;
+    if (fed_send(buf, sizeof(buf), p->fd) < 0) {
+        post_shard_msg(self, MSG_ADOPT, p, NULL, NULL);
+        return;
+    }
+    METRIC_ADD(fed_out, 1);
+    unregister_name(p);
+    p->name_entered = 0;
+    timer_cancel(&p->timer);
+    free_output(p);
+    /* Its count already went with the rest of the player's. */
+    METRIC_ADD(in_buffers, (p->inbuf != NULL));
+    p->in_len = 0;
+    release_inbuf(p);
+    free(p->pl);
+    p->pl = NULL;
+    close(p->fd);
+    p->fd = -1;
+    free_client(p);
+}
+
+/***
+Takes in a player another process of the federation sent here. They join
+the waiting queue with the time they have waited so far, and are matched
+straight away if anyone here can play them. A player whose name is taken
+in this process is asked for another one, and one whose record this build
+cannot read starts over as a new connection.
+struct client *top -> Front of this shard's client list
+struct payload *pl -> The fed_player message with the player's record
+int fd -> The player's socket
+int epfd -> This shard's epoll instance
+Return -> Updated front of the client list
+***/
+static struct client *arrive(struct client *top, struct payload *pl, int fd, int epfd) {
+    struct fed_player m;
+    struct handoff_client r;
+    struct client *p, *opponent;
+    int readable;
+    memcpy(&m, pl->data, sizeof(m));
+    readable = m.version == HANDOFF_VERSION && pl->len == (int)(sizeof(m) + sizeof(r));
+    if (readable) {
+        memcpy(&r, pl->data + sizeof(m), sizeof(r));
+        readable = valid_record(&r);
+    }
+    if (!readable) {
+        struct sockaddr_in addr;
+        socklen_t addrlen = sizeof(addr);
+        memset(&addr, 0, sizeof(addr));
+        getpeername(fd, (struct sockaddr *)&addr, &addrlen);
+        return addclient(top, fd, addr.sin_addr, epfd);
+    }
+    r.in_game = 0;
+    r.closing = 0;
+    if ((p = revive_client(&r, fd, epfd)) == NULL) {
+        return top;
+    }
+    METRIC_ADD(clients, 1);
+    METRIC_ADD(fed_in, 1);
+    p->next = top;
+    if (top != NULL) {
+        top->prev = p;
+    }
+    top = p;
+    client_count++;
+    if (p->pl == NULL) {
+        const char *prompt = "Name already taken, please enter a different name: ";
+        memset(p->name, 0, sizeof(p->name));
+        p->name_len = 0;
+        if (p->binary) {
+            send_frame(p, F_NAME, "\2", 1);
+        } else {
+            send_client(p, prompt, strlen(prompt));
         }
+        return top;
     }
+    enqueue_waiting(p);
+    p->pl->wait_since = r.wait_since;
+    opponent = matchmaker(p);
+    if (opponent != NULL) {
+        start_match(p, opponent);
+    }
+    if (p->in_len > 0) {
+        process_input(p, top);
+    }
+    return top;
 }
@@ -0,0 +1,687 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifndef PORT
+    #define PORT 51621
+#endif
+
+#define MAX_EVENTS 256
+#define RX_BUF 4096
+#define TAIL_KEEP 128
+#define CONNECT_WINDOW 256
+#define MAX_THREADS 64
+#define PROTO_MAGIC "\0BT1"
+#define PROTO_MAGIC_LEN 4
+
+/***
+Headless load generator for the battle server. Opens many connections,
+enters names and plays scripted a/p/s/t turns against the text protocol,
+then reports connections/sec, moves/sec and move-to-response latency.
+Each thread drives its own share of the connections from one epoll loop.
+With -b the players ask for the binary protocol and read frames instead.
+***/
+
+enum conn_state {
+    ST_CONNECTING,
+    ST_NAMING,
+    ST_IDLE,
+    ST_PROMPT,
+    ST_MOVE,
+    ST_TIME,
+    ST_SPEAK,
+    ST_SPOKE,
+    ST_DEAD
+};
+
+/* Strings in the server's output the script reacts to. */
+enum marker {
+    MK_NAME,
+    MK_MATCHED,
+    MK_FIRST,
+    MK_YOUR_TURN,
+    MK_PROMPT,
+    MK_ATTACKED,
+    MK_SECONDS,
+    MK_SPEAK,
+    MK_WON,
+    MK_LOST,
+    MK_FULL,
+    MK_COUNT
+};
+
+/* Binary frame types, as in battle.c. */
+enum frame_type {
+    F_HELLO = 1,
+    F_NAME,
+    F_WAITING,
+    F_MATCH,
+    F_STATE,
+    F_ATTACK,
+    F_RESULT,
+    F_TIME,
+    F_TIMEOUT,
+    F_SAY,
+    F_SPEAK,
+    F_ANNOUNCE,
+    F_NO_POWER
+};
+
+static const char *markers[MK_COUNT] = {
+    "name: ",
+    "Let the battle begin!",
+    "You go first.",
+    "It's your turn",
+    "(t)ime left",
+    "You attacked ",
+    "seconds.\n",
+    "chars):",
+    "You defeated ",
+    "defeated you",
+    "Sorry, the arena is full"
+};
+
+struct conn {
+    int fd;
+    int id;
+    enum conn_state state;
+    int welcomed;
+    int name_tries;
+    int turns;
+    int fresh;
+    int framed;
+    uint64_t sent_ns;
+    int tail_len;
+    char tail[TAIL_KEEP];
+};
+
+/* One load thread's connections and the numbers it collected. */
+struct worker {
+    pthread_t thread;
+    int first_id;
+    int nconns;
+    struct conn *conns;
+    int epfd;
+    int started;
+    int in_flight;
+    int welcomed;
+    int failed;
+    uint64_t ramp_ns;
+    uint64_t moves;
+    uint64_t matches;
+    uint64_t rx_bytes;
+    uint32_t *samples;
+    size_t nsamples;
+    size_t cap;
+    int measuring;
+};
+
+static struct sockaddr_in server;
+static int bench_seconds = 10;
+static int binary = 0;
+
+void *run_worker(void *arg);
+static int start_conn(struct worker *w, struct conn *c);
+static void on_connected(struct worker *w, struct conn *c);
+static void on_readable(struct worker *w, struct conn *c);
+static void on_marker(struct worker *w, struct conn *c, enum marker m);
+static int on_frames(struct worker *w, struct conn *c, const unsigned char *buf, int len);
+static void do_turn(struct worker *w, struct conn *c);
+static void send_move(struct worker *w, struct conn *c, const char *s, int len, enum conn_state next);
+static void record(struct worker *w, struct conn *c);
+static void drop_conn(struct worker *w, struct conn *c);
+static uint64_t now_ns(void);
+static int cmp_u32(const void *a, const void *b);
+static void raise_fd_limit(void);
+static double scrape_metric(int port, const char *name);
+
+/***
+Parses the options, starts the load threads and prints the report.
+-h host -> Server address (127.0.0.1)
+-p port -> Server port (PORT)
+-c conns -> Total connections (1000)
+-d seconds -> Length of the measured run after the ramp (10)
+-t threads -> Load threads (1)
+-b -> Use the binary protocol
+-a port -> Server admin port; reports the server's I/O system calls per command
+***/
+int main(int argc, char **argv) {
+    const char *host = "127.0.0.1";
+    int port = PORT, nconns = 1000, nthreads = 1, admin_port = 0, opt, i;
+    struct worker workers[MAX_THREADS];
+    uint64_t moves = 0, matches = 0, ramp_ns = 0, rx_bytes = 0;
+    int welcomed = 0, failed = 0;
+    size_t nsamples = 0;
+    uint32_t *samples;
+    double syscalls = -1, commands = -1;
+    while ((opt = getopt(argc, argv, "h:p:c:d:t:ba:")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': nconns = atoi(optarg); break;
+        case 'd': bench_seconds = atoi(optarg); break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'b': binary = 1; break;
+        case 'a': admin_port = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-h host] [-p port] [-c conns] [-d seconds] [-t threads] [-b] [-a admin_port]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (nthreads < 1 || nthreads > MAX_THREADS || nconns < nthreads || bench_seconds < 1) {
+        fprintf(stderr, "bad arguments\n");
+        exit(1);
+    }
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server.sin_addr) != 1) {
+        fprintf(stderr, "bad address %s\n", host);
+        exit(1);
+    }
+    raise_fd_limit();
+    signal(SIGPIPE, SIG_IGN);
+    memset(workers, 0, sizeof(workers));
+    if (admin_port > 0) {
+        syscalls = scrape_metric(admin_port, "battle_io_syscalls_total");
+        commands = scrape_metric(admin_port, "battle_commands_total");
+    }
+    for (i = 0; i < nthreads; i++) {
+        workers[i].first_id = nconns / nthreads * i;
+        workers[i].nconns = (i == nthreads - 1) ? nconns - workers[i].first_id : nconns / nthreads;
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        moves += workers[i].moves;
+        matches += workers[i].matches;
+        rx_bytes += workers[i].rx_bytes;
+        welcomed += workers[i].welcomed;
+        failed += workers[i].failed;
+        nsamples += workers[i].nsamples;
+        if (workers[i].ramp_ns > ramp_ns) {
+            ramp_ns = workers[i].ramp_ns;
+        }
+    }
+    samples = (uint32_t *)malloc((nsamples + 1) * sizeof(uint32_t));
+    if (samples == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    nsamples = 0;
+    for (i = 0; i < nthreads; i++) {
+        memcpy(samples + nsamples, workers[i].samples, workers[i].nsamples * sizeof(uint32_t));
+        nsamples += workers[i].nsamples;
+        free(workers[i].samples);
+    }
+    qsort(samples, nsamples, sizeof(uint32_t), cmp_u32);
+    printf("connections: %d in %.3f s (%.0f conns/sec), %d failed\n",
+           welcomed, ramp_ns / 1e9, ramp_ns ? welcomed / (ramp_ns / 1e9) : 0.0, failed);
+    printf("moves: %llu in %d s (%.0f moves/sec), %llu matches finished\n",
+           (unsigned long long)moves, bench_seconds, (double)moves / bench_seconds,
+           (unsigned long long)matches);
+    printf("received: %llu bytes (%.1f per move)\n",
+           (unsigned long long)rx_bytes, moves ? (double)rx_bytes / moves : 0.0);
+    if (nsamples > 0) {
+        printf("latency: p50 %u us, p99 %u us, p999 %u us, max %u us\n",
+               samples[nsamples / 2], samples[nsamples * 99 / 100],
+               samples[nsamples * 999 / 1000], samples[nsamples - 1]);
+    }
+    free(samples);
+    if (admin_port > 0 && syscalls >= 0 && commands >= 0) {
+        double end_syscalls = scrape_metric(admin_port, "battle_io_syscalls_total");
+        double end_commands = scrape_metric(admin_port, "battle_commands_total");
+        if (end_syscalls >= 0 && end_commands > commands) {
+            printf("server: %.0f I/O syscalls for %.0f commands (%.2f per command)\n",
+                   end_syscalls - syscalls, end_commands - commands,
+                   (end_syscalls - syscalls) / (end_commands - commands));
+        }
+    }
+    return (welcomed == 0 || moves == 0) ? 1 : 0;
+}
+
+/***
+Runs one load thread. Connections are opened CONNECT_WINDOW at a time until
+all of them have been welcomed, which is the ramp that connections/sec is
+taken from. Moves are then counted for bench_seconds.
+void *arg -> The struct worker this thread runs
+***/
+void *run_worker(void *arg) {
+    struct worker *w = (struct worker *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t start = now_ns(), stop = 0, now;
+    int nready, i, timeout;
+    w->conns = (struct conn *)calloc(w->nconns, sizeof(struct conn));
+    if (w->conns == NULL || (w->epfd = epoll_create1(0)) < 0) {
+        perror("worker");
+        exit(1);
+    }
+    while (1) {
+        while (w->started < w->nconns && w->in_flight < CONNECT_WINDOW) {
+            struct conn *c = &w->conns[w->started];
+            c->id = w->first_id + w->started;
+            w->started++;
+            if (start_conn(w, c) < 0) {
+                w->failed++;
+            }
+        }
+        now = now_ns();
+        if (!w->measuring && w->started == w->nconns && w->in_flight == 0) {
+            w->ramp_ns = now - start;
+            w->measuring = 1;
+            stop = now + (uint64_t)bench_seconds * 1000000000ULL;
+        }
+        if (w->measuring && now >= stop) {
+            break;
+        }
+        timeout = w->measuring ? (int)((stop - now) / 1000000) + 1 : 100;
+        nready = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+        if (nready < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+                exit(1);
+            }
+            continue;
+        }
+        for (i = 0; i < nready; i++) {
+            struct conn *c = (struct conn *)events[i].data.ptr;
+            if (c->state == ST_CONNECTING) {
+                on_connected(w, c);
+            } else if (c->state != ST_DEAD) {
+                on_readable(w, c);
+            }
+        }
+    }
+    for (i = 0; i < w->started; i++) {
+        if (w->conns[i].state != ST_DEAD) {
+            close(w->conns[i].fd);
+        }
+    }
+    close(w->epfd);
+    free(w->conns);
+    return NULL;
+}
+
+/***
+Starts a non-blocking connect for one simulated player.
+struct worker *w -> Thread the connection belongs to
+struct conn *c -> Connection being opened
+Return -> 0 on success, -1 if the socket could not be set up
+***/
+static int start_conn(struct worker *w, struct conn *c) {
+    struct epoll_event ev;
+    c->state = ST_DEAD;
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(c->fd, (struct sockaddr *)&server, sizeof(server)) < 0 && errno != EINPROGRESS) {
+        perror("connect");
+        close(c->fd);
+        return -1;
+    }
+    c->state = ST_CONNECTING;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        close(c->fd);
+        c->state = ST_DEAD;
+        return -1;
+    }
+    w->in_flight++;
+    return 0;
+}
+
+/***
+Finishes a connect and waits for the server's welcome.
+struct worker *w -> Thread the connection belongs to
+struct conn *c -> Connection that became writable
+***/
+static void on_connected(struct worker *w, struct conn *c) {
+    struct epoll_event ev;
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        drop_conn(w, c);
+        return;
+    }
+    c->state = ST_NAMING;
+    if (binary && write(c->fd, PROTO_MAGIC, PROTO_MAGIC_LEN) != PROTO_MAGIC_LEN) {
+        drop_conn(w, c);
+        return;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+        drop_conn(w, c);
+    }
+}
+
+/***
+Reads what the server sent and reacts to every marker in stream order.
+The last few bytes are kept so a marker split across reads is still seen.
+A binary player switches to frames right after the welcome text.
+struct worker *w -> Thread the connection belongs to
+struct conn *c -> Connection with data to read
+***/
+static void on_readable(struct worker *w, struct conn *c) {
+    char buf[TAIL_KEEP + RX_BUF];
+    int n, len, pos = 0, i;
+    memcpy(buf, c->tail, c->tail_len);
+    n = read(c->fd, buf + c->tail_len, RX_BUF);
+    if (n <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        drop_conn(w, c);
+        return;
+    }
+    len = c->tail_len + n;
+    if (w->measuring) {
+        w->rx_bytes += n;
+    }
+    while (c->state != ST_DEAD && !c->framed) {
+        char *best = NULL;
+        enum marker found = MK_COUNT;
+        for (i = 0; i < MK_COUNT; i++) {
+            char *hit = memmem(buf + pos, len - pos, markers[i], strlen(markers[i]));
+            if (hit != NULL && (best == NULL || hit < best)) {
+                best = hit;
+                found = (enum marker)i;
+            }
+        }
+        if (best == NULL) {
+            break;
+        }
+        pos = (best - buf) + strlen(markers[found]);
+        on_marker(w, c, found);
+        if (binary && found == MK_NAME) {
+            c->framed = 1;
+        }
+    }
+    if (c->framed && c->state != ST_DEAD) {
+        pos += on_frames(w, c, (unsigned char *)buf + pos, len - pos);
+    }
+    if (len - pos > TAIL_KEEP) {
+        pos = len - TAIL_KEEP;
+    }
+    c->tail_len = len - pos;
+    memcpy(c->tail, buf + pos, c->tail_len);
+}
+
+/***
+Advances one simulated player's script on a line from the server.
+struct worker *w -> Thread the connection belongs to
+struct conn *c -> Connection the marker was seen on
+enum marker m -> Which marker it was
+***/
+static void on_marker(struct worker *w, struct conn *c, enum marker m) {
+    char name[20];
+    int len;
+    switch (m) {
+    case MK_NAME:
+        if (!c->welcomed) {
+            c->welcomed = 1;
+            w->welcomed++;
+            w->in_flight--;
+        }
+        len = snprintf(name, sizeof(name), "b%d_%d\n", c->id, c->name_tries++);
+        send_move(w, c, name, len, ST_IDLE);
+        break;
+    case MK_MATCHED:
+        c->fresh = 1;
+        c->state = ST_IDLE;
+        break;
+    case MK_FIRST:
+    case MK_YOUR_TURN:
+        c->state = ST_PROMPT;
+        break;
+    case MK_PROMPT:
+        if (c->state == ST_PROMPT) {
+            do_turn(w, c);
+        } else if (c->state == ST_SPOKE) {
+            record(w, c);
+            send_move(w, c, "a", 1, ST_MOVE);
+        }
+        break;
+    case MK_ATTACKED:
+        if (c->state == ST_MOVE) {
+            record(w, c);
+            c->state = ST_IDLE;
+        }
+        break;
+    case MK_SECONDS:
+        if (c->state == ST_TIME) {
+            record(w, c);
+            send_move(w, c, "a", 1, ST_MOVE);
+        }
+        break;
+    case MK_SPEAK:
+        if (c->state == ST_SPEAK) {
+            record(w, c);
+            send_move(w, c, "gg\n", 3, ST_SPOKE);
+        }
+        break;
+    case MK_WON:
+    case MK_LOST:
+        if (w->measuring && m == MK_WON) {
+            w->matches++;
+        }
+        c->state = ST_IDLE;
+        break;
+    case MK_FULL:
+        drop_conn(w, c);
+        break;
+    default:
+        break;
+    }
+}
+
+/***
+Reacts to every complete binary frame in buf the way on_marker reacts
+to the matching text.
+struct worker *w -> Thread the connection belongs to
+struct conn *c -> Connection the frames came in on
+const unsigned char *buf -> Received bytes
+int len -> Number of bytes at buf
+Return -> Number of bytes taken up by complete frames
+***/
+static int on_frames(struct worker *w, struct conn *c, const unsigned char *buf, int len) {
+    int pos = 0;
+    while (c->state != ST_DEAD && len - pos >= 2 && len - pos >= 1 + buf[pos]) {
+        const unsigned char *body = buf + pos + 2;
+        switch (buf[pos + 1]) {
+        case F_NAME:
+            on_marker(w, c, MK_NAME);
+            break;
+        case F_MATCH:
+            on_marker(w, c, MK_MATCHED);
+            break;
+        case F_STATE:
+            if (body[0]) {
+                if (c->state != ST_SPOKE) {
+                    on_marker(w, c, MK_YOUR_TURN);
+                }
+                on_marker(w, c, MK_PROMPT);
+            }
+            break;
+        case F_ATTACK:
+            if (body[0]) {
+                on_marker(w, c, MK_ATTACKED);
+            }
+            break;
+        case F_TIME:
+            on_marker(w, c, MK_SECONDS);
+            break;
+        case F_SPEAK:
+            if (body[0] == 0) {
+                on_marker(w, c, MK_SPEAK);
+            }
+            break;
+        case F_RESULT:
+            on_marker(w, c, body[0] ? MK_WON : MK_LOST);
+            break;
+        default:
+            break;
+        }
+        pos += 1 + buf[pos];
+    }
+    return pos;
+}
+
+/***
+Plays one turn: a power move to open each match, then mostly attacks,
+with a time check and a taunt mixed in every few turns.
+struct worker *w -> Thread the connection belongs to
+struct conn *c -> Player whose turn it is
+***/
+static void do_turn(struct worker *w, struct conn *c) {
+    c->turns++;
+    if (c->fresh) {
+        c->fresh = 0;
+        send_move(w, c, "p", 1, ST_MOVE);
+    } else if (c->turns % 8 == 3) {
+        send_move(w, c, "t", 1, ST_TIME);
+    } else if (c->turns % 8 == 6) {
+        send_move(w, c, "s", 1, ST_SPEAK);
+    } else {
+        send_move(w, c, "a", 1, ST_MOVE);
+    }
+}
+
+/***
+Sends a command and notes when it went out.
+struct worker *w -> Thread the connection belongs to
+struct conn *c -> Connection to write to
+const char *s -> Bytes to send
+int len -> Number of bytes
+enum conn_state next -> State to wait in for the response
+***/
+static void send_move(struct worker *w, struct conn *c, const char *s, int len, enum conn_state next) {
+    if (write(c->fd, s, len) != len) {
+        drop_conn(w, c);
+        return;
+    }
+    c->sent_ns = now_ns();
+    c->state = next;
+}
+
+/***
+Counts a response to the last command and keeps its latency in
+microseconds, while the measured run is on.
+struct worker *w -> Thread the connection belongs to
+struct conn *c -> Connection the response came in on
+***/
+static void record(struct worker *w, struct conn *c) {
+    uint64_t us = (now_ns() - c->sent_ns) / 1000;
+    if (!w->measuring) {
+        return;
+    }
+    w->moves++;
+    if (w->nsamples == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 65536;
+        w->samples = (uint32_t *)realloc(w->samples, w->cap * sizeof(uint32_t));
+        if (w->samples == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    w->samples[w->nsamples++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+/***
+Closes a connection the server refused or hung up on.
+struct worker *w -> Thread the connection belongs to
+struct conn *c -> Connection being dropped
+***/
+static void drop_conn(struct worker *w, struct conn *c) {
+    if (c->state == ST_DEAD) {
+        return;
+    }
+    if (!c->welcomed) {
+        w->in_flight--;
+    }
+    w->failed++;
+    close(c->fd);
+    c->state = ST_DEAD;
+}
+
+/***
+Return -> Monotonic time in nanoseconds
+***/
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/***
+Raises the open file limit to its hard maximum so thousands of
+connections fit in one process.
+***/
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/***
+Reads the server's metrics page and adds up one counter over its shards.
+int port -> Admin port of the server
+const char *name -> Metric name, without labels
+Return -> The sum, or -1 if the page could not be read
+***/
+static double scrape_metric(int port, const char *name) {
+    static char page[1 << 18];
+    struct sockaddr_in addr = server;
+    size_t namelen = strlen(name);
+    double sum = 0;
+    int fd, len = 0, n;
+    char *line;
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        write(fd, "GET /metrics HTTP/1.0\r\n\r\n", 25) != 25) {
+        close(fd);
+        return -1;
+    }
+    while (len < (int)sizeof(page) - 1 && (n = read(fd, page + len, sizeof(page) - 1 - len)) > 0) {
+        len += n;
+    }
+    close(fd);
+    page[len] = '\0';
+    for (line = page; line != NULL; line = strchr(line, '\n')) {
+        line += (*line == '\n');
+        if (strncmp(line, name, namelen) == 0 && (line[namelen] == '{' || line[namelen] == ' ')) {
+            sum += strtod(strchr(line, ' '), NULL);
+        }
+    }
+    return len > 0 ? sum : -1;
+}
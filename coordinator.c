@@ -0,0 +1,570 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <errno.h>
+#include "fed.h"
+
+/* The same matchmaking window the arena uses for its own players. */
+#ifndef MATCH_WINDOW
+    #define MATCH_WINDOW 100
+#endif
+
+#ifndef MATCH_WIDEN_MS
+    #define MATCH_WIDEN_MS 5000
+#endif
+
+#define MATCH_WIDEN_STEP 100
+
+#define MAX_EVENTS 64
+#define LISTEN_BACKLOG 128
+#define ACCEPT_BATCH 256
+/* Shards of one process the coordinator keeps reports for. */
+#define FED_MAX_SHARDS 64
+
+/***
+Matchmaking coordinator for a federation of battle processes on one host.
+Processes started with -c connect to its Unix socket and report, shard by
+shard, how many clients they have and who has been waiting for an
+opponent. After every report the waiting players of all processes are
+paired by rating, the way each arena pairs its own; a pair from two
+different processes is brought together by asking the process with more
+clients to send its player over. Players travel as their socket plus the
+arena's record of them, passed through here as SCM_RIGHTS. Announcements
+are relayed to every other process, and with -p the coordinator accepts
+players on its own port and hands each one to the least loaded process.
+It keeps no state a process cannot report again, so it can be restarted
+at any time; processes reconnect on their own.
+***/
+
+/* One connected process; slot numbers are what fed_away calls instances. */
+struct instance {
+    int fd;
+    int hello;
+    int port;
+    int pid;
+    int shards;
+    struct fed_report reports[FED_MAX_SHARDS];
+};
+
+/* A waiting player from some report, while pairing. */
+struct candidate {
+    int instance;
+    int shard;
+    int index;
+    int rating;
+    unsigned int waited_ms;
+};
+
+static struct instance instances[FED_MAX_INSTANCES];
+static struct candidate candidates[FED_MAX_INSTANCES * FED_MAX_SHARDS];
+static int epfd;
+static const char *sock_path = FED_SOCK;
+
+static int listen_unix(const char *path);
+static int listen_tcp(int port);
+static void accept_instances(int listenfd);
+static void accept_players(int listenfd);
+static void read_instance(int slot);
+static void drop_instance(int slot);
+static void forward_player(int from, char *buf, int len, int fd);
+static void relay_announce(int from, const char *buf, int len);
+static void pair_players(void);
+static int instance_clients(const struct instance *in);
+static int window(const struct candidate *c);
+static int by_rating(const void *a, const void *b);
+static int send_msg(int sock, const void *buf, int len, int fd);
+static void stop(int sig);
+
+/***
+Sets up the coordinator's socket and, with -p, its port for players, and
+serves both until stopped.
+int argc -> Argument count
+char **argv -> -s socket path, -p port for players
+Return -> Exit status
+***/
+int main(int argc, char **argv) {
+    struct epoll_event ev, events[MAX_EVENTS];
+    int opt, port = 0, unixfd, tcpfd = -1, i, n;
+    while ((opt = getopt(argc, argv, "s:p:")) != -1) {
+        switch (opt) {
+        case 's':
+            sock_path = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s socket] [-p port]\n", argv[0]);
+            return 1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    for (i = 0; i < FED_MAX_INSTANCES; i++) {
+        instances[i].fd = -1;
+    }
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    unixfd = listen_unix(sock_path);
+    ev.events = EPOLLIN;
+    ev.data.u64 = FED_MAX_INSTANCES;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, unixfd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    if (port > 0) {
+        tcpfd = listen_tcp(port);
+        ev.events = EPOLLIN;
+        ev.data.u64 = FED_MAX_INSTANCES + 1;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, tcpfd, &ev) < 0) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+        printf("Coordinator on %s, taking players on port %d\n", sock_path, port);
+    } else {
+        printf("Coordinator on %s\n", sock_path);
+    }
+    fflush(stdout);
+    while (1) {
+        if ((n = epoll_wait(epfd, events, MAX_EVENTS, -1)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.u64 == FED_MAX_INSTANCES) {
+                accept_instances(unixfd);
+            } else if (events[i].data.u64 == FED_MAX_INSTANCES + 1) {
+                accept_players(tcpfd);
+            } else {
+                read_instance((int)events[i].data.u64);
+            }
+        }
+    }
+    return 0;
+}
+
+/***
+Removes the socket file on the way out so the next coordinator can bind.
+int sig -> Signal received
+***/
+static void stop(int sig) {
+    (void)sig;
+    unlink(sock_path);
+    _exit(0);
+}
+
+/***
+Creates the Unix socket processes connect to, replacing a stale socket
+file a killed coordinator left behind.
+const char *path -> Where to bind it
+Return -> The listening socket
+***/
+static int listen_unix(const char *path) {
+    struct sockaddr_un addr;
+    int sock;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+    if ((sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        exit(1);
+    }
+    if (listen(sock, FED_MAX_INSTANCES) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    return sock;
+}
+
+/***
+Creates the TCP listener players may connect to instead of any one process.
+int port -> Port to listen on
+Return -> The listening socket
+***/
+static int listen_tcp(int port) {
+    struct sockaddr_in addr;
+    int sock, yes = 1;
+    if ((sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) < 0) {
+        perror("setsockopt");
+        exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    if (listen(sock, LISTEN_BACKLOG) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    return sock;
+}
+
+/***
+Accepts every process waiting to join. Each gets a free slot and counts
+once it has said hello.
+int listenfd -> The Unix socket
+***/
+static void accept_instances(int listenfd) {
+    struct epoll_event ev;
+    int sock, slot;
+    while ((sock = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+        for (slot = 0; slot < FED_MAX_INSTANCES && instances[slot].fd >= 0; slot++) {
+        }
+        if (slot == FED_MAX_INSTANCES) {
+            fprintf(stderr, "Refusing a process: already %d in the federation\n", FED_MAX_INSTANCES);
+            close(sock);
+            continue;
+        }
+        memset(&instances[slot], 0, sizeof(instances[slot]));
+        instances[slot].fd = sock;
+        ev.events = EPOLLIN;
+        ev.data.u64 = slot;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+            perror("epoll_ctl");
+            close(sock);
+            instances[slot].fd = -1;
+        }
+    }
+}
+
+/***
+Accepts every player waiting on the coordinator's own port and hands each
+to the process with the fewest clients. The estimate is bumped for every
+player handed over, so a burst spreads out before the next reports come.
+int listenfd -> The TCP listener
+***/
+static void accept_players(int listenfd) {
+    struct sockaddr_in addr;
+    socklen_t addrlen;
+    struct fed_client m;
+    int sock, i, best, best_clients, clients, batch = 0;
+    while (batch++ < ACCEPT_BATCH) {
+        addrlen = sizeof(addr);
+        if ((sock = accept4(listenfd, (struct sockaddr *)&addr, &addrlen, SOCK_CLOEXEC)) < 0) {
+            return;
+        }
+        best = -1;
+        best_clients = 0;
+        for (i = 0; i < FED_MAX_INSTANCES; i++) {
+            if (instances[i].fd < 0 || !instances[i].hello) {
+                continue;
+            }
+            clients = instance_clients(&instances[i]);
+            if (best < 0 || clients < best_clients) {
+                best = i;
+                best_clients = clients;
+            }
+        }
+        m.type = FED_CLIENT;
+        m.addr = addr.sin_addr;
+        if (best < 0 || send_msg(instances[best].fd, &m, sizeof(m), sock) < 0) {
+            const char *msg = "No arena is running, please try again later.\n";
+            if (write(sock, msg, strlen(msg)) < 0) {
+                /* Gone already; nothing more to tell them. */
+            }
+        } else {
+            instances[best].reports[0].clients++;
+        }
+        close(sock);
+    }
+}
+
+/***
+Reads one message from a process and acts on it.
+int slot -> The process
+***/
+static void read_instance(int slot) {
+    struct instance *in = &instances[slot];
+    char buf[FED_MAX_MSG];
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {buf, sizeof(buf)};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    uint32_t type;
+    int n, fd = -1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if ((n = recvmsg(in->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC)) <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        drop_instance(slot);
+        return;
+    }
+    if ((cmsg = CMSG_FIRSTHDR(&msg)) != NULL && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (n < (int)sizeof(type)) {
+        type = (uint32_t)-1;
+    } else {
+        memcpy(&type, buf, sizeof(type));
+    }
+    if (type == FED_HELLO && n == sizeof(struct fed_hello)) {
+        struct fed_hello *h = (struct fed_hello *)buf;
+        in->hello = 1;
+        in->port = h->port;
+        in->pid = h->pid;
+        in->shards = h->shards;
+        printf("Process %d joined: pid %d, port %d, %d shard%s\n", slot, in->pid, in->port, in->shards, in->shards == 1 ? "" : "s");
+        fflush(stdout);
+    } else if (type == FED_REPORT && n >= (int)offsetof(struct fed_report, waiting) && in->hello) {
+        struct fed_report *r = (struct fed_report *)buf;
+        if (r->shard >= 0 && r->shard < FED_MAX_SHARDS && r->count >= 0 && r->count <= FED_REPORT_MAX &&
+            n == (int)(offsetof(struct fed_report, waiting) + r->count * sizeof(struct fed_waiting))) {
+            memcpy(&in->reports[r->shard], r, n);
+            pair_players();
+        }
+    } else if (type == FED_PLAYER && n >= (int)sizeof(struct fed_player) && fd >= 0) {
+        forward_player(slot, buf, n, fd);
+    } else if (type == FED_ANNOUNCE && n >= (int)sizeof(struct fed_announce)) {
+        relay_announce(slot, buf, n);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/***
+Forgets a process that went away. Players on their way to it are sent
+back by forward_player.
+int slot -> The process
+***/
+static void drop_instance(int slot) {
+    struct instance *in = &instances[slot];
+    if (in->hello) {
+        printf("Process %d left: pid %d, port %d\n", slot, in->pid, in->port);
+        fflush(stdout);
+    }
+    close(in->fd);
+    memset(in, 0, sizeof(*in));
+    in->fd = -1;
+}
+
+/***
+Passes a player's socket and record on to the process they were sent to.
+If that process is gone, or cannot take the message right now, the player
+goes back to the sender, who puts them in the waiting queue of a shard of
+its own.
+int from -> Process that sent the player
+char *buf -> The fed_player message
+int len -> Its length
+int fd -> The player's socket; the caller closes this copy
+***/
+static void forward_player(int from, char *buf, int len, int fd) {
+    struct fed_player *m = (struct fed_player *)buf;
+    int to = m->to_instance;
+    if (to >= 0 && to < FED_MAX_INSTANCES && to != from && instances[to].fd >= 0 && instances[to].hello &&
+        send_msg(instances[to].fd, buf, len, fd) == 0) {
+        return;
+    }
+    m->to_instance = from;
+    m->to_shard = 0;
+    if (send_msg(instances[from].fd, buf, len, fd) < 0) {
+        fprintf(stderr, "Lost a player on their way from process %d\n", from);
+    }
+}
+
+/***
+Passes an announcement on to every process but the one it came from.
+int from -> Process that made it
+const char *buf -> The fed_announce message
+int len -> Its length
+***/
+static void relay_announce(int from, const char *buf, int len) {
+    int i;
+    for (i = 0; i < FED_MAX_INSTANCES; i++) {
+        if (i != from && instances[i].fd >= 0 && instances[i].hello) {
+            send_msg(instances[i].fd, buf, len, -1);
+        }
+    }
+}
+
+/***
+Pairs the waiting players of all processes by rating. Players are taken
+in rating order, and each is paired with the next one up from another
+process whose rating is within the window of either; the one who has to
+move must accept the other, since their new shard matches them with their
+own window. Both leave the stored reports, so a pair is only asked for
+once; if the move fails they show up again in the next report.
+***/
+static void pair_players(void) {
+    int count = 0, i, j, s, k;
+    for (i = 0; i < FED_MAX_INSTANCES; i++) {
+        if (instances[i].fd < 0 || !instances[i].hello) {
+            continue;
+        }
+        for (s = 0; s < FED_MAX_SHARDS; s++) {
+            struct fed_report *r = &instances[i].reports[s];
+            for (k = 0; k < r->count; k++) {
+                candidates[count].instance = i;
+                candidates[count].shard = s;
+                candidates[count].index = k;
+                candidates[count].rating = r->waiting[k].rating;
+                candidates[count].waited_ms = r->waiting[k].waited_ms;
+                count++;
+            }
+        }
+    }
+    if (count < 2) {
+        return;
+    }
+    qsort(candidates, count, sizeof(candidates[0]), by_rating);
+    for (i = 0; i < count; i++) {
+        struct candidate *a = &candidates[i];
+        if (a->instance < 0) {
+            continue;
+        }
+        for (j = i + 1; j < count; j++) {
+            struct candidate *b = &candidates[j], *mover, *host;
+            struct fed_away away;
+            int gap = b->rating - a->rating;
+            if (b->instance < 0 || b->instance == a->instance) {
+                continue;
+            }
+            if (gap > window(a) && gap > window(b)) {
+                break;
+            }
+            /* The busier process gives up its player, unless they could not accept the other. */
+            if (instance_clients(&instances[a->instance]) >= instance_clients(&instances[b->instance])) {
+                mover = a;
+                host = b;
+            } else {
+                mover = b;
+                host = a;
+            }
+            if (gap > window(mover)) {
+                struct candidate *t = mover;
+                mover = host;
+                host = t;
+            }
+            memset(&away, 0, sizeof(away));
+            away.type = FED_AWAY;
+            away.shard = mover->shard;
+            away.to_instance = host->instance;
+            away.to_shard = host->shard;
+            memcpy(away.name, instances[mover->instance].reports[mover->shard].waiting[mover->index].name, FED_NAME_LEN);
+            send_msg(instances[mover->instance].fd, &away, sizeof(away), -1);
+            instances[a->instance].reports[a->shard].waiting[a->index].name[0] = '\0';
+            instances[b->instance].reports[b->shard].waiting[b->index].name[0] = '\0';
+            a->instance = -1;
+            b->instance = -1;
+            break;
+        }
+    }
+    /* Take out the players paired above. */
+    for (i = 0; i < FED_MAX_INSTANCES; i++) {
+        for (s = 0; s < FED_MAX_SHARDS && instances[i].fd >= 0; s++) {
+            struct fed_report *r = &instances[i].reports[s];
+            for (j = k = 0; k < r->count; k++) {
+                if (r->waiting[k].name[0] != '\0') {
+                    r->waiting[j++] = r->waiting[k];
+                }
+            }
+            r->count = j;
+        }
+    }
+}
+
+/***
+Counts a process's clients from its shards' latest reports.
+const struct instance *in -> The process
+Return -> Its clients
+***/
+static int instance_clients(const struct instance *in) {
+    int s, clients = 0;
+    for (s = 0; s < FED_MAX_SHARDS; s++) {
+        clients += in->reports[s].clients;
+    }
+    return clients;
+}
+
+/***
+How far from their own rating a waiting player accepts an opponent, as in
+the arena: MATCH_WINDOW, plus MATCH_WIDEN_STEP every MATCH_WIDEN_MS.
+const struct candidate *c -> A waiting player
+Return -> Largest rating gap accepted
+***/
+static int window(const struct candidate *c) {
+    unsigned int widened = c->waited_ms / MATCH_WIDEN_MS;
+    if (widened > 1000) {
+        widened = 1000;
+    }
+    return MATCH_WINDOW + (int)widened * MATCH_WIDEN_STEP;
+}
+
+/***
+Orders waiting players by rating for qsort.
+const void *a -> A candidate
+const void *b -> Another candidate
+Return -> Negative, zero or positive as a rates below, level with or above b
+***/
+static int by_rating(const void *a, const void *b) {
+    const struct candidate *x = (const struct candidate *)a, *y = (const struct candidate *)b;
+    return (x->rating > y->rating) - (x->rating < y->rating);
+}
+
+/***
+Sends one message to a process without waiting, with a socket if given.
+int sock -> Connection to the process
+const void *buf -> The message
+int len -> Its length
+int fd -> Socket to pass along, or -1
+Return -> 0 if it was sent, -1 if not
+***/
+static int send_msg(int sock, const void *buf, int len, int fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {(void *)buf, len};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0) {
+        struct cmsghdr *cmsg;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    return sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == len ? 0 : -1;
+}
@@ -0,0 +1,112 @@
+#ifndef FED_H
+#define FED_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/***
+Federation: several battle processes joined into one arena by a
+coordinator. Every process keeps one SOCK_SEQPACKET connection to the
+coordinator's Unix socket, so each message below is one datagram and
+sockets travel with it as SCM_RIGHTS. The coordinator pairs players
+waiting in different processes, relays announcements to everyone and
+hands connections from its own port to the least loaded process.
+***/
+
+/* Unix socket the coordinator listens on, unless told otherwise. */
+#ifndef FED_SOCK
+    #define FED_SOCK "battle-coord.sock"
+#endif
+
+/* How often every shard reports its load and waiting players. */
+#ifndef FED_REPORT_MS
+    #define FED_REPORT_MS 500
+#endif
+
+/* How long a player waits for a local opponent before being offered around. */
+#ifndef FED_WAIT_MS
+    #define FED_WAIT_MS 1000
+#endif
+
+#define FED_MAX_INSTANCES 64
+#define FED_REPORT_MAX 64
+#define FED_NAME_LEN 20
+/* Largest datagram either side sends. */
+#define FED_MAX_MSG 8192
+
+enum fed_type {
+    FED_HELLO,      /* process -> coordinator: struct fed_hello */
+    FED_REPORT,     /* process -> coordinator: struct fed_report */
+    FED_AWAY,       /* coordinator -> process: struct fed_away */
+    FED_PLAYER,     /* both ways: struct fed_player and the player's socket */
+    FED_ANNOUNCE,   /* both ways: struct fed_announce */
+    FED_CLIENT      /* coordinator -> process: struct fed_client and a new socket */
+};
+
+/* First message of a process, once per connection to the coordinator. */
+struct fed_hello {
+    uint32_t type;
+    int32_t port;
+    int32_t shards;
+    int32_t pid;
+};
+
+/* A player who has waited at least FED_WAIT_MS for an opponent. */
+struct fed_waiting {
+    char name[FED_NAME_LEN];
+    int32_t rating;
+    uint32_t waited_ms;
+};
+
+/***
+One shard's state, every FED_REPORT_MS. It replaces whatever the shard
+reported before; the longest waiting players come first.
+***/
+struct fed_report {
+    uint32_t type;
+    int32_t shard;
+    int32_t clients;
+    int32_t count;
+    struct fed_waiting waiting[FED_REPORT_MAX];
+};
+
+/***
+Asks a process to send the waiting player name on shard to shard
+to_shard of process to_instance, where an opponent for them waits.
+***/
+struct fed_away {
+    uint32_t type;
+    int32_t shard;
+    int32_t to_instance;
+    int32_t to_shard;
+    char name[FED_NAME_LEN];
+};
+
+/***
+A player on their way to another process, followed by len bytes of the
+sender's own record of them, of the given version; the coordinator passes
+it on untouched. The receiver puts them in the waiting queue of shard
+to_shard, or back at the name prompt if it cannot read the record.
+***/
+struct fed_player {
+    uint32_t type;
+    uint32_t version;
+    int32_t to_instance;
+    int32_t to_shard;
+    int32_t len;
+};
+
+/* An announcement for every process but the sender: text, then frames. */
+struct fed_announce {
+    uint32_t type;
+    int32_t len;
+    int32_t frames_len;
+};
+
+/* A connection the coordinator accepted, from addr. */
+struct fed_client {
+    uint32_t type;
+    struct in_addr addr;
+};
+
+#endif
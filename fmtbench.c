@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "msgfmt.h"
+
+#define ROUNDS 2000000
+
+/***
+Microbenchmark for the per-move message formatting. One "move" renders
+the messages the attack path sends for an ordinary turn: the attacker's
+and defender's damage lines, the next player's menu and the waiting line.
+It is timed once with snprintf + strlen, as battle.c used to do, and once
+with the compiled templates.
+***/
+
+static struct tmpl t_attacked, t_attacked_by, t_your_turn, t_waiting_for;
+
+/* Sink so the compiler cannot drop the rendering. */
+static volatile int sink;
+
+static double elapsed_ns(struct timespec *a, struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1e9 + (b->tv_nsec - a->tv_nsec);
+}
+
+/***
+Formats one move's messages with snprintf and strlen.
+Return -> Total bytes formatted
+***/
+static int move_snprintf(const char *name, const char *opp, int damage, int hp, int pm, int opp_hp) {
+    char outbuf[512];
+    int total = 0;
+    snprintf(outbuf, sizeof(outbuf), "\nYou attacked %s for %d damage.\n", opp, damage);
+    total += strlen(outbuf);
+    snprintf(outbuf, sizeof(outbuf), "%s attacked you for %d damage.\n", name, damage);
+    total += strlen(outbuf);
+    snprintf(outbuf, sizeof(outbuf), "\nIt's your turn\n\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints: %d\n\n(a)ttack\n(p)owermove\n(s)peak\n(t)ime left\n\n", opp_hp, pm, name, hp);
+    total += strlen(outbuf);
+    snprintf(outbuf, sizeof(outbuf), "Waiting for %s to make a move...\n", opp);
+    total += strlen(outbuf);
+    return total;
+}
+
+/***
+Formats one move's messages with the compiled templates and cached name
+lengths.
+Return -> Total bytes formatted
+***/
+static int move_tmpl(const char *name, int name_len, const char *opp, int opp_len, int damage, int hp, int pm, int opp_hp) {
+    char outbuf[512];
+    int total = 0;
+    total += tmpl_render(outbuf, &t_attacked, opp, opp_len, damage);
+    total += tmpl_render(outbuf, &t_attacked_by, name, name_len, damage);
+    total += tmpl_render(outbuf, &t_your_turn, opp_hp, pm, name, name_len, hp);
+    total += tmpl_render(outbuf, &t_waiting_for, opp, opp_len);
+    return total;
+}
+
+int main(void) {
+    const char *name = "gladiator", *opp = "challenger";
+    int name_len = strlen(name), opp_len = strlen(opp);
+    struct timespec a, b;
+    double before, after;
+    int i, total = 0;
+    tmpl_compile(&t_attacked, "\nYou attacked %s for %d damage.\n");
+    tmpl_compile(&t_attacked_by, "%s attacked you for %d damage.\n");
+    tmpl_compile(&t_your_turn, "\nIt's your turn\n\nYour hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints: %d\n\n(a)ttack\n(p)owermove\n(s)peak\n(t)ime left\n\n");
+    tmpl_compile(&t_waiting_for, "Waiting for %s to make a move...\n");
+    if (move_snprintf(name, opp, 5, 27, 2, 19) != move_tmpl(name, name_len, opp, opp_len, 5, 27, 2, 19)) {
+        fprintf(stderr, "template output differs from snprintf\n");
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    for (i = 0; i < ROUNDS; i++) {
+        total += move_snprintf(name, opp, i % 5 + 2, 30 - i % 30, i % 3, 20 + i % 11);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    before = elapsed_ns(&a, &b) / ROUNDS;
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    for (i = 0; i < ROUNDS; i++) {
+        total += move_tmpl(name, name_len, opp, opp_len, i % 5 + 2, 30 - i % 30, i % 3, 20 + i % 11);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    after = elapsed_ns(&a, &b) / ROUNDS;
+    sink = total;
+    printf("snprintf:  %.1f ns per move\n", before);
+    printf("templates: %.1f ns per move (%.1fx)\n", after, before / after);
+    return 0;
+}
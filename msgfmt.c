@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "msgfmt.h"
+
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+/***
+Splits a format string into literal pieces and %s / %d holes. The pieces
+point into fmt, which must stay alive, so templates are built from string
+literals. Any other conversion is a programming error and exits.
+struct tmpl *t -> Template being built
+const char *fmt -> printf-style format using only %s and %d
+***/
+void tmpl_compile(struct tmpl *t, const char *fmt) {
+    const char *start = fmt, *s;
+    int fixed = 0;
+    t->nargs = 0;
+    for (s = fmt; *s != '\0'; s++) {
+        if (*s != '%') {
+            continue;
+        }
+        if ((s[1] != 's' && s[1] != 'd') || t->nargs == TMPL_MAX_ARGS) {
+            fprintf(stderr, "bad message template: %s\n", fmt);
+            exit(1);
+        }
+        t->lit[t->nargs] = start;
+        t->lit_len[t->nargs] = s - start;
+        fixed += s - start;
+        t->kind[t->nargs++] = s[1];
+        start = s + 2;
+        s++;
+    }
+    t->lit[t->nargs] = start;
+    t->lit_len[t->nargs] = s - start;
+    fixed += s - start;
+    t->bound = fixed;
+    for (s = t->kind; s < t->kind + t->nargs; s++) {
+        t->bound += (*s == 's') ? TMPL_MAX_STR : TMPL_MAX_INT;
+    }
+}
+
+/***
+Renders a template. Takes a (const char *, int) pair for every %s and an
+int for every %d, in order.
+char *out -> Room for at least t->bound bytes
+const struct tmpl *t -> Compiled template
+Return -> Number of bytes written, no terminating NUL
+***/
+int tmpl_render(char *out, const struct tmpl *t, ...) {
+    va_list ap;
+    int len;
+    va_start(ap, t);
+    len = tmpl_vrender(out, t, ap);
+    va_end(ap);
+    return len;
+}
+
+/***
+Renders a template from a va_list; see tmpl_render.
+char *out -> Room for at least t->bound bytes
+const struct tmpl *t -> Compiled template
+va_list ap -> The template's arguments
+Return -> Number of bytes written, no terminating NUL
+***/
+int tmpl_vrender(char *out, const struct tmpl *t, va_list ap) {
+    char *o = out;
+    int i;
+    for (i = 0; i < t->nargs; i++) {
+        memcpy(o, t->lit[i], t->lit_len[i]);
+        o += t->lit_len[i];
+        if (t->kind[i] == 's') {
+            const char *s = va_arg(ap, const char *);
+            int len = va_arg(ap, int);
+            if (len > TMPL_MAX_STR) {
+                len = TMPL_MAX_STR;
+            }
+            memcpy(o, s, len);
+            o += len;
+        } else {
+            o += fmt_int(o, va_arg(ap, int));
+        }
+    }
+    memcpy(o, t->lit[i], t->lit_len[i]);
+    o += t->lit_len[i];
+    return o - out;
+}
+
+/***
+Writes an int in decimal, two digits at a time.
+char *out -> Room for at least TMPL_MAX_INT bytes
+int v -> Number to write
+Return -> Number of bytes written
+***/
+int fmt_int(char *out, int v) {
+    char buf[TMPL_MAX_INT];
+    char *p = buf + sizeof(buf);
+    unsigned int u = (v < 0) ? 0u - (unsigned int)v : (unsigned int)v;
+    int len;
+    while (u >= 100) {
+        unsigned int r = (u % 100) * 2;
+        u /= 100;
+        *--p = digit_pairs[r + 1];
+        *--p = digit_pairs[r];
+    }
+    if (u >= 10) {
+        *--p = digit_pairs[u * 2 + 1];
+        *--p = digit_pairs[u * 2];
+    } else {
+        *--p = (char)('0' + u);
+    }
+    if (v < 0) {
+        *--p = '-';
+    }
+    len = buf + sizeof(buf) - p;
+    memcpy(out, p, len);
+    return len;
+}
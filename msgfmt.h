@@ -0,0 +1,31 @@
+#ifndef MSGFMT_H
+#define MSGFMT_H
+
+#include <stdarg.h>
+
+/* Most variable parts one template may have. */
+#define TMPL_MAX_ARGS 6
+/* Longest string argument copied in; names and speak messages fit. */
+#define TMPL_MAX_STR 32
+/* Longest int argument, "-2147483648". */
+#define TMPL_MAX_INT 11
+
+/***
+A message split at its variable parts once at startup. Rendering copies
+the literal pieces and fills each %s from a (const char *, int) slice and
+each %d from an int, so no format string is parsed per message.
+***/
+struct tmpl {
+    int nargs;
+    int bound;
+    char kind[TMPL_MAX_ARGS];
+    const char *lit[TMPL_MAX_ARGS + 1];
+    int lit_len[TMPL_MAX_ARGS + 1];
+};
+
+void tmpl_compile(struct tmpl *t, const char *fmt);
+int tmpl_render(char *out, const struct tmpl *t, ...);
+int tmpl_vrender(char *out, const struct tmpl *t, va_list ap);
+int fmt_int(char *out, int v);
+
+#endif
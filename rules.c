@@ -0,0 +1,111 @@
+#include <math.h>
+#include "rules.h"
+
+/***
+Seeds a generator. Any seed is fine, including 0.
+struct prng *r -> Generator being seeded
+uint64_t seed -> Seed
+***/
+void prng_seed(struct prng *r, uint64_t seed) {
+    r->state = seed;
+}
+
+/***
+Draws the next 64 random bits (splitmix64).
+struct prng *r -> Generator
+Return -> Random value
+***/
+uint64_t prng_next(struct prng *r) {
+    uint64_t z = (r->state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/***
+Draws a number in [0, n) by scaling the top 32 bits, without a division.
+struct prng *r -> Generator
+int n -> Upper bound, at least 1
+Return -> Random value below n
+***/
+int prng_below(struct prng *r, int n) {
+    return (int)(((prng_next(r) >> 32) * (uint64_t)n) >> 32);
+}
+
+/***
+Sets up a match: both fighters get 20-30 hitpoints and 1-3 power moves,
+side 0 first, then a coin flip picks who moves first.
+struct match *m -> Match being set up
+uint64_t seed -> Seed that decides everything random in the match
+***/
+void match_init(struct match *m, uint64_t seed) {
+    int i;
+    m->seed = seed;
+    prng_seed(&m->rng, seed);
+    for (i = 0; i < 2; i++) {
+        m->fighter[i].hitpoints = prng_below(&m->rng, 11) + 20;
+        m->fighter[i].powermoves = prng_below(&m->rng, 3) + 1;
+    }
+    m->turn = prng_below(&m->rng, 2);
+    m->winner = -1;
+    m->moves = 0;
+}
+
+/***
+Plays one move for the side whose turn it is. An attack deals 2-6 damage.
+A power move uses one up and either deals three times 2-6 damage or
+misses. A timeout deals nothing. The match is won when the other side's
+hitpoints reach 0; otherwise the turn passes.
+struct match *m -> Match being played
+enum move mv -> The move
+struct move_result *r -> Filled in with what happened
+Return -> 0 if the move was played, -1 if the match is over or a power
+move was asked for with none left
+***/
+int match_move(struct match *m, enum move mv, struct move_result *r) {
+    struct fighter *target = &m->fighter[1 - m->turn];
+    if (m->winner >= 0 || (mv == MOVE_POWER && m->fighter[m->turn].powermoves == 0)) {
+        return -1;
+    }
+    r->side = m->turn;
+    r->damage = 0;
+    r->power = (mv == MOVE_POWER);
+    r->missed = 0;
+    r->finished = 0;
+    if (mv == MOVE_ATTACK) {
+        r->damage = prng_below(&m->rng, 5) + 2;
+    } else if (mv == MOVE_POWER) {
+        m->fighter[m->turn].powermoves--;
+        if (prng_below(&m->rng, 2) == 0) {
+            r->damage = (prng_below(&m->rng, 5) + 2) * 3;
+        } else {
+            r->missed = 1;
+        }
+    }
+    target->hitpoints -= r->damage;
+    m->moves++;
+    if (target->hitpoints <= 0) {
+        m->winner = m->turn;
+        r->finished = 1;
+    } else {
+        m->turn = 1 - m->turn;
+    }
+    return 0;
+}
+
+/***
+Moves rating points from the loser to the winner (Elo). The fewer points
+the winner was expected to win by, the more they take; at least one point
+always changes hands.
+int *winner -> Winner's rating, updated
+int *loser -> Loser's rating, updated
+***/
+void elo_update(int *winner, int *loser) {
+    double expected = 1.0 / (1.0 + pow(10.0, (*loser - *winner) / 400.0));
+    int delta = (int)(ELO_K * (1.0 - expected) + 0.5);
+    if (delta < 1) {
+        delta = 1;
+    }
+    *winner += delta;
+    *loser -= delta;
+}
@@ -0,0 +1,51 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include <stdint.h>
+
+/* Per-match random number generator (splitmix64). */
+struct prng {
+    uint64_t state;
+};
+
+struct fighter {
+    int hitpoints;
+    int powermoves;
+};
+
+enum move { MOVE_ATTACK, MOVE_POWER, MOVE_TIMEOUT };
+
+/* Most rating points one match can move. */
+#define ELO_K 32
+
+/***
+The whole state of one match. Everything random comes from the match's
+own generator, so a match is fully determined by its seed and the moves
+made in it, and can be replayed or simulated without any sockets.
+***/
+struct match {
+    uint64_t seed;
+    struct prng rng;
+    struct fighter fighter[2];
+    int turn;
+    int winner;
+    int moves;
+};
+
+/* What a move did, for the messages and the event log. */
+struct move_result {
+    int side;
+    int damage;
+    int power;
+    int missed;
+    int finished;
+};
+
+void prng_seed(struct prng *r, uint64_t seed);
+uint64_t prng_next(struct prng *r);
+int prng_below(struct prng *r, int n);
+void match_init(struct match *m, uint64_t seed);
+int match_move(struct match *m, enum move mv, struct move_result *r);
+void elo_update(int *winner, int *loser);
+
+#endif
@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "rules.h"
+
+#define MAX_THREADS 64
+#define MAX_LINE 1024
+
+/***
+Headless driver for the battle rules in rules.c, no sockets involved.
+With -r it replays an event log written by the server: every match is
+rebuilt from the seed in its match_start line, the logged moves are played
+again and the damage and outcome are checked against the log.
+Otherwise it simulates matches from consecutive seeds on all threads with
+a fixed policy and reports matches/sec and balance figures.
+***/
+
+/* A match being replayed, indexed by its id. */
+struct replay {
+    int active;
+    struct match m;
+};
+
+/* One simulation thread's share of the seeds and what it saw. */
+struct worker {
+    pthread_t thread;
+    uint64_t first_seed;
+    uint64_t nmatches;
+    uint64_t moves;
+    uint64_t first_wins;
+    uint64_t power_hits;
+    uint64_t power_moves;
+};
+
+static int replay(const char *path);
+static void *run_worker(void *arg);
+static int simulate(uint64_t nmatches, int nthreads, uint64_t seed);
+
+/***
+Parses the options and runs a replay or a simulation.
+-r file -> Replay an event log instead of simulating
+-n matches -> Matches to simulate (1000000)
+-t threads -> Simulation threads (online CPUs)
+-s seed -> First seed (1)
+***/
+int main(int argc, char **argv) {
+    const char *path = NULL;
+    uint64_t nmatches = 1000000, seed = 1;
+    int nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN), opt;
+    while ((opt = getopt(argc, argv, "r:n:t:s:")) != -1) {
+        switch (opt) {
+        case 'r': path = optarg; break;
+        case 'n': nmatches = strtoull(optarg, NULL, 10); break;
+        case 't': nthreads = atoi(optarg); break;
+        case 's': seed = strtoull(optarg, NULL, 10); break;
+        default:
+            fprintf(stderr, "usage: %s [-r events.jsonl] [-n matches] [-t threads] [-s seed]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (path != NULL) {
+        return replay(path);
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    if (nthreads > MAX_THREADS) {
+        nthreads = MAX_THREADS;
+    }
+    if (nmatches < (uint64_t)nthreads) {
+        fprintf(stderr, "bad arguments\n");
+        exit(1);
+    }
+    return simulate(nmatches, nthreads, seed);
+}
+
+/***
+Finds a numeric field in an event line. Names are escaped by the server,
+so the key cannot show up inside one.
+const char *line -> One JSON line
+const char *key -> Key with its quotes and colon, e.g. "\"match\":"
+uint64_t *out -> Set to the value
+Return -> 1 if the field was found, 0 otherwise
+***/
+static int field(const char *line, const char *key, uint64_t *out) {
+    const char *s = strstr(line, key);
+    if (s == NULL) {
+        return 0;
+    }
+    *out = strtoull(s + strlen(key), NULL, 10);
+    return 1;
+}
+
+/***
+Looks up the replay slot for a match id, growing the table as needed.
+struct replay **table -> The table, indexed by match id
+uint64_t *size -> Number of slots in the table
+uint64_t id -> Match id
+Return -> The slot
+***/
+static struct replay *slot_for(struct replay **table, uint64_t *size, uint64_t id) {
+    if (id >= *size) {
+        uint64_t grown = *size ? *size : 1024;
+        while (grown <= id) {
+            grown *= 2;
+        }
+        *table = (struct replay *)realloc(*table, grown * sizeof(struct replay));
+        if (*table == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(*table + *size, 0, (grown - *size) * sizeof(struct replay));
+        *size = grown;
+    }
+    return &(*table)[id];
+}
+
+/***
+Replays an event log. Moves of a match that has no match_start line (the
+server drops events when its log ring is full) are skipped and counted.
+const char *path -> Event log written by the server
+Return -> 0 if every replayed move and result agreed with the log, 1 if not
+***/
+static int replay(const char *path) {
+    FILE *f = fopen(path, "r");
+    char line[MAX_LINE];
+    struct replay *table = NULL;
+    uint64_t size = 0, id, seed, damage, power, matches = 0, finished = 0, moves = 0;
+    uint64_t mismatches = 0, skipped = 0;
+    if (f == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        struct move_result r;
+        struct replay *rp;
+        int is_attack = strstr(line, "\"ev\":\"attack\"") != NULL;
+        int is_timeout = strstr(line, "\"ev\":\"timeout\"") != NULL;
+        int is_result = strstr(line, "\"ev\":\"result\"") != NULL;
+        if (strstr(line, "\"ev\":\"match_start\"") != NULL) {
+            if (!field(line, "\"match\":", &id) || !field(line, "\"seed\":", &seed)) {
+                continue;
+            }
+            rp = slot_for(&table, &size, id);
+            match_init(&rp->m, seed);
+            rp->active = 1;
+            matches++;
+            continue;
+        }
+        if (!(is_attack || is_timeout || is_result) || !field(line, "\"match\":", &id)) {
+            continue;
+        }
+        rp = slot_for(&table, &size, id);
+        if (!rp->active) {
+            skipped++;
+            continue;
+        }
+        if (is_result) {
+            if (strstr(line, "\"by\":\"ko\"") != NULL && rp->m.winner < 0) {
+                fprintf(stderr, "match %llu: logged a knockout the rules did not reach\n", (unsigned long long)id);
+                mismatches++;
+            }
+            rp->active = 0;
+            finished++;
+            continue;
+        }
+        moves++;
+        if (is_timeout) {
+            match_move(&rp->m, MOVE_TIMEOUT, &r);
+            continue;
+        }
+        field(line, "\"damage\":", &damage);
+        field(line, "\"power\":", &power);
+        if (match_move(&rp->m, power ? MOVE_POWER : MOVE_ATTACK, &r) < 0 || (uint64_t)r.damage != damage) {
+            fprintf(stderr, "match %llu: move %d logged %llu damage, replay gave %d\n",
+                    (unsigned long long)id, rp->m.moves, (unsigned long long)damage, r.damage);
+            mismatches++;
+            rp->active = 0;
+        }
+    }
+    fclose(f);
+    free(table);
+    printf("replayed %llu matches (%llu finished), %llu moves, %llu mismatches, %llu events skipped\n",
+           (unsigned long long)matches, (unsigned long long)finished, (unsigned long long)moves,
+           (unsigned long long)mismatches, (unsigned long long)skipped);
+    return mismatches == 0 ? 0 : 1;
+}
+
+/***
+Plays one thread's matches to the end. The policy spends a power move
+whenever the opponent still has more than 12 hitpoints, and attacks
+otherwise.
+void *arg -> The thread's struct worker
+Return -> NULL
+***/
+static void *run_worker(void *arg) {
+    struct worker *w = (struct worker *)arg;
+    struct match m;
+    struct move_result r;
+    uint64_t i;
+    for (i = 0; i < w->nmatches; i++) {
+        match_init(&m, w->first_seed + i);
+        int first = m.turn;
+        while (m.winner < 0) {
+            int power = m.fighter[m.turn].powermoves > 0 && m.fighter[1 - m.turn].hitpoints > 12;
+            match_move(&m, power ? MOVE_POWER : MOVE_ATTACK, &r);
+            if (power) {
+                w->power_moves++;
+                w->power_hits += !r.missed;
+            }
+        }
+        w->moves += m.moves;
+        w->first_wins += (m.winner == first);
+    }
+    return NULL;
+}
+
+/***
+Simulates matches from seeds seed, seed + 1, ... split over the threads
+and prints the throughput and balance report.
+uint64_t nmatches -> Matches to play
+int nthreads -> Threads to play them on
+uint64_t seed -> First seed
+Return -> 0
+***/
+static int simulate(uint64_t nmatches, int nthreads, uint64_t seed) {
+    struct worker workers[MAX_THREADS];
+    struct timespec a, b;
+    uint64_t moves = 0, first_wins = 0, power_hits = 0, power_moves = 0;
+    double secs;
+    int i;
+    memset(workers, 0, sizeof(workers));
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    for (i = 0; i < nthreads; i++) {
+        workers[i].first_seed = seed + nmatches / nthreads * i;
+        workers[i].nmatches = (i == nthreads - 1) ? nmatches - nmatches / nthreads * i : nmatches / nthreads;
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        moves += workers[i].moves;
+        first_wins += workers[i].first_wins;
+        power_hits += workers[i].power_hits;
+        power_moves += workers[i].power_moves;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    secs = (b.tv_sec - a.tv_sec) + (b.tv_nsec - a.tv_nsec) / 1e9;
+    printf("matches: %llu in %.3f s on %d thread%s (%.0f matches/sec, %.0f moves/sec)\n",
+           (unsigned long long)nmatches, secs, nthreads, nthreads == 1 ? "" : "s",
+           nmatches / secs, moves / secs);
+    printf("moves per match: %.2f\n", (double)moves / nmatches);
+    printf("first mover wins: %.2f%%\n", 100.0 * first_wins / nmatches);
+    printf("power moves hit: %.2f%%\n", power_moves ? 100.0 * power_hits / power_moves : 0.0);
+    return 0;
+}
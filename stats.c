@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "stats.h"
+
+/***
+Persistent player records. The table is an open addressing hash table of
+struct player_stats slots in a memory-mapped file, so opening it costs a
+mmap however many players it holds; pages are faulted in as names are
+looked up. Shards never touch the file: they queue match results in a
+lock-free ring (the same scheme as the event log) and a writer thread
+applies them every STATS_FLUSH_MS. The writer appends the new records to
+a write-ahead log and fdatasyncs it before moving on, and checkpoints by
+msyncing the table and emptying the log once the log passes
+STATS_CHECKPOINT_BYTES. Log entries hold whole records, not deltas, so
+replaying one twice at startup is harmless.
+The writer is the only thread that changes the table; lookups from the
+shards take a read lock for the few loads of one probe sequence.
+stats_close has the writer apply what is queued, checkpoint and stop, so
+another process can open the table.
+***/
+
+#define STATS_MAGIC "BTSTATS1"
+
+/* First bytes of the table file. */
+struct stats_header {
+    char magic[8];
+    uint64_t capacity;
+    uint64_t count;
+    char reserved[40];
+};
+
+/* A write-ahead log entry: the record and a checksum over it. */
+struct wal_entry {
+    struct player_stats rec;
+    uint64_t sum;
+};
+
+/* A finished match waiting for the writer thread. */
+struct stats_update {
+    char winner[STATS_NAME_LEN];
+    char loser[STATS_NAME_LEN];
+    int winner_damage;
+    int loser_damage;
+    int winner_rating;
+    int loser_rating;
+};
+
+struct stats_slot {
+    uint64_t seq;
+    struct stats_update up;
+};
+
+static struct stats_slot ring[STATS_RING_SIZE];
+static uint64_t ring_tail = 0;
+static uint64_t ring_head = 0;
+static uint64_t dropped = 0;
+
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct stats_header *header;
+static struct player_stats *table;
+static size_t table_bytes;
+static int table_fd = -1;
+static int wal_fd = -1;
+static off_t wal_size = 0;
+static char *table_path;
+static char *wal_path;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static int closing = 0;
+static int closed = 0;
+
+static void *run_stats(void *arg);
+
+/***
+FNV-1a over a name or over raw bytes.
+const void *data -> Bytes to hash
+size_t len -> Number of bytes
+Return -> 64-bit hash
+***/
+static uint64_t fnv(const void *data, size_t len) {
+    const unsigned char *s = (const unsigned char *)data;
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h = (h ^ s[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/***
+Finds the slot a name lives in, or the empty slot it would go in.
+struct player_stats *t -> Table to search
+uint64_t capacity -> Number of slots, a power of two
+const char *name -> NUL-terminated name
+Return -> The slot
+***/
+static struct player_stats *probe(struct player_stats *t, uint64_t capacity, const char *name) {
+    uint64_t i = fnv(name, strlen(name)) & (capacity - 1);
+    while (t[i].name[0] != '\0' && strncmp(t[i].name, name, STATS_NAME_LEN) != 0) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &t[i];
+}
+
+/***
+Maps a table file, creating it with the given capacity if it is empty.
+Exits if the file is not a stats table.
+const char *path -> Table file
+uint64_t capacity -> Capacity for a new file, a power of two
+int *fd -> Set to the open file
+size_t *bytes -> Set to the size of the mapping
+Return -> The mapped header; the slots follow it
+***/
+static struct stats_header *map_table(const char *path, uint64_t capacity, int *fd, size_t *bytes) {
+    struct stats_header *h;
+    struct stat st;
+    if ((*fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0 || fstat(*fd, &st) < 0) {
+        perror(path);
+        exit(1);
+    }
+    if (st.st_size == 0) {
+        st.st_size = sizeof(struct stats_header) + capacity * sizeof(struct player_stats);
+        if (ftruncate(*fd, st.st_size) < 0) {
+            perror(path);
+            exit(1);
+        }
+    }
+    *bytes = st.st_size;
+    h = (struct stats_header *)mmap(NULL, *bytes, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (h == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    if (h->magic[0] == '\0') {
+        memcpy(h->magic, STATS_MAGIC, 8);
+        h->capacity = capacity;
+        h->count = 0;
+    }
+    if (memcmp(h->magic, STATS_MAGIC, 8) != 0 ||
+        *bytes != sizeof(struct stats_header) + h->capacity * sizeof(struct player_stats)) {
+        fprintf(stderr, "%s is not a stats table\n", path);
+        exit(1);
+    }
+    return h;
+}
+
+/***
+Doubles the table into a new file and renames it over the old one. Only
+the writer thread changes the table, so the copy is made without the
+lock; the lock is held just to swap the mappings.
+***/
+static void grow_table(void) {
+    char tmp[4096];
+    struct stats_header *h, *old = header;
+    struct player_stats *t;
+    size_t bytes, old_bytes = table_bytes;
+    uint64_t i;
+    int fd, old_fd = table_fd;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", table_path);
+    unlink(tmp);
+    h = map_table(tmp, header->capacity * 2, &fd, &bytes);
+    t = (struct player_stats *)(h + 1);
+    for (i = 0; i < header->capacity; i++) {
+        if (table[i].name[0] != '\0') {
+            *probe(t, h->capacity, table[i].name) = table[i];
+        }
+    }
+    h->count = header->count;
+    if (msync(h, bytes, MS_SYNC) < 0 || rename(tmp, table_path) < 0) {
+        perror(table_path);
+        exit(1);
+    }
+    pthread_rwlock_wrlock(&table_lock);
+    header = h;
+    table = t;
+    table_bytes = bytes;
+    table_fd = fd;
+    pthread_rwlock_unlock(&table_lock);
+    munmap(old, old_bytes);
+    close(old_fd);
+}
+
+/***
+Stores a whole record in the table, adding the name if it is new.
+const struct player_stats *rec -> Record to store
+***/
+static void put_record(const struct player_stats *rec) {
+    struct player_stats *slot;
+    if ((header->count + 1) * 4 > header->capacity * 3) {
+        grow_table();
+    }
+    pthread_rwlock_wrlock(&table_lock);
+    slot = probe(table, header->capacity, rec->name);
+    if (slot->name[0] == '\0') {
+        header->count++;
+    }
+    *slot = *rec;
+    pthread_rwlock_unlock(&table_lock);
+}
+
+/***
+Empties the write-ahead log once everything in it is safely in the table.
+***/
+static void checkpoint(void) {
+    if (msync(header, table_bytes, MS_SYNC) < 0 || ftruncate(wal_fd, 0) < 0) {
+        perror(table_path);
+        return;
+    }
+    wal_size = 0;
+}
+
+/***
+Applies the write-ahead log left by the previous run. A torn entry at the
+end, from a crash in the middle of a write, ends the replay.
+Return -> Number of entries applied
+***/
+static int replay_wal(void) {
+    struct wal_entry e;
+    int n = 0;
+    while (read(wal_fd, &e, sizeof(e)) == (ssize_t)sizeof(e)) {
+        if (e.sum != fnv(&e.rec, sizeof(e.rec)) || e.rec.name[0] == '\0') {
+            break;
+        }
+        e.rec.name[STATS_NAME_LEN - 1] = '\0';
+        put_record(&e.rec);
+        n++;
+    }
+    return n;
+}
+
+/***
+Opens the stats table and its write-ahead log, replays the log and starts
+the writer thread. Runs before any shard.
+const char *path -> Table file; the log is the same name with ".wal"
+***/
+void stats_open(const char *path) {
+    pthread_t writer;
+    int i;
+    for (i = 0; i < STATS_RING_SIZE; i++) {
+        ring[i].seq = i;
+    }
+    table_path = strdup(path);
+    if (table_path == NULL || asprintf(&wal_path, "%s.wal", path) < 0) {
+        perror("malloc");
+        exit(1);
+    }
+    header = map_table(table_path, STATS_INITIAL_CAPACITY, &table_fd, &table_bytes);
+    table = (struct player_stats *)(header + 1);
+    if ((wal_fd = open(wal_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+        perror(wal_path);
+        exit(1);
+    }
+    if (replay_wal() > 0) {
+        checkpoint();
+    } else if (ftruncate(wal_fd, 0) < 0) {
+        perror(wal_path);
+    }
+    if (pthread_create(&writer, NULL, run_stats, NULL) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
+        exit(1);
+    }
+    pthread_detach(writer);
+}
+
+/***
+Has the writer apply every queued result, checkpoint and stop. Returns
+once it has; results submitted after that are never stored.
+***/
+void stats_close(void) {
+    pthread_mutex_lock(&writer_lock);
+    closing = 1;
+    pthread_cond_broadcast(&writer_cond);
+    while (!closed) {
+        pthread_cond_wait(&writer_cond, &writer_lock);
+    }
+    pthread_mutex_unlock(&writer_lock);
+}
+
+/***
+Copies out a player's record. Safe to call from any shard.
+const char *name -> NUL-terminated name
+struct player_stats *out -> Filled in with the record
+Return -> 1 if the player has a record, 0 if not
+***/
+int stats_lookup(const char *name, struct player_stats *out) {
+    struct player_stats *slot;
+    int found;
+    pthread_rwlock_rdlock(&table_lock);
+    slot = probe(table, header->capacity, name);
+    found = slot->name[0] != '\0';
+    if (found) {
+        *out = *slot;
+    }
+    pthread_rwlock_unlock(&table_lock);
+    return found;
+}
+
+/***
+Queues the result of a match for the writer thread. Safe to call from
+any shard at the same time and never waits; if the queue is full the
+result is dropped and counted.
+const char *winner -> Winner's name
+int winner_damage -> Damage the winner dealt in the match
+int winner_rating -> Winner's rating after the match
+const char *loser -> Loser's name
+int loser_damage -> Damage the loser dealt in the match
+int loser_rating -> Loser's rating after the match
+Return -> 0 if queued, -1 if dropped
+***/
+int stats_submit(const char *winner, int winner_damage, int winner_rating, const char *loser, int loser_damage, int loser_rating) {
+    uint64_t pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+    struct stats_slot *slot;
+    while (1) {
+        slot = &ring[pos & (STATS_RING_SIZE - 1)];
+        int64_t diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring_tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return -1;
+        } else {
+            pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+        }
+    }
+    strncpy(slot->up.winner, winner, STATS_NAME_LEN - 1);
+    slot->up.winner[STATS_NAME_LEN - 1] = '\0';
+    strncpy(slot->up.loser, loser, STATS_NAME_LEN - 1);
+    slot->up.loser[STATS_NAME_LEN - 1] = '\0';
+    slot->up.winner_damage = winner_damage;
+    slot->up.loser_damage = loser_damage;
+    slot->up.winner_rating = winner_rating;
+    slot->up.loser_rating = loser_rating;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/***
+Number of players with a record.
+Return -> Record count
+***/
+uint64_t stats_records(void) {
+    uint64_t n;
+    pthread_rwlock_rdlock(&table_lock);
+    n = header->count;
+    pthread_rwlock_unlock(&table_lock);
+    return n;
+}
+
+/***
+Number of results dropped because the queue was full.
+Return -> Dropped results since startup
+***/
+uint64_t stats_dropped(void) {
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+/***
+Reads a player's record for the writer, starting a new one for a name
+that has none. Only the writer changes the table, so no lock is needed.
+const char *name -> NUL-terminated name
+struct player_stats *rec -> Filled in with the record
+***/
+static void get_record(const char *name, struct player_stats *rec) {
+    struct player_stats *slot = probe(table, header->capacity, name);
+    if (slot->name[0] != '\0') {
+        *rec = *slot;
+        return;
+    }
+    memset(rec, 0, sizeof(*rec));
+    strncpy(rec->name, name, STATS_NAME_LEN - 1);
+    rec->rating = STATS_RATING_START;
+}
+
+/***
+Adds one entry to the pending write-ahead log batch, writing the batch
+out first if it is full.
+struct wal_entry *batch -> Pending entries
+int *n -> Number of pending entries
+int max -> Room in the batch
+const struct player_stats *rec -> Record to log
+***/
+static void log_record(struct wal_entry *batch, int *n, int max, const struct player_stats *rec) {
+    if (*n == max) {
+        if (write(wal_fd, batch, *n * sizeof(*batch)) < 0) {
+            perror(wal_path);
+        }
+        wal_size += *n * sizeof(*batch);
+        *n = 0;
+    }
+    batch[*n].rec = *rec;
+    batch[*n].sum = fnv(rec, sizeof(*rec));
+    (*n)++;
+}
+
+/***
+Background writer of the stats table. Every STATS_FLUSH_MS it empties the
+queue, updates both players' records, logs them and syncs the log, and
+checkpoints when the log has grown large. Ratings are worked out by the
+shard that ran the match and are stored as given. After the pass
+stats_close asked for, it checkpoints and stops.
+void *arg -> Unused
+***/
+static void *run_stats(void *arg) {
+    static struct wal_entry batch[512];
+    struct timespec deadline;
+    struct stats_update up;
+    struct player_stats w, l;
+    int n, stop;
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&writer_lock);
+        if (!closing) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (STATS_FLUSH_MS % 1000) * 1000000L;
+            deadline.tv_sec += STATS_FLUSH_MS / 1000 + deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&writer_cond, &writer_lock, &deadline);
+        }
+        stop = closing;
+        pthread_mutex_unlock(&writer_lock);
+        n = 0;
+        while (1) {
+            struct stats_slot *slot = &ring[ring_head & (STATS_RING_SIZE - 1)];
+            if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring_head + 1) {
+                break;
+            }
+            up = slot->up;
+            __atomic_store_n(&slot->seq, ring_head + STATS_RING_SIZE, __ATOMIC_RELEASE);
+            ring_head++;
+            get_record(up.winner, &w);
+            w.wins++;
+            w.matches++;
+            w.damage += up.winner_damage;
+            w.rating = up.winner_rating;
+            put_record(&w);
+            get_record(up.loser, &l);
+            l.losses++;
+            l.matches++;
+            l.damage += up.loser_damage;
+            l.rating = up.loser_rating;
+            put_record(&l);
+            log_record(batch, &n, 512, &w);
+            log_record(batch, &n, 512, &l);
+        }
+        if (n > 0) {
+            if (write(wal_fd, batch, n * sizeof(*batch)) < 0) {
+                perror(wal_path);
+            }
+            wal_size += n * sizeof(*batch);
+        }
+        if (wal_size > 0 && fdatasync(wal_fd) < 0) {
+            perror(wal_path);
+        }
+        if (wal_size > STATS_CHECKPOINT_BYTES || stop) {
+            checkpoint();
+        }
+        if (stop) {
+            pthread_mutex_lock(&writer_lock);
+            closed = 1;
+            pthread_cond_broadcast(&writer_cond);
+            pthread_mutex_unlock(&writer_lock);
+            return NULL;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,45 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+/* Longest name plus its NUL, the same as a client's name. */
+#define STATS_NAME_LEN 20
+/* Rating a player starts with. */
+#define STATS_RATING_START 1200
+
+/* How often the writer thread applies queued results. */
+#ifndef STATS_FLUSH_MS
+    #define STATS_FLUSH_MS 200
+#endif
+
+/* Write-ahead log size that triggers a checkpoint of the table. */
+#ifndef STATS_CHECKPOINT_BYTES
+    #define STATS_CHECKPOINT_BYTES (4 << 20)
+#endif
+
+#define STATS_RING_SIZE 16384
+#define STATS_INITIAL_CAPACITY 1024
+
+/***
+A player's record. This is also the on-disk layout of a table slot and
+of a write-ahead log entry, so it has no padding and a fixed size.
+***/
+struct player_stats {
+    char name[STATS_NAME_LEN];
+    uint32_t wins;
+    uint32_t losses;
+    uint32_t matches;
+    int32_t rating;
+    uint32_t reserved;
+    uint64_t damage;
+};
+
+void stats_open(const char *path);
+void stats_close(void);
+int stats_lookup(const char *name, struct player_stats *out);
+int stats_submit(const char *winner, int winner_damage, int winner_rating, const char *loser, int loser_damage, int loser_rating);
+uint64_t stats_records(void);
+uint64_t stats_dropped(void);
+
+#endif
@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tourney.h"
+
+/***
+Tournament brackets and pairings, without any sockets, so the server only
+has to seat the players of each pairing and report who won.
+Single elimination seeds the entrants by rating into a bracket whose size
+is the next power of two, the top seeds getting the byes, and the winners
+of each round meet in bracket order. A Swiss tournament plays enough
+rounds to single out a winner; each round pairs players on the same score,
+best rated first, with people they have not played yet, and the lowest
+ranked player without one gets a bye when the count is odd.
+***/
+
+/***
+Starts an empty tournament.
+struct tourney *t -> Tournament being set up
+enum tourney_format format -> Single elimination or Swiss
+***/
+void tourney_init(struct tourney *t, enum tourney_format format) {
+    memset(t, 0, sizeof(*t));
+    t->format = format;
+}
+
+/***
+Frees everything a tournament holds and leaves it empty.
+struct tourney *t -> Tournament
+***/
+void tourney_free(struct tourney *t) {
+    enum tourney_format format = t->format;
+    free(t->entrants);
+    free(t->pairs);
+    free(t->bracket);
+    tourney_init(t, format);
+}
+
+/***
+Adds an entrant. Only before the first round.
+struct tourney *t -> Tournament
+const char *name -> Their name
+int rating -> Their rating, for seeding
+void *client -> Caller's handle for them
+Return -> Their entry number
+***/
+int tourney_enter(struct tourney *t, const char *name, int rating, void *client) {
+    struct entrant *e;
+    if (t->count == t->capacity) {
+        t->capacity = t->capacity ? t->capacity * 2 : 64;
+        t->entrants = (struct entrant *)realloc(t->entrants, t->capacity * sizeof(struct entrant));
+        if (t->entrants == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    e = &t->entrants[t->count];
+    memset(e, 0, sizeof(*e));
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    e->rating = rating;
+    e->client = client;
+    return t->count++;
+}
+
+/***
+Takes an entrant out for good. A pairing of theirs still being played
+must have had its result reported first.
+struct tourney *t -> Tournament
+int entry -> Entry number from tourney_enter
+***/
+void tourney_withdraw(struct tourney *t, int entry) {
+    t->entrants[entry].out = 1;
+    t->entrants[entry].client = NULL;
+}
+
+/***
+Counts the entrants who can still be paired.
+const struct tourney *t -> Tournament
+Return -> Entrants neither knocked out nor gone
+***/
+int tourney_active(const struct tourney *t) {
+    int i, n = 0;
+    for (i = 0; i < t->count; i++) {
+        n += !t->entrants[i].out;
+    }
+    return n;
+}
+
+/* The tournament being sorted by ranked_before; qsort passes no context. */
+static const struct tourney *ranking;
+
+/***
+Orders entry numbers best first: higher score, then higher rating, then
+whoever entered first.
+const void *a -> An entry number
+const void *b -> Another entry number
+Return -> Negative if a ranks first, positive if b does
+***/
+static int ranked_before(const void *a, const void *b) {
+    const struct entrant *x = &ranking->entrants[*(const int *)a];
+    const struct entrant *y = &ranking->entrants[*(const int *)b];
+    if (x->score != y->score) {
+        return y->score - x->score;
+    }
+    if (x->rating != y->rating) {
+        return y->rating - x->rating;
+    }
+    return *(const int *)a - *(const int *)b;
+}
+
+/***
+Lists the entrants still in, best ranked first.
+struct tourney *t -> Tournament
+int *out -> Room for t->count entry numbers
+Return -> How many were listed
+***/
+static int rank_active(struct tourney *t, int *out) {
+    int i, n = 0;
+    for (i = 0; i < t->count; i++) {
+        if (!t->entrants[i].out) {
+            out[n++] = i;
+        }
+    }
+    ranking = t;
+    qsort(out, n, sizeof(int), ranked_before);
+    return n;
+}
+
+/***
+Seeds the entrants into a bracket: seed 1 and 2 can only meet in the
+final, and so on down, with the empty places, which are byes, falling to
+the top seeds.
+struct tourney *t -> Tournament about to play its first round
+***/
+static void seed_bracket(struct tourney *t) {
+    int *seeds = (int *)malloc((t->count + 1) * sizeof(int));
+    int n, size = 1, len, i;
+    if (seeds == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    n = rank_active(t, seeds);
+    while (size < n) {
+        size *= 2;
+        t->rounds++;
+    }
+    t->bracket = (int *)malloc(size * sizeof(int));
+    if (t->bracket == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    /* Seed order for a bracket twice as big: each seed s meets 2 * len - 1 - s first. */
+    t->bracket[0] = 0;
+    for (len = 1; len < size; len *= 2) {
+        for (i = len - 1; i >= 0; i--) {
+            t->bracket[2 * i] = t->bracket[i];
+            t->bracket[2 * i + 1] = 2 * len - 1 - t->bracket[i];
+        }
+    }
+    for (i = 0; i < size; i++) {
+        t->bracket[i] = t->bracket[i] < n ? seeds[t->bracket[i]] : -1;
+    }
+    t->bracket_len = size;
+    free(seeds);
+}
+
+/***
+Makes room for a round's pairings.
+struct tourney *t -> Tournament
+int n -> Pairings needed
+***/
+static void reserve_pairs(struct tourney *t, int n) {
+    free(t->pairs);
+    t->pairs = (struct pairing *)malloc((n > 0 ? n : 1) * sizeof(struct pairing));
+    if (t->pairs == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    t->npairs = 0;
+    t->pending = 0;
+}
+
+/***
+Adds a pairing to the round being drawn. A bye is decided on the spot.
+struct tourney *t -> Tournament
+int a -> An entrant, or -1
+int b -> Their opponent, or -1
+***/
+static void add_pair(struct tourney *t, int a, int b) {
+    struct pairing *p = &t->pairs[t->npairs++];
+    if (a < 0) {
+        a = b;
+        b = -1;
+    }
+    p->a = a;
+    p->b = b;
+    p->winner = b < 0 ? a : -1;
+    if (b >= 0) {
+        t->pending++;
+    }
+}
+
+/***
+Draws the next knockout round from the winners of the last one.
+struct tourney *t -> Tournament
+***/
+static void draw_knockout(struct tourney *t) {
+    int i;
+    if (t->round > 1) {
+        for (i = 0; i < t->npairs; i++) {
+            t->bracket[i] = t->pairs[i].winner;
+        }
+        t->bracket_len = t->npairs;
+    }
+    reserve_pairs(t, t->bracket_len / 2);
+    for (i = 0; i < t->bracket_len; i += 2) {
+        int a = t->bracket[i], b = t->bracket[i + 1];
+        add_pair(t, a >= 0 && !t->entrants[a].out ? a : -1, b >= 0 && !t->entrants[b].out ? b : -1);
+    }
+}
+
+/***
+Tells whether two entrants of a Swiss tournament have played each other.
+const struct tourney *t -> Tournament
+int a -> An entrant
+int b -> Another entrant
+Return -> 1 if they met in an earlier round
+***/
+static int have_met(const struct tourney *t, int a, int b) {
+    int r;
+    for (r = 0; r < t->round - 1; r++) {
+        if (t->entrants[a].met[r] == b) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/***
+Draws a Swiss round. Going down the ranking, everyone unpaired gets the
+next unpaired player below them they have not met, or the next unpaired
+one at all if there is no such player.
+struct tourney *t -> Tournament
+***/
+static void draw_swiss(struct tourney *t) {
+    int *order = (int *)malloc((t->count + 1) * sizeof(int));
+    int n, i, j, pick;
+    if (order == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    n = rank_active(t, order);
+    reserve_pairs(t, n / 2 + 1);
+    if (n % 2 == 1) {
+        for (i = n - 1; i > 0 && t->entrants[order[i]].had_bye; i--) {
+        }
+        t->entrants[order[i]].had_bye = 1;
+        t->entrants[order[i]].score++;
+        t->entrants[order[i]].met[t->round - 1] = -1;
+        add_pair(t, order[i], -1);
+        memmove(order + i, order + i + 1, (n - i - 1) * sizeof(int));
+        n--;
+    }
+    for (i = 0; i < n; i++) {
+        if (order[i] < 0) {
+            continue;
+        }
+        pick = -1;
+        for (j = i + 1; j < n; j++) {
+            if (order[j] < 0) {
+                continue;
+            }
+            if (pick < 0) {
+                pick = j;
+            }
+            if (!have_met(t, order[i], order[j])) {
+                pick = j;
+                break;
+            }
+        }
+        t->entrants[order[i]].met[t->round - 1] = order[pick];
+        t->entrants[order[pick]].met[t->round - 1] = order[i];
+        add_pair(t, order[i], order[pick]);
+        order[pick] = -1;
+    }
+    free(order);
+}
+
+/***
+Draws the next round. Before the first one the bracket is seeded, or for
+a Swiss tournament the number of rounds is settled.
+struct tourney *t -> Tournament whose last round is over
+Return -> Number of pairings, byes included; 0 once the tournament is over
+***/
+int tourney_next_round(struct tourney *t) {
+    if (t->round == 0) {
+        if (t->format == TOURNEY_ELIMINATION) {
+            seed_bracket(t);
+        } else {
+            int n = tourney_active(t);
+            for (t->rounds = 0; (1 << t->rounds) < n && t->rounds < TOURNEY_MAX_ROUNDS; t->rounds++) {
+            }
+        }
+    }
+    if (tourney_over(t)) {
+        return 0;
+    }
+    t->round++;
+    if (t->format == TOURNEY_ELIMINATION) {
+        draw_knockout(t);
+    } else {
+        draw_swiss(t);
+    }
+    return t->npairs;
+}
+
+/***
+Records who won a pairing. In a knockout the loser is out.
+struct tourney *t -> Tournament
+int pairing -> Index into t->pairs
+int winner -> Entry number of the winner
+Return -> Matches of this round still being played
+***/
+int tourney_result(struct tourney *t, int pairing, int winner) {
+    struct pairing *p = &t->pairs[pairing];
+    if (p->winner >= 0) {
+        return t->pending;
+    }
+    p->winner = winner;
+    t->entrants[winner].score++;
+    if (t->format == TOURNEY_ELIMINATION) {
+        t->entrants[winner == p->a ? p->b : p->a].out = 1;
+    }
+    return --t->pending;
+}
+
+/***
+Tells whether a tournament has nothing left to play: its last round is
+over, or fewer than two entrants are left to play one.
+const struct tourney *t -> Tournament
+Return -> 1 if it is over
+***/
+int tourney_over(const struct tourney *t) {
+    if (t->pending > 0) {
+        return 0;
+    }
+    if (tourney_active(t) < 2) {
+        return 1;
+    }
+    return t->round > 0 && t->round >= t->rounds;
+}
+
+/***
+Finds who is on top: the last entrant standing in a knockout, the best
+ranked one still in a Swiss tournament.
+const struct tourney *t -> Tournament
+Return -> Entry number, or -1 if nobody is left
+***/
+int tourney_leader(const struct tourney *t) {
+    int i, best = -1;
+    for (i = 0; i < t->count; i++) {
+        const struct entrant *e = &t->entrants[i];
+        if (e->out || (best >= 0 && (e->score < t->entrants[best].score ||
+            (e->score == t->entrants[best].score && e->rating <= t->entrants[best].rating)))) {
+            continue;
+        }
+        best = i;
+    }
+    return best;
+}
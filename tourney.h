@@ -0,0 +1,63 @@
+#ifndef TOURNEY_H
+#define TOURNEY_H
+
+/* Longest name plus its NUL, the same as a client's name. */
+#define TOURNEY_NAME_LEN 20
+/* Most rounds a Swiss tournament is played over. */
+#define TOURNEY_MAX_ROUNDS 32
+
+enum tourney_format { TOURNEY_ELIMINATION, TOURNEY_SWISS };
+
+/***
+Someone who entered. score counts match wins, and byes in a Swiss
+tournament; out is set once they lost a knockout match or left. met holds
+who they played in each Swiss round. client is the caller's handle for
+them, NULL once they left.
+***/
+struct entrant {
+    char name[TOURNEY_NAME_LEN];
+    int rating;
+    int score;
+    int out;
+    int had_bye;
+    int met[TOURNEY_MAX_ROUNDS];
+    void *client;
+};
+
+/* One pairing of a round; b is -1 for a bye, winner -1 until decided. */
+struct pairing {
+    int a;
+    int b;
+    int winner;
+};
+
+/***
+A tournament: the entrants, the round being played and its pairings.
+For single elimination, bracket holds the entrants still in, in bracket
+order, with -1 for an empty place.
+***/
+struct tourney {
+    enum tourney_format format;
+    int rounds;
+    int round;
+    int count;
+    int capacity;
+    struct entrant *entrants;
+    int npairs;
+    int pending;
+    struct pairing *pairs;
+    int bracket_len;
+    int *bracket;
+};
+
+void tourney_init(struct tourney *t, enum tourney_format format);
+void tourney_free(struct tourney *t);
+int tourney_enter(struct tourney *t, const char *name, int rating, void *client);
+void tourney_withdraw(struct tourney *t, int entry);
+int tourney_active(const struct tourney *t);
+int tourney_next_round(struct tourney *t);
+int tourney_result(struct tourney *t, int pairing, int winner);
+int tourney_over(const struct tourney *t);
+int tourney_leader(const struct tourney *t);
+
+#endif
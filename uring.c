@@ -0,0 +1,262 @@
+#include "uring.h"
+#if URING
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/***
+The io_uring plumbing for the shards, on the raw io_uring_setup,
+io_uring_enter and io_uring_register calls. Submissions are queued in the
+mapped submission ring and only handed to the kernel by uring_wait, so
+everything a shard queues in one loop iteration goes in with the call that
+waits for the next completions. Completions are read straight from the
+mapped completion ring.
+Rings are set up with SINGLE_ISSUER and DEFER_TASKRUN, so completion work
+only runs when the owning thread asks for events, and with CQSIZE so a
+burst of multishot completions has room. Receive buffers come from one
+provided buffer ring; a buffer a completion pointed at belongs to the
+caller until uring_recycle puts it back.
+***/
+
+/* Completion ring entries per submission ring entry. */
+#define URING_CQ_FACTOR 4
+
+/***
+Maps a new ring. Fails on kernels without the features the shards rely
+on: DEFER_TASKRUN is refused before 6.1, which also brought multishot
+receive, and a single mmap and the extended wait argument are checked.
+struct uring *r -> Ring being set up
+unsigned entries -> Submission ring size, a power of two
+Return -> 0 on success, -1 with errno set otherwise
+***/
+static int map_rings(struct uring *r, unsigned entries) {
+    struct io_uring_params p;
+    unsigned i;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = entries * URING_CQ_FACTOR;
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        return -1;
+    }
+    if ((p.features & (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG)) != (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG)) {
+        close(r->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    r->rings_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > r->rings_size) {
+        r->rings_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    }
+    r->rings = mmap(NULL, r->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->rings == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        munmap(r->rings, r->rings_size);
+        close(r->fd);
+        return -1;
+    }
+    r->sq_head = (unsigned *)((char *)r->rings + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->rings + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)((char *)r->rings + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_local_tail = *r->sq_tail;
+    r->cq_head = (unsigned *)((char *)r->rings + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->rings + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)((char *)r->rings + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->rings + p.cq_off.cqes);
+    /* Slot i of the submission ring always holds entry i. */
+    for (i = 0; i < p.sq_entries; i++) {
+        ((unsigned *)((char *)r->rings + p.sq_off.array))[i] = i;
+    }
+    return 0;
+}
+
+/***
+Tells whether this kernel can run a shard on io_uring, by setting up and
+tearing down a small ring.
+Return -> 1 if it can, 0 if not
+***/
+int uring_supported(void) {
+    struct uring r;
+    if (uring_init(&r, 8, 8, 64) < 0) {
+        return 0;
+    }
+    uring_close(&r);
+    return 1;
+}
+
+/***
+Sets up a ring and its provided receive buffers, all of them handed to
+the kernel.
+struct uring *r -> Ring being set up
+unsigned entries -> Submission ring size, a power of two
+int nbufs -> Receive buffers, a power of two up to 32768
+int buf_size -> Bytes in each receive buffer
+Return -> 0 on success, -1 with errno set otherwise
+***/
+int uring_init(struct uring *r, unsigned entries, int nbufs, int buf_size) {
+    struct io_uring_buf_reg reg;
+    int i, saved;
+    memset(r, 0, sizeof(*r));
+    if (map_rings(r, entries) < 0) {
+        return -1;
+    }
+    r->buf_count = nbufs;
+    r->buf_size = buf_size;
+    r->buf_ring_size = nbufs * sizeof(struct io_uring_buf);
+    r->buf_ring = (struct io_uring_buf_ring *)mmap(NULL, r->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->buf_ring == MAP_FAILED) {
+        r->buf_ring = NULL;
+        goto fail;
+    }
+    if ((r->buf_data = (char *)malloc((size_t)nbufs * buf_size)) == NULL) {
+        goto fail;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)r->buf_ring;
+    reg.ring_entries = nbufs;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        goto fail;
+    }
+    for (i = 0; i < nbufs; i++) {
+        uring_recycle(r, i);
+    }
+    return 0;
+fail:
+    saved = errno;
+    uring_close(r);
+    errno = saved;
+    return -1;
+}
+
+/***
+Tears a ring down. Requests still in flight are cancelled by the kernel.
+struct uring *r -> Ring from uring_init
+***/
+void uring_close(struct uring *r) {
+    if (r->buf_ring != NULL) {
+        munmap(r->buf_ring, r->buf_ring_size);
+    }
+    free(r->buf_data);
+    munmap(r->sqes, r->sqes_size);
+    munmap(r->rings, r->rings_size);
+    close(r->fd);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+/***
+Hands the queued submissions to the kernel, waiting for nothing.
+struct uring *r -> Ring
+***/
+static void submit(struct uring *r) {
+    unsigned pending;
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    pending = r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    r->enters++;
+    if (syscall(__NR_io_uring_enter, r->fd, pending, 0, 0, NULL, 0) < 0 && errno != EINTR && errno != EBUSY) {
+        perror("io_uring_enter");
+    }
+}
+
+/***
+Gets a cleared submission entry to fill in. When the submission ring is
+full what is queued is submitted first, so this never fails.
+struct uring *r -> Ring
+Return -> The entry, submitted by the next uring_wait
+***/
+struct io_uring_sqe *uring_sqe(struct uring *r) {
+    struct io_uring_sqe *sqe;
+    while (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+        submit(r);
+    }
+    sqe = &r->sqes[r->sq_local_tail & r->sq_mask];
+    r->sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/***
+Submits everything queued and waits, in the same system call, until at
+least one completion is ready or the timeout passes.
+struct uring *r -> Ring
+int timeout_ms -> Longest wait; -1 waits for a completion, 0 does not wait
+Return -> 0 on success or timeout, -1 with errno set on failure
+***/
+int uring_wait(struct uring *r, int timeout_ms) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned pending;
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    pending = r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    memset(&arg, 0, sizeof(arg));
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    r->enters++;
+    if (syscall(__NR_io_uring_enter, r->fd, pending, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0) {
+        if (errno == ETIME || errno == EINTR || errno == EBUSY) {
+            return 0;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/***
+Looks at the oldest completion without consuming it.
+struct uring *r -> Ring
+Return -> The completion, or NULL if none is ready
+***/
+struct io_uring_cqe *uring_peek(struct uring *r) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &r->cqes[head & r->cq_mask];
+}
+
+/***
+Consumes the completion uring_peek returned.
+struct uring *r -> Ring
+***/
+void uring_seen(struct uring *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/***
+Finds the bytes of a provided buffer a completion named.
+struct uring *r -> Ring
+int bid -> Buffer id from the completion's flags
+Return -> Start of the buffer
+***/
+char *uring_buf(struct uring *r, int bid) {
+    return r->buf_data + (size_t)bid * r->buf_size;
+}
+
+/***
+Gives a provided buffer back to the kernel for later receives.
+struct uring *r -> Ring
+int bid -> Buffer id
+***/
+void uring_recycle(struct uring *r, int bid) {
+    struct io_uring_buf *b = &r->buf_ring->bufs[r->buf_tail & (r->buf_count - 1)];
+    b->addr = (uint64_t)(uintptr_t)uring_buf(r, bid);
+    b->len = r->buf_size;
+    b->bid = (unsigned short)bid;
+    r->buf_tail++;
+    __atomic_store_n(&r->buf_ring->tail, r->buf_tail, __ATOMIC_RELEASE);
+}
+#endif
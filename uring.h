@@ -0,0 +1,58 @@
+#ifndef URING_H
+#define URING_H
+
+/* Build the io_uring backend; 0 leaves only epoll. */
+#ifndef URING
+    #define URING 1
+#endif
+
+#if URING
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/* Buffer group the provided receive buffers are registered as. */
+#define URING_BGID 0
+
+/***
+An io_uring driven with the raw system calls, without liburing: the
+submission and completion rings, mapped once, and one ring of provided
+buffers that multishot receives pick their buffers from. Only the thread
+that set it up may use it.
+***/
+struct uring {
+    int fd;
+    void *rings;
+    size_t rings_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *buf_data;
+    int buf_count;
+    int buf_size;
+    unsigned short buf_tail;
+    uint64_t enters;
+};
+
+int uring_supported(void);
+int uring_init(struct uring *r, unsigned entries, int nbufs, int buf_size);
+void uring_close(struct uring *r);
+struct io_uring_sqe *uring_sqe(struct uring *r);
+int uring_wait(struct uring *r, int timeout_ms);
+struct io_uring_cqe *uring_peek(struct uring *r);
+void uring_seen(struct uring *r);
+char *uring_buf(struct uring *r, int bid);
+void uring_recycle(struct uring *r, int bid);
+#endif
+
+#endif